@@ -1,12 +1,62 @@
 #ifndef LEAF_CONFIG_H
 #define LEAF_CONFIG_H
 
+#include <cstdint>
 #include <filesystem>
 
 namespace leaf
 {
 constexpr auto kBlockSize = 128 * 1024;
 constexpr auto kHashBlockSize = 10 * kBlockSize;
+// login 协商的上下限
+constexpr auto kProtocolVersion = 5;
+constexpr auto kPipelineProtocolVersion = 2;    // 支持多文件流水线上传
+constexpr auto kRangeProtocolVersion = 3;       // 支持大文件分段多连接传输
+constexpr auto kDedupProtocolVersion = 4;       // 支持内容分块去重上传
+constexpr auto kBatchProtocolVersion = 5;       // 支持小文件批量上传
+constexpr auto kMaxPipelineFiles = 16;           // 流水线模式下同时在途的文件数
+constexpr auto kReadAheadBlocks = 4;             // 上传预读队列中的块数
+constexpr auto kReceiveQueueBlocks = 8;          // 服务端每个连接在校验/写盘阶段中的块数
+constexpr auto kDiskThreads = 4;                 // 磁盘读写线程数
+constexpr auto kMetadataThreads = 4;             // 文件元数据操作线程数
+constexpr auto kMetadataStrands = 64;            // 元数据操作按用户散列到的串行队列数
+constexpr auto kMinBlockSize = 16 * 1024;
+constexpr auto kMaxBlockSize = 1024 * 1024;
+constexpr auto kMaxHashBlockSize = 16 * kMaxBlockSize;
+constexpr auto kMaxWindow = 16;
+constexpr uint64_t kWriteBatchSize = 4ULL * kMaxBlockSize;    // 服务端合并连续块一次写盘的上限
+constexpr uint64_t kPreallocateMaxSize = 4096ULL * kMaxBlockSize;    // 上传文件预分配的上限, 更大的文件按写入分配
+constexpr auto kDirectIoAlignment = 4096;                     // O_DIRECT 读写的偏移/长度/内存对齐
+constexpr uint64_t kBlockCacheSize = 256ULL * 1024 * 1024;    // 服务端下载块缓存的默认内存上限
+constexpr auto kBlockCacheShards = 64;                         // 块缓存分片数, 每个分片独立加锁
+constexpr auto kBlockCacheSeen = 4096;                         // 每个分片记住的只访问过一次的块数
+constexpr uint64_t kRangeSize = 64ULL * kMaxBlockSize;    // 大于该值的文件按分段并行传输
+constexpr auto kRangeConnections = 4;                     // 分段传输使用的连接数
+constexpr auto kRangeRetries = 3;                         // 单个分段失败后重新排队的次数上限
+constexpr auto kRangeStateInterval = 1000;                // 分段断点合并写入 .state 文件的间隔, 毫秒
+constexpr auto kRangeIdleTimeout = 600;                   // 分段上传空闲超过该秒数后从内存移除, 断点仍在 .state 文件中
+constexpr uint64_t kResumeSize = 16ULL * kMaxBlockSize;   // 不小于该值的文件等待响应中的断点再发送数据
+// 秒传, 发送数据前先比较整个文件的摘要, 客户端计算摘要需要多读一遍文件
+// 服务端登记所有不小于 kInstantSize 的上传, 分段上传在后台补建清单时登记, 客户端只对不超过 kInstantMaxSize 的文件查询
+constexpr uint64_t kInstantSize = 4ULL * kMaxBlockSize;
+// 摘要在发送请求前算完, 期间流水线不发送其他文件的数据, 上限不宜过大
+constexpr uint64_t kInstantMaxSize = 4ULL * kRangeSize;
+// 内容分块去重, 分块边界只与内容有关
+constexpr auto kChunkMinSize = 16 * 1024;
+constexpr auto kChunkAvgSize = 64 * 1024;
+constexpr auto kChunkMaxSize = 256 * 1024;
+constexpr auto kChunkBatch = 1024;    // 每个 chunk_offer 携带的分块数
+// 小文件批量上传, 一批文件的数据在内存中拼接
+constexpr uint64_t kBatchFileSize = 256 * 1024;           // 不大于该值的文件参与批量上传
+constexpr uint64_t kBatchSize = 4ULL * kMaxBlockSize;     // 每批数据总大小上限
+constexpr auto kBatchFiles = 1024;                        // 每批文件数上限
+// 持久模式下上传完成的组提交, 时间窗口内的文件一起 fdatasync/改名/目录 fsync
+constexpr auto kGroupCommitWindow = 5;      // 毫秒
+constexpr auto kGroupCommitFiles = 1024;    // 达到该文件数立即提交
+// 上传完成后生成的摘要清单, 续传校验和下载的块摘要直接查表
+constexpr uint64_t kManifestBlockSize = 4ULL * kMaxBlockSize;    // 与客户端默认的摘要块大小一致
+constexpr uint64_t kManifestCheckpoint = kMaxBlockSize;          // 前缀摘要间隔, 客户端续传断点按此对齐
+constexpr uint64_t kManifestMinSize = kResumeSize;               // 小文件续传直接计算摘要
 static auto kDefaultDir = std::filesystem::temp_directory_path().string();
 constexpr auto kKB = 1024ULL;
 constexpr auto kMB = 1024 * kKB;
@@ -14,6 +64,10 @@ constexpr auto kReadWsLimited = 1 * kMB;
 constexpr auto kWriteWsLimited = 1 * kMB;
 constexpr auto kTmpFilenameSuffix = ".tmp";
 constexpr auto kLeafFilenameSuffix = ".leaf";
+constexpr auto kStateFilenameSuffix = ".state";          // 未完成上传的断点状态
+constexpr auto kManifestFilenameSuffix = ".manifest";    // .leaf 文件的摘要清单
+constexpr auto kChunkStoreDir = ".chunks";          // 服务端分块仓库, 在 kDefaultDir 下
+constexpr auto kDigestIndexDir = ".digests";        // 服务端整个文件的摘要索引, 在 kDefaultDir 下
 
 }    // namespace leaf
 
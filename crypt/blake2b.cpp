@@ -1,10 +1,13 @@
 #include <vector>
 #include <string>
+#include <algorithm>
 #include <sodium.h>
 #include <boost/algorithm/hex.hpp>
 
 #include "blake2b.h"
 
+static_assert(leaf::blake2b::kDigestSize == crypto_generichash_BYTES_MAX);
+
 namespace leaf
 {
 class blake2b::blake2b_impl
@@ -23,6 +26,22 @@ class blake2b::blake2b_impl
 
     std::vector<uint8_t> bytes() { return std::vector<uint8_t>{bytes_, bytes_ + crypto_generichash_BYTES_MAX}; }
 
+    blake2b::digest raw() const
+    {
+        blake2b::digest d;
+        std::copy(bytes_, bytes_ + crypto_generichash_BYTES_MAX, d.begin());
+        return d;
+    }
+
+    bool equal(std::span<const uint8_t> other) const
+    {
+        if (other.size() != crypto_generichash_BYTES_MAX)
+        {
+            return false;
+        }
+        return sodium_memcmp(bytes_, other.data(), crypto_generichash_BYTES_MAX) == 0;
+    }
+
     void update(const void* buffer, uint32_t buffer_len)
     {
         if (buffer == nullptr || buffer_len == 0)
@@ -34,6 +53,14 @@ class blake2b::blake2b_impl
 
     void final() { crypto_generichash_final(&state_, bytes_, crypto_generichash_BYTES_MAX); }
 
+    blake2b::digest peek() const
+    {
+        auto state = state_;
+        blake2b::digest d;
+        crypto_generichash_final(&state, d.data(), crypto_generichash_BYTES_MAX);
+        return d;
+    }
+
    private:
     crypto_generichash_state state_;
     unsigned char bytes_[crypto_generichash_BYTES_MAX] = {0};
@@ -51,7 +78,13 @@ void blake2b::reset()
 }
 std::vector<uint8_t> blake2b::bytes() { return impl->bytes(); }
 
+blake2b::digest blake2b::raw() const { return impl->raw(); }
+
+bool blake2b::equal(std::span<const uint8_t> other) const { return impl->equal(other); }
+
 void blake2b::update(const void* buffer, uint32_t buffer_len) { impl->update(buffer, buffer_len); }
 
 void blake2b::final() { impl->final(); }
+
+blake2b::digest blake2b::peek() const { return impl->peek(); }
 }    // namespace leaf
@@ -1,6 +1,8 @@
 #ifndef LEAF_CRYPT_BLAKE2B_H
 #define LEAF_CRYPT_BLAKE2B_H
 
+#include <span>
+#include <array>
 #include <vector>
 #include <cstdint>
 #include <string>
@@ -9,6 +11,10 @@ namespace leaf
 {
 class blake2b
 {
+   public:
+    static constexpr std::size_t kDigestSize = 64;
+    using digest = std::array<uint8_t, kDigestSize>;
+
    public:
     blake2b();
     ~blake2b();
@@ -17,8 +23,14 @@ class blake2b
     std::string hex();
     void reset();
     std::vector<uint8_t> bytes();
+    // final 之后的原始摘要, 不做 hex 转换
+    digest raw() const;
+    // 与原始摘要做常量时间比较, 长度不符直接返回 false
+    bool equal(std::span<const uint8_t> other) const;
     void update(const void* buffer, uint32_t buffer_len);
     void final();
+    // 当前已输入数据的摘要, 不影响继续 update
+    digest peek() const;
 
    private:
     class blake2b_impl;
@@ -0,0 +1,132 @@
+#include <sys/stat.h>
+#include <algorithm>
+#include <functional>
+#include "file/block_cache.h"
+
+namespace leaf
+{
+block_cache& block_cache::instance()
+{
+    static block_cache instance;
+    return instance;
+}
+
+std::optional<block_cache::file_key> block_cache::key_of(const std::string& path)
+{
+    struct stat st = {};
+    if (::stat(path.c_str(), &st) != 0)
+    {
+        return {};
+    }
+    file_key key;
+    key.path = path;
+    key.inode = static_cast<uint64_t>(st.st_ino);
+    key.size = static_cast<uint64_t>(st.st_size);
+#ifdef __linux__
+    key.mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#else
+    key.mtime = static_cast<int64_t>(st.st_mtime);
+#endif
+    return key;
+}
+
+std::size_t block_cache::entry_key_hash::operator()(const entry_key& k) const
+{
+    std::size_t h = std::hash<std::string>{}(k.file.path);
+    for (uint64_t v : {k.file.inode, k.file.size, static_cast<uint64_t>(k.file.mtime), k.start, k.end, static_cast<uint64_t>(k.digest)})
+    {
+        h ^= std::hash<uint64_t>{}(v) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    }
+    return h;
+}
+
+block_cache::block block_cache::find(const entry_key& key)
+{
+    auto& s = shards_[entry_key_hash{}(key) % shards_.size()];
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.index.find(key);
+    if (it == s.index.end())
+    {
+        return nullptr;
+    }
+    s.lru.splice(s.lru.begin(), s.lru, it->second);
+    return it->second->second;
+}
+
+void block_cache::put(entry_key key, block data)
+{
+    auto& s = shards_[entry_key_hash{}(key) % shards_.size()];
+    auto capacity = capacity_.load() / shards_.size();
+    if (data == nullptr || data->size() > capacity)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.index.find(key);
+    if (it != s.index.end())
+    {
+        s.lru.splice(s.lru.begin(), s.lru, it->second);
+        return;
+    }
+    s.size += data->size();
+    s.lru.emplace_front(key, std::move(data));
+    s.index.emplace(std::move(key), s.lru.begin());
+    while (s.size > capacity)
+    {
+        auto& last = s.lru.back();
+        s.size -= last.second->size();
+        s.index.erase(last.first);
+        s.lru.pop_back();
+    }
+}
+
+block_cache::block block_cache::find_block(const file_key& file, uint64_t offset, uint64_t size)
+{
+    return find(entry_key{file, offset, offset + size, false});
+}
+
+bool block_cache::admit_block(const file_key& file, uint64_t offset, uint64_t size)
+{
+    auto h = entry_key_hash{}(entry_key{file, offset, offset + size, false});
+    auto& s = shards_[h % shards_.size()];
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.seen_index.find(h);
+    if (it != s.seen_index.end())
+    {
+        s.seen.erase(it->second);
+        s.seen_index.erase(it);
+        return true;
+    }
+    s.seen.push_front(h);
+    s.seen_index.emplace(h, s.seen.begin());
+    if (s.seen.size() > kBlockCacheSeen)
+    {
+        s.seen_index.erase(s.seen.back());
+        s.seen.pop_back();
+    }
+    return false;
+}
+
+void block_cache::put_block(const file_key& file, uint64_t offset, block data)
+{
+    auto size = data != nullptr ? data->size() : 0;
+    put(entry_key{file, offset, offset + size, false}, std::move(data));
+}
+
+std::optional<leaf::blake2b::digest> block_cache::find_digest(const file_key& file, uint64_t start, uint64_t end)
+{
+    auto data = find(entry_key{file, start, end, true});
+    if (data == nullptr || data->size() != leaf::blake2b::kDigestSize)
+    {
+        return {};
+    }
+    leaf::blake2b::digest digest;
+    std::copy(data->begin(), data->end(), digest.begin());
+    return digest;
+}
+
+void block_cache::put_digest(const file_key& file, uint64_t start, uint64_t end, const leaf::blake2b::digest& digest)
+{
+    put(entry_key{file, start, end, true}, std::make_shared<const std::vector<uint8_t>>(digest.begin(), digest.end()));
+}
+}    // namespace leaf
@@ -0,0 +1,85 @@
+#ifndef LEAF_FILE_BLOCK_CACHE_H
+#define LEAF_FILE_BLOCK_CACHE_H
+
+#include <list>
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include "crypt/blake2b.h"
+#include "config/config.h"
+
+namespace leaf
+{
+// 服务端共享的下载块缓存, 多个客户端下载同一个文件时只读一次磁盘, 摘要只计算一次
+// 按 key 散列到多个分片, 每个分片独立加锁和 LRU 淘汰, 不同执行器线程之间基本没有竞争
+class block_cache
+{
+   public:
+    // 文件被覆盖后 inode/修改时间变化, 旧的缓存不再命中, 由 LRU 淘汰
+    struct file_key
+    {
+        std::string path;
+        uint64_t inode = 0;
+        uint64_t size = 0;
+        int64_t mtime = 0;
+        bool operator==(const file_key&) const = default;
+    };
+    using block = std::shared_ptr<const std::vector<uint8_t>>;
+
+   public:
+    static block_cache& instance();
+
+   public:
+    // 内存上限, 0 表示关闭
+    void set_capacity(uint64_t bytes) { capacity_ = bytes; }
+    [[nodiscard]] bool enabled() const { return capacity_ != 0; }
+    static std::optional<file_key> key_of(const std::string& path);
+
+    block find_block(const file_key& file, uint64_t offset, uint64_t size);
+    // 第一次访问只记下块的位置, 第二次访问才值得复制进缓存, 一次性的顺序扫描不会冲掉 LRU
+    bool admit_block(const file_key& file, uint64_t offset, uint64_t size);
+    void put_block(const file_key& file, uint64_t offset, block data);
+    // 摘要块 [start, end) 的原始摘要
+    std::optional<leaf::blake2b::digest> find_digest(const file_key& file, uint64_t start, uint64_t end);
+    void put_digest(const file_key& file, uint64_t start, uint64_t end, const leaf::blake2b::digest& digest);
+
+   private:
+    struct entry_key
+    {
+        file_key file;
+        uint64_t start = 0;
+        uint64_t end = 0;
+        bool digest = false;
+        bool operator==(const entry_key&) const = default;
+    };
+    struct entry_key_hash
+    {
+        std::size_t operator()(const entry_key& k) const;
+    };
+    struct shard
+    {
+        std::mutex mutex;
+        std::list<std::pair<entry_key, block>> lru;    // 最近使用的在前
+        std::unordered_map<entry_key, std::list<std::pair<entry_key, block>>::iterator, entry_key_hash> index;
+        uint64_t size = 0;
+        std::list<std::size_t> seen;    // 只访问过一次的块的散列, 最近的在前
+        std::unordered_map<std::size_t, std::list<std::size_t>::iterator> seen_index;
+    };
+
+   private:
+    block find(const entry_key& key);
+    void put(entry_key key, block data);
+
+   private:
+    std::atomic<uint64_t> capacity_ = kBlockCacheSize;
+    std::array<shard, kBlockCacheShards> shards_;
+};
+}    // namespace leaf
+
+#endif
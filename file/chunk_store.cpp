@@ -0,0 +1,127 @@
+#include <filesystem>
+#include <boost/asio/error.hpp>
+#include <boost/algorithm/hex.hpp>
+#include "log/log.h"
+#include "file/file.h"
+#include "config/config.h"
+#include "crypt/blake2b.h"
+#include "file/chunk_store.h"
+
+namespace leaf
+{
+chunk_store::chunk_store(std::string root) : root_(std::move(root)) {}
+
+chunk_store& chunk_store::instance()
+{
+    static chunk_store instance(std::filesystem::path(leaf::kDefaultDir).append(kChunkStoreDir).string());
+    return instance;
+}
+
+std::string chunk_store::path(std::span<const uint8_t> digest) const
+{
+    std::string hex;
+    boost::algorithm::hex_lower(digest.begin(), digest.end(), std::back_inserter(hex));
+    return std::filesystem::path(root_).append(hex.substr(0, 2)).append(hex).string();
+}
+
+bool chunk_store::contains(std::span<const uint8_t> digest) const
+{
+    std::error_code ec;
+    return std::filesystem::exists(path(digest), ec);
+}
+
+boost::system::error_code chunk_store::put(std::span<const uint8_t> digest, std::span<const uint8_t> data)
+{
+    auto chunk_path = path(digest);
+    std::error_code fs_ec;
+    if (std::filesystem::exists(chunk_path, fs_ec))
+    {
+        return {};
+    }
+    std::filesystem::create_directories(std::filesystem::path(chunk_path).parent_path(), fs_ec);
+    if (fs_ec)
+    {
+        LOG_ERROR("chunk store create dir {} error {}", chunk_path, fs_ec.message());
+        return boost::system::errc::make_error_code(boost::system::errc::io_error);
+    }
+    auto tmp_path = fmt::format("{}.{}{}", chunk_path, leaf::file_id(), kTmpFilenameSuffix);
+    leaf::file_writer writer(tmp_path);
+    auto ec = writer.open();
+    if (ec)
+    {
+        return ec;
+    }
+    auto size = writer.write_at(0, data.data(), data.size(), ec);
+    auto close_ec = writer.close();
+    if (!ec && size != data.size())
+    {
+        ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+    }
+    if (!ec)
+    {
+        ec = close_ec;
+    }
+    if (!ec)
+    {
+        std::filesystem::rename(tmp_path, chunk_path, fs_ec);
+        if (fs_ec)
+        {
+            ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+        }
+    }
+    if (ec)
+    {
+        LOG_ERROR("chunk store put {} error {}", chunk_path, ec.message());
+        std::filesystem::remove(tmp_path, fs_ec);
+    }
+    return ec;
+}
+
+std::vector<uint8_t> chunk_store::get(std::span<const uint8_t> digest, boost::system::error_code& ec) const
+{
+    auto chunk_path = path(digest);
+    std::error_code fs_ec;
+    auto size = std::filesystem::file_size(chunk_path, fs_ec);
+    if (fs_ec || size > kChunkMaxSize)
+    {
+        ec = boost::system::errc::make_error_code(boost::system::errc::no_such_file_or_directory);
+        return {};
+    }
+    std::vector<uint8_t> data(size);
+    leaf::file_reader reader(chunk_path);
+    ec = reader.open();
+    if (ec)
+    {
+        return {};
+    }
+    std::size_t read_size = 0;
+    while (read_size < data.size())
+    {
+        auto n = reader.read_at(static_cast<int64_t>(read_size), data.data() + read_size, data.size() - read_size, ec);
+        if (ec)
+        {
+            break;
+        }
+        read_size += n;
+    }
+    auto _ = reader.close();
+    if (ec == boost::asio::error::eof)
+    {
+        ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+    }
+    if (ec)
+    {
+        return {};
+    }
+    leaf::blake2b hash;
+    hash.update(data.data(), static_cast<uint32_t>(data.size()));
+    hash.final();
+    if (!hash.equal(digest))
+    {
+        LOG_ERROR("chunk store {} digest not match", chunk_path);
+        ec = boost::system::errc::make_error_code(boost::system::errc::illegal_byte_sequence);
+        return {};
+    }
+    return data;
+}
+}    // namespace leaf
@@ -0,0 +1,37 @@
+#ifndef LEAF_FILE_CHUNK_STORE_H
+#define LEAF_FILE_CHUNK_STORE_H
+
+#include <span>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <boost/system/error_code.hpp>
+
+namespace leaf
+{
+// 服务端按 blake2b 摘要保存的分块, 去重上传时已有的分块不再传输
+// 每个分块一个文件, 路径为 root/摘要前两位/摘要
+class chunk_store
+{
+   public:
+    explicit chunk_store(std::string root);
+
+   public:
+    static chunk_store& instance();
+
+   public:
+    bool contains(std::span<const uint8_t> digest) const;
+    // 先写临时文件再改名, 多个连接同时写入同一个分块也是安全的
+    boost::system::error_code put(std::span<const uint8_t> digest, std::span<const uint8_t> data);
+    // 读取时重新校验摘要, 损坏的分块返回错误
+    std::vector<uint8_t> get(std::span<const uint8_t> digest, boost::system::error_code& ec) const;
+
+   private:
+    std::string path(std::span<const uint8_t> digest) const;
+
+   private:
+    std::string root_;
+};
+}    // namespace leaf
+
+#endif
@@ -0,0 +1,116 @@
+#include <array>
+#include <algorithm>
+#include <boost/asio/error.hpp>
+#include "config/config.h"
+#include "file/chunker.h"
+
+namespace leaf
+{
+// splitmix64 生成固定的 gear 表, 客户端之间的分块边界必须一致
+static constexpr std::array<uint64_t, 256> make_gear_table()
+{
+    std::array<uint64_t, 256> table{};
+    uint64_t seed = 0;
+    for (auto& v : table)
+    {
+        seed += 0x9e3779b97f4a7c15ULL;
+        uint64_t z = seed;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        v = z ^ (z >> 31);
+    }
+    return table;
+}
+
+static constexpr auto kGear = make_gear_table();
+// 平均大小之前用更严格的掩码, 之后放宽, 分块大小集中在平均值附近
+static constexpr uint64_t kMaskS = ((1ULL << 18) - 1) << (64 - 18);
+static constexpr uint64_t kMaskL = ((1ULL << 14) - 1) << (64 - 14);
+
+chunker::chunker(leaf::reader& reader, uint64_t offset, uint64_t length)
+    : reader_(reader), offset_(offset), length_(length), buffer_(4 * kChunkMaxSize)
+{
+}
+
+std::size_t chunker::cut(const uint8_t* data, std::size_t size)
+{
+    if (size <= kChunkMinSize)
+    {
+        return size;
+    }
+    auto n = std::min<std::size_t>(size, kChunkMaxSize);
+    auto normal = std::min<std::size_t>(n, kChunkAvgSize);
+    uint64_t fp = 0;
+    std::size_t i = kChunkMinSize;
+    for (; i < normal; i++)
+    {
+        fp = (fp << 1) + kGear[data[i]];
+        if ((fp & kMaskS) == 0)
+        {
+            return i;
+        }
+    }
+    for (; i < n; i++)
+    {
+        fp = (fp << 1) + kGear[data[i]];
+        if ((fp & kMaskL) == 0)
+        {
+            return i;
+        }
+    }
+    return n;
+}
+
+void chunker::fill(boost::system::error_code& ec)
+{
+    if (end_ - begin_ >= kChunkMaxSize || read_ == length_)
+    {
+        return;
+    }
+    std::copy(buffer_.begin() + static_cast<std::ptrdiff_t>(begin_), buffer_.begin() + static_cast<std::ptrdiff_t>(end_), buffer_.begin());
+    end_ -= begin_;
+    begin_ = 0;
+    while (end_ < buffer_.size() && read_ < length_)
+    {
+        auto size = std::min<uint64_t>(buffer_.size() - end_, length_ - read_);
+        auto read_size = reader_.read_at(static_cast<int64_t>(offset_ + read_), buffer_.data() + end_, size, ec);
+        if (ec == boost::asio::error::eof)
+        {
+            // 文件比请求的范围短
+            ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+            return;
+        }
+        if (ec)
+        {
+            return;
+        }
+        end_ += read_size;
+        read_ += read_size;
+    }
+}
+
+std::vector<leaf::chunk> chunker::next(std::size_t count, boost::system::error_code& ec)
+{
+    std::vector<leaf::chunk> chunks;
+    while (chunks.size() < count)
+    {
+        fill(ec);
+        if (ec || begin_ == end_)
+        {
+            break;
+        }
+        auto size = cut(buffer_.data() + begin_, end_ - begin_);
+        leaf::chunk c;
+        c.offset = chunk_offset_;
+        c.size = static_cast<uint32_t>(size);
+        leaf::blake2b hash;
+        hash.update(buffer_.data() + begin_, c.size);
+        hash.final();
+        c.digest = hash.raw();
+        chunks.push_back(c);
+        begin_ += size;
+        chunk_offset_ += size;
+    }
+    return chunks;
+}
+}    // namespace leaf
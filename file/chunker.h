@@ -0,0 +1,45 @@
+#ifndef LEAF_FILE_CHUNKER_H
+#define LEAF_FILE_CHUNKER_H
+
+#include <vector>
+#include <cstdint>
+#include <boost/system/error_code.hpp>
+#include "file/file.h"
+#include "crypt/blake2b.h"
+
+namespace leaf
+{
+struct chunk
+{
+    uint64_t offset = 0;    // 相对分段起点
+    uint32_t size = 0;
+    leaf::blake2b::digest digest{};
+};
+
+// 基于 gear 哈希的内容分块 (FastCDC), 插入或删除数据只影响附近的分块边界
+class chunker
+{
+   public:
+    chunker(leaf::reader& reader, uint64_t offset, uint64_t length);
+
+   public:
+    // 读取下一批分块并计算摘要, 返回空表示分段结束
+    std::vector<leaf::chunk> next(std::size_t count, boost::system::error_code& ec);
+
+   private:
+    void fill(boost::system::error_code& ec);
+    static std::size_t cut(const uint8_t* data, std::size_t size);
+
+   private:
+    leaf::reader& reader_;
+    uint64_t offset_ = 0;
+    uint64_t length_ = 0;
+    uint64_t read_ = 0;
+    uint64_t chunk_offset_ = 0;
+    std::size_t begin_ = 0;
+    std::size_t end_ = 0;
+    std::vector<uint8_t> buffer_;
+};
+}    // namespace leaf
+
+#endif
@@ -5,8 +5,10 @@
 #include "file/file.h"
 #include "crypt/easy.h"
 #include "config/config.h"
+#include "net/buffer.h"
 #include "net/exception.h"
 #include "protocol/codec.h"
+#include "file/metadata_executor.h"
 #include "file/cotrol_file_handle.h"
 
 namespace leaf
@@ -74,51 +76,42 @@ boost::asio::awaitable<void> cotrol_file_handle::loop()
             LOG_ERROR("{} recv error {}", id_, ec.message());
             co_return;
         }
-        auto message = boost::beast::buffers_to_string(buffer.data());
-        auto type = leaf::get_message_type(message);
-        if (type == leaf::message_type::files_request)
+        auto message = leaf::decode(leaf::buffers_to_span(buffer.cdata()));
+        // 与之前一样忽略不认识的消息, 不断开控制连接
+        if (std::holds_alternative<std::monostate>(message))
         {
-            co_await on_files_request(message, ec);
-        }
-        if (type == leaf::message_type::dir)
-        {
-            co_await on_create_dir(message, ec);
-        }
-        if (type == leaf::message_type::rename)
-        {
-            co_await on_rename(message, ec);
+            LOG_WARN("{} decode message error, ignore", id_);
+            continue;
         }
+        co_await std::visit(leaf::overloaded{[&](const leaf::files_request& msg) { return on_files_request(msg, ec); },
+                                             [&](const leaf::create_dir& msg) { return on_create_dir(msg, ec); },
+                                             [&](const leaf::rename_request& msg) { return on_rename(msg, ec); },
+                                             [](const auto&) -> boost::asio::awaitable<void> { co_return; }},
+                            message);
         if (ec)
         {
-            LOG_ERROR("{} process message {} error {}", id_, (int)type, ec.message());
+            LOG_ERROR("{} process message {} error {}", id_, message.index(), ec.message());
             break;
         }
     }
     LOG_INFO("{} recv coro shutdown", id_);
 }
 
-boost::asio::awaitable<void> cotrol_file_handle::on_rename(const std::string& message, boost::beast::error_code& ec)
+boost::asio::awaitable<void> cotrol_file_handle::on_rename(const leaf::rename_request& msg, boost::beast::error_code& ec)
 {
-    auto rename_request = leaf::deserialize_rename_request(std::vector<uint8_t>(message.begin(), message.end()));
-    if (!rename_request.has_value())
+    if (msg.token != token_)
     {
-        ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
-        co_return;
-    }
-    if (rename_request->token != token_)
-    {
-        LOG_ERROR("{} rename request token {} not match {}", id_, rename_request->token, token_);
+        LOG_ERROR("{} rename request token {} not match {}", id_, msg.token, token_);
         ec = boost::system::errc::make_error_code(boost::system::errc::permission_denied);
         co_return;
     }
-    const auto& msg = rename_request.value();
     std::string token_path = leaf::make_user_path(token_);
     auto old_name = std::filesystem::path(msg.parent).append(msg.old_name).string();
     auto new_name = std::filesystem::path(msg.parent).append(msg.new_name).string();
     auto old_file_path = std::filesystem::path(token_path).append(old_name);
     auto new_file_path = std::filesystem::path(token_path).append(new_name);
     LOG_INFO("{} on rename old {} new {} parent {} token_path {}", id_, old_file_path.string(), new_file_path.string(), msg.parent, token_path);
-    std::filesystem::rename(old_file_path, new_file_path, ec);
+    co_await leaf::offload_metadata(token_, [&]() { std::filesystem::rename(old_file_path, new_file_path, ec); });
     if (ec)
     {
         LOG_ERROR("{} rename old {} new {} parent {} token_path {} error {}",
@@ -137,7 +130,7 @@ boost::asio::awaitable<void> cotrol_file_handle::on_rename(const std::string& me
     response.parent = msg.parent;
     response.type = msg.type;
 
-    co_await write(leaf::serialize_rename_response(response), ec);
+    co_await write(leaf::serialize_rename_response(response, codec_), ec);
 }
 
 boost::asio::awaitable<void> cotrol_file_handle::keepalive(boost::beast::error_code& ec)
@@ -149,21 +142,15 @@ boost::asio::awaitable<void> cotrol_file_handle::keepalive(boost::beast::error_c
         LOG_ERROR("{} keepalive error {}", id_, ec.message());
         co_return;
     }
-    auto message = boost::beast::buffers_to_string(buffer.data());
-    auto type = leaf::get_message_type(message);
-    if (type != leaf::message_type::keepalive)
-    {
-        ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
-        co_return;
-    }
-    auto k = leaf::deserialize_keepalive(std::vector<uint8_t>(message.begin(), message.end()));
-    if (!k.has_value())
+    auto message = leaf::decode(leaf::buffers_to_span(buffer.cdata()));
+    const auto* k = std::get_if<leaf::keepalive>(&message);
+    if (k == nullptr)
     {
         ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
         co_return;
     }
 
-    auto sk = k.value();
+    auto sk = *k;
 
     sk.server_timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
     LOG_DEBUG("{} keepalive client {} server_timestamp {} client_timestamp {} token {}",
@@ -172,7 +159,7 @@ boost::asio::awaitable<void> cotrol_file_handle::keepalive(boost::beast::error_c
               sk.server_timestamp,
               sk.client_timestamp,
               token_);
-    co_await write(serialize_keepalive(sk), ec);
+    co_await write(serialize_keepalive(sk, codec_), ec);
 }
 boost::asio::awaitable<void> cotrol_file_handle::wait_login(boost::beast::error_code& ec)
 {
@@ -189,24 +176,20 @@ boost::asio::awaitable<void> cotrol_file_handle::wait_login(boost::beast::error_
         LOG_ERROR("{} login error {}", id_, ec.message());
         co_return;
     }
-    auto message = boost::beast::buffers_to_string(buffer.data());
-    auto type = leaf::get_message_type(message);
-    auto bytes = std::vector<uint8_t>(message.begin(), message.end());
-    if (type != leaf::message_type::login)
-    {
-        ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
-        co_return;
-    }
-    auto login = leaf::deserialize_login_token(bytes);
-    if (!login.has_value())
+    auto message = leaf::decode(leaf::buffers_to_span(buffer.cdata()));
+    const auto* login = std::get_if<leaf::login_token>(&message);
+    if (login == nullptr)
     {
         ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
         co_return;
     }
 
     token_ = login->token;
-    LOG_INFO("{} login success token {}", id_, token_);
-    co_await write(leaf::serialize_login_token(login.value()), ec);
+    codec_ = leaf::negotiate_codec(login->codec);
+    LOG_INFO("{} login success token {} codec {}", id_, token_, login->codec);
+    auto response = *login;
+    response.codec = static_cast<uint32_t>(codec_);
+    co_await write(leaf::serialize_login_token(response), ec);
 }
 static std::vector<leaf::file_node> lookup_dir(const std::filesystem::path& dir, const std::string& token_path)
 {
@@ -258,56 +241,40 @@ static std::vector<leaf::file_node> lookup_dir(const std::filesystem::path& dir,
     return files;
 }
 
-boost::asio::awaitable<void> cotrol_file_handle::on_files_request(const std::string& message, boost::beast::error_code& ec)
+boost::asio::awaitable<void> cotrol_file_handle::on_files_request(const leaf::files_request& msg, boost::beast::error_code& ec)
 {
-    auto files_request = leaf::deserialize_files_request(std::vector<uint8_t>(message.begin(), message.end()));
-    if (!files_request.has_value())
-    {
-        ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
-        co_return;
-    }
-
-    const auto& msg = files_request.value();
     LOG_DEBUG("files request {} {}", msg.dir, msg.token);
     std::string token_path = leaf::make_user_path(token_);
     auto file_path = std::filesystem::path(token_path).append(msg.dir);
     auto dir_path = std::filesystem::absolute(file_path).lexically_normal().string();
     LOG_INFO("{} on files request dir {} file path {} dir path {}", id_, msg.dir, file_path.string(), dir_path);
     leaf::files_response response;
-    auto files = lookup_dir(dir_path, token_path);
+    auto files = co_await leaf::offload_metadata(token_, [&]() { return lookup_dir(dir_path, token_path); });
     response.token = msg.token;
     response.files.swap(files);
     response.dir = msg.dir;
-    co_await write(leaf::serialize_files_response(response), ec);
+    co_await write(leaf::serialize_files_response(response, codec_), ec);
 }
 
-boost::asio::awaitable<void> cotrol_file_handle::on_create_dir(const std::string& message, boost::beast::error_code& ec)
+boost::asio::awaitable<void> cotrol_file_handle::on_create_dir(const leaf::create_dir& msg, boost::beast::error_code& ec)
 {
-    auto dir_request = leaf::deserialize_create_dir(std::vector<uint8_t>(message.begin(), message.end()));
-    if (!dir_request.has_value())
-    {
-        ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
-        LOG_ERROR("{} deserialize create dir request error", id_);
-        co_return;
-    }
-    LOG_INFO("{} create dir parent {} dir {}", id_, dir_request->parent, dir_request->dir);
-    std::string dir_path = std::filesystem::path(dir_request->parent).append(dir_request->dir).string();
-    auto local_path = leaf::make_file_path(dir_request->token, dir_path);
+    LOG_INFO("{} create dir parent {} dir {}", id_, msg.parent, msg.dir);
+    std::string dir_path = std::filesystem::path(msg.parent).append(msg.dir).string();
+    auto local_path = co_await leaf::offload_metadata(token_, [&]() { return leaf::make_file_path(msg.token, dir_path); });
     if (local_path.empty())
     {
-        LOG_ERROR("{} create dir failed parent {} dir {}", id_, dir_request->parent, dir_request->dir);
+        LOG_ERROR("{} create dir failed parent {} dir {}", id_, msg.parent, msg.dir);
         ec = boost::system::errc::make_error_code(boost::system::errc::no_such_file_or_directory);
         co_return;
     }
-    std::filesystem::create_directory(local_path, ec);
+    co_await leaf::offload_metadata(token_, [&]() { std::filesystem::create_directory(local_path, ec); });
     if (ec)
     {
-        LOG_ERROR("{} create dir failed parent {} dir {} localath {} error {}", id_, dir_request->parent, dir_request->dir, local_path, ec.message());
+        LOG_ERROR("{} create dir failed parent {} dir {} localath {} error {}", id_, msg.parent, msg.dir, local_path, ec.message());
         co_return;
     }
-    LOG_INFO("{} create dir parent {} dir {} local {}", id_, dir_request->parent, dir_request->dir, local_path);
-    auto response = dir_request.value();
-    co_await write(leaf::serialize_create_dir(response), ec);
+    LOG_INFO("{} create dir parent {} dir {} local {}", id_, msg.parent, msg.dir, local_path);
+    co_await write(leaf::serialize_create_dir(msg, codec_), ec);
 }
 
 }    // namespace leaf
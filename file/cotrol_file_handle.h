@@ -28,13 +28,14 @@ class cotrol_file_handle : public websocket_handle
     boost::asio::awaitable<void> keepalive(boost::beast::error_code& ec);
     boost::asio::awaitable<void> error_message(uint32_t id, int32_t error_code);
 
-    boost::asio::awaitable<void> on_files_request(const std::string& message, boost::beast::error_code& ec);
-    boost::asio::awaitable<void> on_create_dir(const std::string& message, boost::beast::error_code& ec);
-    boost::asio::awaitable<void> on_rename(const std::string& message, boost::beast::error_code& ec);
+    boost::asio::awaitable<void> on_files_request(const leaf::files_request& msg, boost::beast::error_code& ec);
+    boost::asio::awaitable<void> on_create_dir(const leaf::create_dir& msg, boost::beast::error_code& ec);
+    boost::asio::awaitable<void> on_rename(const leaf::rename_request& msg, boost::beast::error_code& ec);
 
    private:
     std::string id_;
     std::string token_;
+    leaf::codec_type codec_ = leaf::codec_type::json;
     std::once_flag shutdown_flag_;
     leaf::websocket_session::ptr session_;
     const boost::asio::any_io_executor& io_;
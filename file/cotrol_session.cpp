@@ -84,7 +84,8 @@ boost::asio::awaitable<void> cotrol_session::loop1(boost::beast::error_code& ec)
             break;
         }
         LOG_DEBUG("{} ------- {} message ------", id_, mp.type);
-        co_await ws_client_->write(ec, mp.message.data(), mp.message.size());
+        auto message = mp.message(codec_);
+        co_await ws_client_->write(ec, message.data(), message.size());
         if (ec)
         {
             LOG_ERROR("{} write message to ws client {}", id_, ec.message());
@@ -141,9 +142,11 @@ boost::asio::awaitable<void> cotrol_session::wait_files_response(boost::beast::e
 }
 boost::asio::awaitable<void> cotrol_session::login(boost::beast::error_code& ec)
 {
+    codec_ = leaf::codec_type::json;
     leaf::login_token lt;
     lt.id = 0x01;
     lt.token = token_;
+    lt.codec = static_cast<uint32_t>(leaf::codec_type::binary);
     co_await write(leaf::serialize_login_token(lt), ec);
     if (ec)
     {
@@ -171,6 +174,8 @@ boost::asio::awaitable<void> cotrol_session::login(boost::beast::error_code& ec)
         ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
         co_return;
     }
+    // 旧版本服务端原样返回不带 codec 的登录消息, 此时保持 json
+    codec_ = leaf::negotiate_codec(login->codec);
 }
 
 boost::asio::awaitable<void> cotrol_session::write(const std::vector<uint8_t>& data, boost::beast::error_code& ec)
@@ -292,7 +297,7 @@ void cotrol_session::create_directory(const leaf::create_dir& cd)
 {
     message_pack mp;
     mp.type = "create_directory";
-    mp.message = leaf::serialize_create_dir(cd);
+    mp.message = [cd](leaf::codec_type codec) { return leaf::serialize_create_dir(cd, codec); };
     push_message(std::move(mp));
 }
 
@@ -303,7 +308,7 @@ void cotrol_session::change_current_dir(const std::string& dir)
     req.dir = dir;
     message_pack mp;
     mp.type = "files";
-    mp.message = leaf::serialize_files_request(req);
+    mp.message = [req](leaf::codec_type codec) { return leaf::serialize_files_request(req, codec); };
     push_message(std::move(mp));
 }
 
@@ -311,7 +316,7 @@ void cotrol_session::rename(const leaf::rename_request& req)
 {
     message_pack mp;
     mp.type = "rename";
-    mp.message = leaf::serialize_rename_request(req);
+    mp.message = [req](leaf::codec_type codec) { return leaf::serialize_rename_request(req, codec); };
     push_message(std::move(mp));
 }
 
@@ -41,7 +41,7 @@ class cotrol_session : public std::enable_shared_from_this<cotrol_session>
     struct message_pack
     {
         std::string type;
-        std::vector<uint8_t> message;
+        std::function<std::vector<uint8_t>(leaf::codec_type)> message;
     };
 
    private:
@@ -53,6 +53,7 @@ class cotrol_session : public std::enable_shared_from_this<cotrol_session>
     std::string host_;
     std::string port_;
     std::string token_;
+    leaf::codec_type codec_ = leaf::codec_type::json;
     bool shutdown_ = false;
     boost::asio::io_context &io_;
     std::shared_ptr<boost::asio::steady_timer> timer_;
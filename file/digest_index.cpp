@@ -0,0 +1,148 @@
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include "log/log.h"
+#include "file/file.h"
+#include "config/config.h"
+#include "crypt/blake2b.h"
+#include "net/reflect.hpp"
+#include "file/digest_index.h"
+
+namespace leaf
+{
+// 索引文件内容
+struct digest_entry
+{
+    std::string path;
+    uint64_t size = 0;
+    int64_t mtime = 0;
+};
+}    // namespace leaf
+
+namespace reflect
+{
+REFLECT_STRUCT(leaf::digest_entry, (path)(size)(mtime));
+}    // namespace reflect
+
+namespace leaf
+{
+static std::optional<int64_t> mtime_of(const std::string& path)
+{
+    std::error_code ec;
+    auto t = std::filesystem::last_write_time(path, ec);
+    if (ec)
+    {
+        return {};
+    }
+    return static_cast<int64_t>(t.time_since_epoch().count());
+}
+
+digest_index::digest_index(std::string root) : root_(std::move(root)) {}
+
+digest_index& digest_index::instance()
+{
+    static digest_index instance(std::filesystem::path(leaf::kDefaultDir).append(kDigestIndexDir).string());
+    return instance;
+}
+
+std::optional<std::string> digest_index::path(const std::string& user, const std::string& digest) const
+{
+    if (user.empty() || user == "." || user == ".." || user.find_first_of("/\\") != std::string::npos)
+    {
+        return {};
+    }
+    // 摘要来自客户端, 只接受小写 hex, 避免拼出仓库外的路径
+    if (digest.size() != 2 * leaf::blake2b::kDigestSize)
+    {
+        return {};
+    }
+    for (auto c : digest)
+    {
+        if ((c < '0' || c > '9') && (c < 'a' || c > 'f'))
+        {
+            return {};
+        }
+    }
+    return std::filesystem::path(root_).append(user).append(digest.substr(0, 2)).append(digest).string();
+}
+
+std::optional<std::string> digest_index::find(const std::string& user, const std::string& digest, uint64_t size) const
+{
+    auto index_path = path(user, digest);
+    if (!index_path)
+    {
+        return {};
+    }
+    std::ifstream in(*index_path, std::ios::binary);
+    if (!in)
+    {
+        return {};
+    }
+    std::stringstream ss;
+    ss << in.rdbuf();
+    digest_entry entry;
+    if (!reflect::deserialize_struct(entry, ss.str()) || entry.size != size)
+    {
+        return {};
+    }
+    // 改名覆盖后是新的文件, 大小和修改时间都一致才认为内容没有变化
+    std::error_code ec;
+    auto file_size = std::filesystem::file_size(entry.path, ec);
+    auto mtime = mtime_of(entry.path);
+    if (ec || file_size != size || mtime != entry.mtime)
+    {
+        LOG_DEBUG("digest index {} stale file {}", digest, entry.path);
+        return {};
+    }
+    // 索引文件被改动时也不链接用户目录以外的文件
+    auto user_path = std::filesystem::path(leaf::make_user_path(user)).lexically_normal();
+    auto relative = std::filesystem::path(entry.path).lexically_normal().lexically_relative(user_path);
+    if (relative.empty() || *relative.begin() == "..")
+    {
+        LOG_WARN("digest index {} file {} outside user {}", digest, entry.path, user);
+        return {};
+    }
+    return entry.path;
+}
+
+void digest_index::put(const std::string& user, const std::string& digest, uint64_t size, const std::string& path)
+{
+    auto index_path = this->path(user, digest);
+    auto mtime = mtime_of(path);
+    if (!index_path || !mtime)
+    {
+        return;
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(*index_path).parent_path(), ec);
+    if (ec)
+    {
+        LOG_ERROR("digest index create dir {} error {}", *index_path, ec.message());
+        return;
+    }
+    digest_entry entry;
+    entry.path = path;
+    entry.size = size;
+    entry.mtime = *mtime;
+    // 先写临时文件再改名, 多个连接同时登记同一个摘要也是安全的
+    auto tmp_path = fmt::format("{}.{}{}", *index_path, leaf::file_id(), kTmpFilenameSuffix);
+    {
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        out << reflect::serialize_struct(entry);
+        if (!out)
+        {
+            LOG_ERROR("digest index {} save error", *index_path);
+            std::filesystem::remove(tmp_path, ec);
+            return;
+        }
+    }
+    std::filesystem::rename(tmp_path, *index_path, ec);
+    if (ec)
+    {
+        LOG_ERROR("digest index {} rename error {}", *index_path, ec.message());
+        std::filesystem::remove(tmp_path, ec);
+        return;
+    }
+    LOG_DEBUG("digest index {} size {} file {}", digest, size, path);
+}
+}    // namespace leaf
@@ -0,0 +1,35 @@
+#ifndef LEAF_FILE_DIGEST_INDEX_H
+#define LEAF_FILE_DIGEST_INDEX_H
+
+#include <string>
+#include <cstdint>
+#include <optional>
+
+namespace leaf
+{
+// 服务端整个文件的 blake2b 摘要索引, 秒传时按摘要找到已有的文件
+// 每个用户单独索引, 只能秒传自己已有的文件, 不会通过摘要拿到或探测到其他用户的文件
+// 每个摘要一个索引文件, 路径为 root/用户/摘要前两位/摘要, 内容为文件路径/大小/修改时间
+class digest_index
+{
+   public:
+    explicit digest_index(std::string root);
+
+   public:
+    static digest_index& instance();
+
+   public:
+    // 文件被删除或者被覆盖后索引失效, 返回空
+    std::optional<std::string> find(const std::string& user, const std::string& digest, uint64_t size) const;
+    // 同一个摘要只保留最近一次登记的文件
+    void put(const std::string& user, const std::string& digest, uint64_t size, const std::string& path);
+
+   private:
+    std::optional<std::string> path(const std::string& user, const std::string& digest) const;
+
+   private:
+    std::string root_;
+};
+}    // namespace leaf
+
+#endif
@@ -1,15 +1,22 @@
 #include <utility>
 #include <filesystem>
+#include <boost/algorithm/hex.hpp>
 #include <boost/system/error_code.hpp>
 
 #include "log/log.h"
 #include "file/file.h"
 #include "crypt/easy.h"
+#include "net/buffer.h"
 #include "net/exception.h"
 #include "crypt/blake2b.h"
 #include "config/config.h"
 #include "protocol/codec.h"
 #include "file/hash_file.h"
+#include "file/block_cache.h"
+#include "file/mmap_reader.h"
+#include "file/thread_pools.h"
+#include "file/hash_manifest.h"
+#include "file/metadata_executor.h"
 #include "file/download_file_handle.h"
 
 namespace leaf
@@ -37,6 +44,13 @@ boost::asio::awaitable<void> download_file_handle ::write(const std::vector<uint
     co_await session_->write(ec, msg.data(), msg.size());
 }
 
+boost::asio::awaitable<void> download_file_handle::write(const leaf::file_data_view& fd, boost::beast::error_code& ec)
+{
+    auto header = leaf::serialize_file_data_header(fd);
+    std::vector<boost::asio::const_buffer> buffers{boost::asio::buffer(header), boost::asio::buffer(fd.data.data(), fd.data.size())};
+    co_await session_->write(ec, buffers);
+}
+
 void download_file_handle ::shutdown()
 {
     auto msg = fmt::format("download file handle shutdown {}", id_);
@@ -144,23 +158,27 @@ boost::asio::awaitable<void> download_file_handle::wait_login(boost::beast::erro
     {
         co_return;
     }
-    auto message = boost::beast::buffers_to_string(buffer.data());
-    auto type = leaf::get_message_type(message);
-    auto bytes = std::vector<uint8_t>(message.begin(), message.end());
-    if (type != leaf::message_type::login)
-    {
-        ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
-        co_return;
-    }
-    auto login = leaf::deserialize_login_token(bytes);
-    if (!login.has_value())
+    auto message = leaf::decode(leaf::buffers_to_span(buffer.cdata()));
+    const auto* login = std::get_if<leaf::login_token>(&message);
+    if (login == nullptr)
     {
         ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
         co_return;
     }
 
     token_ = login->token;
-    co_await write(leaf::serialize_login_token(login.value()), ec);
+    options_ = leaf::negotiate_transfer_options(*login);
+    LOG_INFO("{} login version {} codec {} block size {} hash block size {} digest {} window {}",
+             id_,
+             options_.version,
+             static_cast<int>(options_.codec),
+             options_.block_size,
+             options_.hash_block_size,
+             static_cast<int>(options_.digest),
+             options_.window);
+    auto response = *login;
+    leaf::set_transfer_options(response, options_);
+    co_await write(leaf::serialize_login_token(response), ec);
 }
 boost::asio::awaitable<leaf::keepalive> download_file_handle::wait_keepalive(boost::beast::error_code& ec)
 {
@@ -171,21 +189,15 @@ boost::asio::awaitable<leaf::keepalive> download_file_handle::wait_keepalive(boo
     {
         co_return k;
     }
-    auto message = boost::beast::buffers_to_string(buffer.data());
-    auto type = leaf::get_message_type(message);
-    if (type != leaf::message_type::keepalive)
-    {
-        ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
-        co_return k;
-    }
-    auto keepalive_request = leaf::deserialize_keepalive(std::vector<uint8_t>(message.begin(), message.end()));
-    if (!keepalive_request.has_value())
+    auto message = leaf::decode(leaf::buffers_to_span(buffer.cdata()));
+    const auto* keepalive_request = std::get_if<leaf::keepalive>(&message);
+    if (keepalive_request == nullptr)
     {
         ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
         co_return k;
     }
 
-    k = keepalive_request.value();
+    k = *keepalive_request;
 
     k.server_timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
     LOG_DEBUG("{} on_keepalive client {} server_timestamp {} client_timestamp {} token {}",
@@ -194,8 +206,8 @@ boost::asio::awaitable<leaf::keepalive> download_file_handle::wait_keepalive(boo
               k.server_timestamp,
               k.client_timestamp,
               token_);
-    co_await write(serialize_keepalive(k), ec);
-    co_return keepalive_request.value();
+    co_await write(serialize_keepalive(k, options_.codec), ec);
+    co_return *keepalive_request;
 }
 boost::asio::awaitable<void> download_file_handle::error_message(uint32_t id, int32_t error_code)
 {
@@ -203,57 +215,173 @@ boost::asio::awaitable<void> download_file_handle::error_message(uint32_t id, in
     leaf::error_message e;
     e.id = id;
     e.error = error_code;
-    co_await write(leaf::serialize_error_message(e), ec);
+    co_await write(leaf::serialize_error_message(e, options_.codec), ec);
 }
 
 boost::asio::awaitable<void> download_file_handle::send_file_data(leaf::download_file_handle::download_context& ctx, boost::beast::error_code& ec)
 {
-    uint8_t buffer[kBlockSize] = {0};
+    std::vector<uint8_t> buffer;
     auto hash = std::make_shared<leaf::blake2b>();
-    auto reader = std::make_shared<leaf::file_reader>(ctx.file.local_path);
-    ec = reader->open();
+    // 多个连接下载同一个文件时共享已经读出的块和算好的摘要
+    auto& cache = leaf::block_cache::instance();
+    std::optional<leaf::block_cache::file_key> cache_key;
+    if (cache.enabled())
+    {
+        cache_key = co_await leaf::offload_metadata(token_, [&ctx]() { return leaf::block_cache::key_of(ctx.file.local_path); });
+    }
+    // 页缓存中的文件直接映射发送, 绕过页缓存的大文件仍然读到缓冲区
+    std::shared_ptr<leaf::reader> reader;
+    std::shared_ptr<leaf::mmap_reader> mapped;
+    if (!leaf::use_direct_io(ctx.file.file_size))
+    {
+        mapped = std::make_shared<leaf::mmap_reader>(ctx.file.local_path);
+        ec = mapped->open();
+        if (ec)
+        {
+            LOG_WARN("{} download file map file {} error {}", id_, ctx.file.local_path, ec.message());
+            mapped.reset();
+        }
+        reader = mapped;
+    }
+    if (mapped == nullptr)
+    {
+        buffer.resize(options_.block_size, 0);
+        reader = std::make_shared<leaf::file_reader>(ctx.file.local_path, leaf::use_direct_io(ctx.file.file_size));
+        ec = reader->open();
+    }
     if (ec)
     {
         LOG_ERROR("{} download file open file {} error {}", id_, ctx.file.local_path, ec.message());
         co_return;
     }
+    // 分段下载只发送 [offset, offset + length) 的数据
+    uint64_t end = ctx.file.file_size;
+    if (ctx.request.length != 0)
+    {
+        end = std::min<uint64_t>(ctx.file.file_size, ctx.request.offset + ctx.request.length);
+    }
+    if (mapped != nullptr)
+    {
+        mapped->will_need(ctx.request.offset, end - std::min(end, ctx.request.offset));
+    }
+    // 打开期间文件被覆盖时不使用缓存, 避免新旧内容混在同一个 key 下
+    if (cache_key && cache_key != co_await leaf::offload_metadata(token_, [&ctx]() { return leaf::block_cache::key_of(ctx.file.local_path); }))
+    {
+        cache_key.reset();
+    }
+    // 摘要块与清单对齐时直接发送清单中的块摘要, 没有清单的大文件在后台补建
+    std::shared_ptr<leaf::hash_manifest> manifest;
+    if (options_.hash_block_size == kManifestBlockSize && ctx.request.offset % kManifestBlockSize == 0 && ctx.file.file_size >= kManifestMinSize)
+    {
+        manifest = co_await leaf::offload_metadata(token_,
+                                                   [&ctx]() -> std::shared_ptr<leaf::hash_manifest>
+                                                   {
+                                                       auto key = leaf::block_cache::key_of(ctx.file.local_path);
+                                                       auto m = key ? leaf::hash_manifest::load(ctx.file.local_path, *key) : nullptr;
+                                                       if (m == nullptr)
+                                                       {
+                                                           leaf::hash_manifest::schedule(ctx.file.local_path);
+                                                       }
+                                                       return m;
+                                                   });
+    }
+    // 绕过页缓存的大文件只缓存摘要, 块数据读一次就发走, 不进 LRU
+    bool cache_blocks = cache_key.has_value() && !leaf::use_direct_io(ctx.file.file_size);
+    uint64_t sent = 0;
+    uint64_t hash_start = 0;    // 当前摘要块在范围内的起点
+    std::optional<leaf::blake2b::digest> cached_digest;
     while (true)
     {
-        auto read_size = reader->read_at(static_cast<int64_t>(reader->size() + ctx.request.offset), buffer, kBlockSize, ec);
+        auto offset = sent + ctx.request.offset;
+        auto size = std::min<uint64_t>(options_.block_size, end > offset ? end - offset : 0);
+        // 摘要块开始时查缓存, 命中后这个摘要块内的数据不再计算摘要
+        if (cache_key && sent == hash_start)
+        {
+            cached_digest = cache.find_digest(*cache_key, offset, std::min<uint64_t>(offset + options_.hash_block_size, end));
+        }
+        if (manifest && sent == hash_start && !cached_digest)
+        {
+            cached_digest = manifest->block_digest(offset, std::min<uint64_t>(offset + options_.hash_block_size, end));
+        }
+        leaf::block_cache::block cached;
+        if (cache_blocks && size != 0)
+        {
+            cached = cache.find_block(*cache_key, offset, size);
+        }
+        std::span<const uint8_t> data;
+        if (cached != nullptr)
+        {
+            data = *cached;
+            ec = {};
+        }
+        else if (mapped != nullptr)
+        {
+            data = mapped->view_at(offset, size, ec);
+        }
+        else
+        {
+            auto read_size = co_await reader->async_read_at(static_cast<int64_t>(offset), buffer.data(), size, ec);
+            data = std::span<const uint8_t>(buffer.data(), read_size);
+        }
         if (ec && ec != boost::asio::error::eof)
         {
             LOG_ERROR("{} download file read file {} error {}", id_, ctx.file.local_path, ec.message());
             break;
         }
-        leaf::file_data fd;
-        fd.data.insert(fd.data.end(), buffer, buffer + read_size);
-        if (read_size != 0)
+        if (cache_blocks && cached == nullptr && data.size() == size && size != 0 && cache.admit_block(*cache_key, offset, size))
         {
-            hash->update(fd.data.data(), read_size);
+            cache.put_block(*cache_key, offset, std::make_shared<const std::vector<uint8_t>>(data.begin(), data.end()));
         }
+        if (!data.empty() && !cached_digest)
+        {
+            hash->update(data.data(), data.size());
+        }
+        sent += data.size();
         // block count hash or eof hash
-        if (reader->size() % kHashBlockSize == 0 || ec == boost::asio::error::eof)
+        leaf::file_data_view fd;
+        leaf::blake2b::digest block_hash;
+        std::string legacy_hash;
+        auto range_end = sent + ctx.request.offset == end;
+        if (sent % options_.hash_block_size == 0 || range_end || ec == boost::asio::error::eof)
         {
-            hash->final();
-            fd.hash = hash->hex();
+            if (cached_digest)
+            {
+                block_hash = *cached_digest;
+            }
+            else
+            {
+                hash->final();
+                block_hash = hash->raw();
+                if (cache_key && ec != boost::asio::error::eof)
+                {
+                    cache.put_digest(*cache_key, hash_start + ctx.request.offset, sent + ctx.request.offset, block_hash);
+                }
+            }
+            // 旧版本对端仍发送 hex 摘要
+            if (options_.digest == leaf::digest_type::raw)
+            {
+                fd.hash = block_hash;
+            }
+            else
+            {
+                boost::algorithm::hex_lower(block_hash.begin(), block_hash.end(), std::back_inserter(legacy_hash));
+                fd.hash = std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(legacy_hash.data()), legacy_hash.size());
+            }
             hash.reset();
             hash = std::make_shared<leaf::blake2b>();
+            hash_start = sent;
+            cached_digest.reset();
         }
-        LOG_DEBUG("{} download file {} offset {} read {} hash {}",
-                  id_,
-                  ctx.file.local_path,
-                  ctx.request.offset,
-                  read_size,
-                  fd.hash.empty() ? "empty" : fd.hash);
+        fd.data = data;
+        LOG_DEBUG("{} download file {} offset {} read {} hash size {}", id_, ctx.file.local_path, ctx.request.offset, data.size(), fd.hash.size());
         boost::beast::error_code write_ec;
         if (!fd.data.empty())
         {
-            co_await write(leaf::serialize_file_data(fd), write_ec);
+            co_await write(fd, write_ec);
         }
-        LOG_DEBUG(
-            "{} download file {} left {} hash {}", id_, ctx.file.local_path, ctx.request.offset + read_size, fd.hash.empty() ? "empty" : fd.hash);
+        LOG_DEBUG("{} download file {} left {} hash size {}", id_, ctx.file.local_path, ctx.request.offset + data.size(), fd.hash.size());
 
-        if (ec == boost::asio::error::eof || reader->size() == ctx.file.file_size)
+        if (ec == boost::asio::error::eof || range_end)
         {
             LOG_INFO("{} download file {} complete", id_, ctx.file.local_path);
             break;
@@ -286,26 +414,20 @@ boost::asio::awaitable<leaf::download_file_handle::download_context> download_fi
     {
         co_return ctx;
     }
-    auto message = boost::beast::buffers_to_string(buffer.data());
-    auto type = leaf::get_message_type(message);
-    if (type != leaf::message_type::download_file_request)
-    {
-        ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
-        co_return ctx;
-    }
-    auto download = leaf::deserialize_download_file_request(std::vector<uint8_t>(message.begin(), message.end()));
-    if (!download.has_value())
+    auto message = leaf::decode(leaf::buffers_to_span(buffer.cdata()));
+    const auto* download = std::get_if<leaf::download_file_request>(&message);
+    if (download == nullptr)
     {
         ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
         co_return ctx;
     }
-    const auto& msg = download.value();
+    const auto& msg = *download;
     auto local_path = std::filesystem::path(token_).append(download->dir).string();
-    auto file_path = leaf::make_file_path(local_path, leaf::encode(download->filename));
+    auto file_path = co_await leaf::offload_metadata(token_, [&]() { return leaf::make_file_path(local_path, leaf::encode(download->filename)); });
     auto download_file_path = leaf::encode_leaf_filename(file_path);
 
     LOG_INFO("{} download file {} dir {} to {}", id_, msg.filename, msg.dir, download_file_path);
-    bool exist = std::filesystem::exists(download_file_path, ec);
+    bool exist = co_await leaf::offload_metadata(token_, [&]() { return std::filesystem::exists(download_file_path, ec); });
     if (ec)
     {
         LOG_ERROR("{} download file {} exist error {}", id_, msg.filename, ec.message());
@@ -318,15 +440,39 @@ boost::asio::awaitable<leaf::download_file_handle::download_context> download_fi
         co_return ctx;
     }
 
-    auto file_size = std::filesystem::file_size(download_file_path, ec);
+    auto file_size = co_await leaf::offload_metadata(token_, [&]() { return std::filesystem::file_size(download_file_path, ec); });
     if (ec)
     {
         LOG_ERROR("{} download file {} size error {}", id_, msg.filename, ec.message());
         co_return ctx;
     }
-    if (download->offset != 0)
+    // 分段下载只校验范围, 续传才校验已有部分的摘要
+    // 空文件的第一个分段 offset 与文件大小都是 0, 按空范围发送后直接结束
+    bool empty_range = download->offset == 0 && file_size == 0;
+    if (download->length != 0 && (options_.version < kRangeProtocolVersion || (download->offset >= file_size && !empty_range)))
+    {
+        LOG_ERROR("{} download file {} invalid range {}:{} size {}", id_, msg.filename, download->offset, download->length, file_size);
+        ec = boost::system::errc::make_error_code(boost::system::errc::invalid_argument);
+        co_return ctx;
+    }
+    if (download->offset != 0 && download->length == 0)
     {
-        auto hash = hash_file(download->filename, ec, download->offset);
+        // 断点在清单检查点上时只读一条前缀摘要, 否则在磁盘线程上重新计算
+        auto hash = co_await boost::asio::co_spawn(
+            leaf::disk_pool(),
+            [&]() -> boost::asio::awaitable<std::string>
+            {
+                auto key = leaf::block_cache::key_of(download_file_path);
+                auto digest = key ? leaf::hash_manifest::prefix_digest(download_file_path, *key, download->offset) : std::nullopt;
+                if (!digest.has_value())
+                {
+                    co_return hash_file(download_file_path, ec, download->offset);
+                }
+                std::string hex;
+                boost::algorithm::hex_lower(digest->begin(), digest->end(), std::back_inserter(hex));
+                co_return hex;
+            },
+            boost::asio::use_awaitable);
         if (ec)
         {
             co_return ctx;
@@ -342,14 +488,14 @@ boost::asio::awaitable<leaf::download_file_handle::download_context> download_fi
     file.file_size = file_size;
     file.filename = msg.filename;
     ctx.file = file;
-    ctx.request = download.value();
+    ctx.request = msg;
     leaf::download_file_response response;
     response.filename = file.filename;
     response.id = download->id;
     response.filesize = file.file_size;
     response.offset = download->offset;
     response.hash = download->hash;
-    co_await write(leaf::serialize_download_file_response(response), ec);
+    co_await write(leaf::serialize_download_file_response(response, options_.codec), ec);
     co_return ctx;
 }
 
@@ -30,6 +30,7 @@ class download_file_handle : public websocket_handle
    private:
     boost::asio::awaitable<void> loop();
     boost::asio::awaitable<void> write(const std::vector<uint8_t>& msg, boost::beast::error_code& ec);
+    boost::asio::awaitable<void> write(const leaf::file_data_view& fd, boost::beast::error_code& ec);
     boost::asio::awaitable<void> shutdown_coro();
     boost::asio::awaitable<void> wait_login(boost::beast::error_code& ec);
     boost::asio::awaitable<leaf::keepalive> wait_keepalive(boost::beast::error_code& ec);
@@ -42,6 +43,7 @@ class download_file_handle : public websocket_handle
    private:
     std::string id_;
     std::string token_;
+    leaf::transfer_options options_;
     std::once_flag shutdown_flag_;
     leaf::websocket_session::ptr session_;
     const boost::asio::any_io_executor& io_;
@@ -0,0 +1,142 @@
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include "log/log.h"
+#include "config/config.h"
+#include "net/reflect.hpp"
+#include "file/download_ranges.h"
+
+namespace leaf
+{
+// .state 文件内容
+struct download_state
+{
+    uint64_t file_size = 0;
+    std::vector<uint64_t> done;
+};
+}    // namespace leaf
+
+namespace reflect
+{
+REFLECT_STRUCT(leaf::download_state, (file_size)(done));
+}    // namespace reflect
+
+namespace leaf
+{
+static uint64_t range_count(uint64_t file_size) { return file_size == 0 ? 1 : (file_size + kRangeSize - 1) / kRangeSize; }
+
+download_ranges& download_ranges::instance()
+{
+    static download_ranges instance;
+    return instance;
+}
+
+std::string download_ranges::tmp_path(const std::string& filename) { return filename + kTmpFilenameSuffix; }
+
+std::string download_ranges::state_path(const std::string& filename) { return tmp_path(filename) + kStateFilenameSuffix; }
+
+void download_ranges::save(const std::string& filename, const range_file& f)
+{
+    download_state state;
+    state.file_size = f.file_size;
+    state.done.assign(f.done.begin(), f.done.end());
+    // 先写临时文件再改名, 中途退出不会留下半个状态文件
+    auto path = state_path(filename);
+    auto tmp = path + kTmpFilenameSuffix;
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        out << reflect::serialize_struct(state);
+        if (!out)
+        {
+            LOG_ERROR("download ranges {} save state error", filename);
+            return;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+    if (ec)
+    {
+        LOG_ERROR("download ranges {} rename state error {}", filename, ec.message());
+    }
+}
+
+bool download_ranges::load(const std::string& filename, range_file& f)
+{
+    std::ifstream in(state_path(filename), std::ios::binary);
+    if (!in)
+    {
+        return false;
+    }
+    std::stringstream ss;
+    ss << in.rdbuf();
+    download_state state;
+    if (!reflect::deserialize_struct(state, ss.str()))
+    {
+        return false;
+    }
+    f.file_size = state.file_size;
+    f.done.insert(state.done.begin(), state.done.end());
+    return true;
+}
+
+std::vector<uint64_t> download_ranges::begin(const std::string& filename, uint64_t file_size)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = files_.find(filename);
+    if (it == files_.end() || it->second.file_size != file_size)
+    {
+        range_file f;
+        std::error_code ec;
+        // 重启后从状态文件恢复, 大小不一致说明服务端文件已经变化
+        if (!load(filename, f) || f.file_size != file_size || !std::filesystem::exists(tmp_path(filename), ec))
+        {
+            std::filesystem::remove(tmp_path(filename), ec);
+            f = range_file{};
+            f.file_size = file_size;
+            save(filename, f);
+        }
+        else
+        {
+            LOG_INFO("download ranges {} size {} resume done {}/{}", filename, file_size, f.done.size(), range_count(file_size));
+        }
+        it = files_.insert_or_assign(filename, f).first;
+    }
+    std::vector<uint64_t> missing;
+    for (uint64_t i = 0; i < range_count(file_size); i++)
+    {
+        if (!it->second.done.contains(i * kRangeSize))
+        {
+            missing.push_back(i * kRangeSize);
+        }
+    }
+    return missing;
+}
+
+bool download_ranges::complete(const std::string& filename, uint64_t offset)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = files_.find(filename);
+    if (it == files_.end())
+    {
+        return false;
+    }
+    auto& f = it->second;
+    f.done.insert(offset);
+    if (f.done.size() < range_count(f.file_size))
+    {
+        save(filename, f);
+        return false;
+    }
+    files_.erase(it);
+    std::error_code ec;
+    std::filesystem::rename(tmp_path(filename), filename, ec);
+    if (ec)
+    {
+        LOG_ERROR("download ranges {} rename error {}", filename, ec.message());
+        return false;
+    }
+    std::filesystem::remove(state_path(filename), ec);
+    LOG_INFO("download ranges {} complete", filename);
+    return true;
+}
+}    // namespace leaf
@@ -0,0 +1,46 @@
+#ifndef LEAF_FILE_DOWNLOAD_RANGES_H
+#define LEAF_FILE_DOWNLOAD_RANGES_H
+
+#include <set>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace leaf
+{
+// 客户端分段下载的状态, 多个连接并行写同一个临时文件
+// 已完成的分段保存在临时文件旁边的 .state 文件中, 失败或重启后只重新下载缺少的分段
+// 所有分段完成后临时文件改名为目标文件, 目标文件存在时一定是完整的
+class download_ranges
+{
+   public:
+    static download_ranges& instance();
+
+   public:
+    static std::string tmp_path(const std::string& filename);
+    // 大小与状态文件一致时继续, 否则丢弃旧的临时文件重新开始, 返回还没有完成的分段起点
+    std::vector<uint64_t> begin(const std::string& filename, uint64_t file_size);
+    // 分段写完后调用, 返回 true 表示所有分段都已完成并且已经改名
+    bool complete(const std::string& filename, uint64_t offset);
+
+   private:
+    struct range_file
+    {
+        uint64_t file_size = 0;
+        std::set<uint64_t> done;
+    };
+
+   private:
+    static std::string state_path(const std::string& filename);
+    static void save(const std::string& filename, const range_file& f);
+    static bool load(const std::string& filename, range_file& f);
+
+   private:
+    std::mutex mutex_;
+    std::map<std::string, range_file> files_;
+};
+}    // namespace leaf
+
+#endif
@@ -4,10 +4,13 @@
 #include "log/log.h"
 #include "file/file.h"
 #include "config/config.h"
+#include "net/buffer.h"
 #include "net/exception.h"
+#include "net/scoped_exit.hpp"
 #include "protocol/codec.h"
 #include "file/hash_file.h"
 #include "file/event_manager.h"
+#include "file/download_ranges.h"
 #include "file/download_session.h"
 
 namespace leaf
@@ -38,7 +41,7 @@ boost::asio::awaitable<void> download_session::send_keepalive(boost::beast::erro
     k.client_id = reinterpret_cast<uintptr_t>(this);
     k.client_timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
     k.server_timestamp = padding_files_.size();
-    co_await write(leaf::serialize_keepalive(k), ec);
+    co_await write(leaf::serialize_keepalive(k, options_.codec), ec);
     if (ec)
     {
         LOG_ERROR("{} send keepalive error {}", id_, ec.message());
@@ -75,9 +78,11 @@ boost::asio::awaitable<void> download_session::send_keepalive(boost::beast::erro
 boost::asio::awaitable<void> download_session::login(boost::beast::error_code& ec)
 {
     LOG_INFO("{} connect ws client will login use token {}", id_, token_);
+    options_ = leaf::transfer_options{};
     leaf::login_token lt;
     lt.id = 0x01;
     lt.token = token_;
+    leaf::set_transfer_options(lt, leaf::preferred_transfer_options());
     co_await write(leaf::serialize_login_token(lt), ec);
     if (ec)
     {
@@ -106,7 +111,8 @@ boost::asio::awaitable<void> download_session::login(boost::beast::error_code& e
         ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
         co_return;
     }
-    LOG_INFO("{} login success token {}", id_, login->token);
+    options_ = leaf::negotiate_transfer_options(login.value());
+    LOG_INFO("{} login success token {} block size {} window {}", id_, login->token, options_.block_size, options_.window);
 }
 boost::asio::awaitable<void> download_session::loop()
 {
@@ -206,6 +212,42 @@ boost::asio::awaitable<void> download_session::download(boost::beast::error_code
 {
     auto file = padding_files_.front();
     padding_files_.pop();
+    // 不知道文件大小, 先按第一个分段请求, 收到响应后再切分剩余部分
+    // 分段写到临时文件, 全部完成后才改名, 目标文件存在时一定是完整的
+    bool first_range = false;
+    bool range = file.length != 0;
+    // 分段失败后重新排队, 服务端持续出错时超过次数上限后放弃, 已完成的分段记录在状态文件中, 下次只下载缺少的分段
+    auto requeue = leaf::make_scoped_exit(
+        [&]()
+        {
+            if (!range)
+            {
+                return;
+            }
+            auto key = std::make_pair(file.filename, file.offset);
+            if (!ec)
+            {
+                range_retries_.erase(key);
+                return;
+            }
+            if (++range_retries_[key] <= kRangeRetries)
+            {
+                padding_files_.push(file);
+                return;
+            }
+            range_retries_.erase(key);
+            LOG_ERROR("{} download file {} range {}:{} failed after {} retries {}", id_, file.filename, file.offset, file.length, kRangeRetries, ec.message());
+            leaf::notify_event e;
+            e.method = "download";
+            e.error = ec.message();
+            e.data = file;
+            leaf::event_manager::instance().post("notify", e);
+        });
+    if (file.length == 0 && options_.version >= kRangeProtocolVersion && !range_sessions_.empty() && !std::filesystem::exists(file.filename))
+    {
+        file.length = kRangeSize;
+        first_range = true;
+    }
     // send download file request
     LOG_INFO("{} send download file request {}", id_, file.local_path);
     co_await send_download_file_request(file, ec);
@@ -223,6 +265,16 @@ boost::asio::awaitable<void> download_session::download(boost::beast::error_code
         co_return;
     }
     LOG_INFO("{} wait download file response success {} file size {}", id_, ctx.response.filename, ctx.response.filesize);
+    if (first_range)
+    {
+        auto missing = leaf::download_ranges::instance().begin(file.filename, ctx.response.filesize);
+        split_ranges(file, ctx.response.filesize, missing);
+        range = true;
+    }
+    if (range)
+    {
+        ctx.file->local_path = leaf::download_ranges::tmp_path(file.filename);
+    }
     // wait ack message
     LOG_INFO("{} wait ack for download file {}", id_, ctx.response.filename);
     co_await wait_ack(ec);
@@ -240,26 +292,75 @@ boost::asio::awaitable<void> download_session::download(boost::beast::error_code
         LOG_ERROR("{} wait file data error {} {}", id_, ctx.response.filename, ec.message());
         co_return;
     }
+    if (range && leaf::download_ranges::instance().complete(file.filename, file.offset))
+    {
+        LOG_INFO("{} download file {} all ranges done", id_, file.filename);
+    }
     co_return;
 }
 
+void download_session::split_ranges(const leaf::file_info& file, uint64_t file_size, const std::vector<uint64_t>& missing)
+{
+    std::size_t index = 0;
+    for (auto offset : missing)
+    {
+        // 第一个分段由当前会话下载
+        if (offset == 0)
+        {
+            continue;
+        }
+        auto range = file;
+        range.file_size = file_size;
+        range.offset = offset;
+        range.length = std::min<uint64_t>(kRangeSize, file_size - offset);
+        auto session = range_sessions_[index % range_sessions_.size()].lock();
+        if (session != nullptr)
+        {
+            session->add_file(range);
+        }
+        else
+        {
+            padding_files_.push(range);
+        }
+        index++;
+    }
+    LOG_INFO("{} split file {} size {} missing {} ranges", id_, file.filename, file_size, missing.size());
+}
+
+void download_session::set_range_sessions(std::vector<std::weak_ptr<download_session>> sessions) { range_sessions_ = std::move(sessions); }
+
 boost::asio::awaitable<void> download_session::send_download_file_request(const file_info& file, boost::beast::error_code& ec)
 {
     leaf::download_file_request req;
     req.dir = file.dir;
     req.filename = file.filename;
     req.id = ++seq_;
-    if (std::filesystem::exists(file.filename))
+    if (file.length != 0)
     {
-        req.offset = std::filesystem::file_size(file.filename);
-        req.hash = leaf::hash_file(file.filename, ec);
-        if (ec)
+        req.offset = file.offset;
+        req.length = file.length;
+    }
+    else if (std::filesystem::exists(file.filename))
+    {
+        // 断点按服务端清单的检查点对齐, 服务端只需查表校验, 最多重新下载一个检查点的数据
+        auto size = std::filesystem::file_size(file.filename);
+        req.offset = size - size % kManifestCheckpoint;
+        if (req.offset != 0)
         {
-            co_return;
+            req.hash = leaf::hash_file(file.filename, ec, req.offset);
+            if (ec)
+            {
+                co_return;
+            }
         }
     }
-    LOG_INFO("{} send download file request {} offset {} hash {}", id_, file.filename, req.offset, req.hash.empty() ? "empty" : req.hash);
-    co_await write(leaf::serialize_download_file_request(req), ec);
+    LOG_INFO("{} send download file request {} offset {} length {} hash {}",
+             id_,
+             file.filename,
+             req.offset,
+             req.length,
+             req.hash.empty() ? "empty" : req.hash);
+    co_await write(leaf::serialize_download_file_request(req, options_.codec), ec);
 }
 
 boost::asio::awaitable<leaf::download_session::download_context> download_session::wait_download_file_response(boost::beast::error_code& ec)
@@ -293,7 +394,7 @@ boost::asio::awaitable<leaf::download_session::download_context> download_sessio
     }
     if (exists)
     {
-        uint32_t exists_size = std::filesystem::file_size(file_path, ec);
+        uint64_t exists_size = std::filesystem::file_size(file_path, ec);
         if (ec)
         {
             co_return ctx;
@@ -349,19 +450,19 @@ boost::asio::awaitable<void> download_session::wait_file_data(leaf::download_ses
 
     auto hash = std::make_shared<leaf::blake2b>();
     auto write_offset = static_cast<int64_t>(ctx.response.offset);
-    uint32_t write_size = write_offset;
+    uint64_t write_size = write_offset;
 
     auto start_time = std::chrono::steady_clock::now();
     while (true)
     {
-        boost::beast::flat_buffer buffer;
-        co_await ws_client_->read(ec, buffer);
+        recv_buffer_.consume(recv_buffer_.size());
+        co_await ws_client_->read(ec, recv_buffer_);
         if (ec)
         {
             LOG_ERROR("{} read error {}", id_, ec.message());
             break;
         }
-        auto message = boost::beast::buffers_to_string(buffer.data());
+        auto message = leaf::buffers_to_span(recv_buffer_.cdata());
         auto type = leaf::get_message_type(message);
         if (type == leaf::message_type::done)
         {
@@ -373,14 +474,14 @@ boost::asio::awaitable<void> download_session::wait_file_data(leaf::download_ses
             ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
             break;
         }
-        auto data = leaf::deserialize_file_data(std::vector<uint8_t>(message.begin(), message.end()));
+        auto data = leaf::deserialize_file_data_view(message);
         if (!data.has_value())
         {
             ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
             break;
         }
 
-        auto rsize = writer->write_at(write_offset, data->data.data(), data->data.size(), ec);
+        auto rsize = co_await writer->async_write_at(write_offset, data->data.data(), data->data.size(), ec);
         if (ec)
         {
             LOG_ERROR("{} wait file data writer write error {}", id_, ec.message());
@@ -395,20 +496,20 @@ boost::asio::awaitable<void> download_session::wait_file_data(leaf::download_ses
         write_size += rsize;
         write_offset += static_cast<int64_t>(data->data.size());
         hash->update(data->data.data(), data->data.size());
-        LOG_DEBUG("{} download file {} hash {} data size {} write size {}",
+        LOG_DEBUG("{} download file {} hash size {} data size {} write size {}",
                   id_,
                   ctx.file->local_path,
-                  data->hash.empty() ? "empty" : data->hash,
+                  data->hash.size(),
                   data->data.size(),
                   writer->size());
 
         if (!data->hash.empty())
         {
             hash->final();
-            auto hex_str = hash->hex();
-            if (hex_str != data->hash)
+            if (!leaf::verify_block_hash(*hash, data->hash))
             {
-                LOG_ERROR("{} download file {} hash not match {} {}", id_, ctx.file->local_path, hex_str, data->hash);
+                LOG_ERROR("{} download file {} hash not match {}", id_, ctx.file->local_path, hash->hex());
+                ec = boost::system::errc::make_error_code(boost::system::errc::illegal_byte_sequence);
                 break;
             }
             hash.reset();
@@ -1,6 +1,7 @@
 #ifndef LEAF_FILE_DOWNLOAD_SESSION_H
 #define LEAF_FILE_DOWNLOAD_SESSION_H
 
+#include <map>
 #include <boost/asio/experimental/awaitable_operators.hpp>
 #include <boost/asio/experimental/channel.hpp>
 
@@ -32,6 +33,8 @@ class download_session : public std::enable_shared_from_this<download_session>
     void update();
     void add_file(leaf::file_info f);
     void add_files(const std::vector<leaf::file_info> &files);
+    // 大文件的分段轮流交给这些会话, 每个会话是一条独立的连接
+    void set_range_sessions(std::vector<std::weak_ptr<download_session>> sessions);
 
    public:
     boost::asio::awaitable<void> login(boost::beast::error_code &);
@@ -51,6 +54,8 @@ class download_session : public std::enable_shared_from_this<download_session>
    private:
     void safe_add_file(leaf::file_info f);
     void safe_add_files(const std::vector<file_info> &files);
+    // 把第一个分段以外还没有完成的分段交给其他会话
+    void split_ranges(const leaf::file_info &file, uint64_t file_size, const std::vector<uint64_t> &missing);
 
    private:
     uint32_t seq_ = 0;
@@ -58,11 +63,15 @@ class download_session : public std::enable_shared_from_this<download_session>
     std::string host_;
     std::string port_;
     std::string token_;
+    leaf::transfer_options options_;
     bool shutdown_ = false;
     boost::asio::io_context &io_;
     std::queue<leaf::file_info> padding_files_;
+    boost::beast::flat_buffer recv_buffer_;
     std::shared_ptr<boost::asio::steady_timer> timer_;
     std::shared_ptr<leaf::plain_websocket_client> ws_client_;
+    std::vector<std::weak_ptr<download_session>> range_sessions_;
+    std::map<std::pair<std::string, uint64_t>, uint32_t> range_retries_;    // 按文件和分段起点记录的失败次数
 };
 }    // namespace leaf
 
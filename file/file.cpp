@@ -3,9 +3,20 @@
 #include <filesystem>
 #include <optional>
 #include <uv.h>
+#include <new>
+#include <cerrno>
+#include <atomic>
+#include <memory>
+#include <cstring>
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
 #include <boost/asio.hpp>
 #include <boost/system/error_code.hpp>
+#include "log/log.h"
 #include "file/file.h"
+#include "file/file_io.h"
 #include "config/config.h"
 
 namespace leaf
@@ -33,6 +44,11 @@ std::string encode_leaf_filename(const std::string& p)
 }
 std::string decode_leaf_filename(const std::string& p) { return std::filesystem::path(p).stem().string(); }
 
+std::string encode_state_filename(const std::string& p)
+{
+    return std::filesystem::path(p).replace_extension(kStateFilenameSuffix).string();
+}
+
 std::string tmp_to_leaf_filename(const std::string& p)
 {
     return std::filesystem::path(p).replace_extension(leaf_extension()).string();
@@ -141,6 +157,32 @@ bool rename(const std::string& src, const std::string& dst) { return ::rename(sr
 
 bool remove(const std::string& file) { return ::remove(file.c_str()) == 0; }
 
+// O_DIRECT 要求偏移/长度/内存地址都按扇区对齐, 调用方的缓冲区不对齐时经过对齐的中转缓冲区
+struct aligned_deleter
+{
+    void operator()(uint8_t* p) const { ::operator delete(p, std::align_val_t{kDirectIoAlignment}); }
+};
+using aligned_buffer = std::unique_ptr<uint8_t, aligned_deleter>;
+
+static aligned_buffer bounce_buffer(void const* buffer, std::size_t size)
+{
+    if (reinterpret_cast<std::uintptr_t>(buffer) % kDirectIoAlignment == 0)
+    {
+        return nullptr;
+    }
+    return aligned_buffer(static_cast<uint8_t*>(::operator new(size, std::align_val_t{kDirectIoAlignment})));
+}
+
+static std::atomic<uint64_t> direct_io_min_size = 0;
+
+void set_direct_io_size(uint64_t size) { direct_io_min_size = size; }
+
+bool use_direct_io(uint64_t file_size)
+{
+    auto size = direct_io_min_size.load();
+    return size != 0 && file_size >= size;
+}
+
 class file_impl
 {
    public:
@@ -151,7 +193,15 @@ class file_impl
     };
 
    public:
-    explicit file_impl(std::string filename) : filename_(std::move(filename)) {}
+    explicit file_impl(std::string filename, bool direct) : direct_(direct), filename_(std::move(filename)) {}
+    // 连接断开等没有显式关闭的情况, 关闭时同时释放没有用到的预分配空间
+    ~file_impl()
+    {
+        if (file_ >= 0)
+        {
+            auto _ = close();
+        }
+    }
 
     boost::system::error_code open(file_operation op)
     {
@@ -175,11 +225,23 @@ class file_impl
         }
         uv_fs_req_cleanup(&req);
         file_ = static_cast<int>(req.result);
+        if (direct_)
+        {
+            open_direct(flag & ~UV_FS_O_CREAT, mode);
+        }
         return ec;
     }
 
     boost::system::error_code close()
     {
+        release_preallocated();
+        if (direct_file_ >= 0)
+        {
+            uv_fs_t direct_req;
+            uv_fs_close(nullptr, &direct_req, direct_file_, nullptr);
+            uv_fs_req_cleanup(&direct_req);
+            direct_file_ = -1;
+        }
         uv_fs_t close_req;
         uv_fs_close(nullptr, &close_req, file_, nullptr);
         boost::system::error_code ec;
@@ -203,35 +265,42 @@ class file_impl
 
     std::size_t read_at(std::int64_t offset, void* buffer, std::size_t size, boost::system::error_code& ec)
     {
-        if (size > SSIZE_MAX)
+        std::size_t read_size = 0;
+        if (direct(offset, size))
         {
-            static constexpr boost::source_location loc = BOOST_CURRENT_LOCATION;
-            ec.assign(EINVAL, boost::system::generic_category(), &loc);
-            return 0;
+            auto bounce = bounce_buffer(buffer, size);
+            read_size = leaf::sync_read_at(direct_file_, offset, bounce ? bounce.get() : buffer, size, ec);
+            if (bounce && read_size != 0)
+            {
+                std::memcpy(buffer, bounce.get(), read_size);
+            }
+        }
+        else
+        {
+            read_size = leaf::sync_read_at(file_, offset, buffer, size, ec);
         }
+        read_size_ += read_size;
+        return read_size;
+    }
 
-        uv_fs_t read_req;
-        uv_buf_t buf = uv_buf_init(static_cast<char*>(buffer), size);
-        uv_fs_read(nullptr, &read_req, file_, &buf, 1, offset, nullptr);
-        if (read_req.result < 0)
+    boost::asio::awaitable<std::size_t> async_read_at(std::int64_t offset, void* buffer, std::size_t size, boost::system::error_code& ec)
+    {
+        std::size_t read_size = 0;
+        if (direct(offset, size))
         {
-            static constexpr boost::source_location loc = BOOST_CURRENT_LOCATION;
-            int err = uv_translate_sys_error(static_cast<int>(read_req.result));
-            ec.assign(err, boost::system::generic_category(), &loc);
-            uv_fs_req_cleanup(&read_req);
-            return 0;
+            auto bounce = bounce_buffer(buffer, size);
+            read_size = co_await leaf::get_file_io().read_at(direct_file_, offset, bounce ? bounce.get() : buffer, size, ec);
+            if (bounce && read_size != 0)
+            {
+                std::memcpy(buffer, bounce.get(), read_size);
+            }
         }
-        if (read_req.result == 0)
+        else
         {
-            uv_fs_req_cleanup(&read_req);
-            ec = boost::asio::error::eof;
-            return 0;
+            read_size = co_await leaf::get_file_io().read_at(file_, offset, buffer, size, ec);
         }
-        auto read_size = static_cast<std::size_t>(read_req.result);
-        read_size_ += read_req.result;
-        uv_fs_req_cleanup(&read_req);
-        ec = {};
-        return read_size;
+        read_size_ += read_size;
+        co_return read_size;
     }
 
     std::size_t write(void const* buffer, std::size_t size, boost::system::error_code& ec)
@@ -241,42 +310,165 @@ class file_impl
 
     std::size_t write_at(std::int64_t offset, void const* buffer, std::size_t size, boost::system::error_code& ec)
     {
-        if (size > SSIZE_MAX)
+        std::size_t write_size = 0;
+        if (direct(offset, size))
         {
-            static constexpr boost::source_location loc = BOOST_CURRENT_LOCATION;
-            ec.assign(EINVAL, boost::system::generic_category(), &loc);
-            return 0;
+            auto bounce = bounce_buffer(buffer, size);
+            if (bounce)
+            {
+                std::memcpy(bounce.get(), buffer, size);
+            }
+            write_size = leaf::sync_write_at(direct_file_, offset, bounce ? bounce.get() : buffer, size, ec);
+        }
+        else
+        {
+            write_size = leaf::sync_write_at(file_, offset, buffer, size, ec);
         }
+        write_size_ += write_size;
+        return write_size;
+    }
 
-        uv_fs_t write_req;
-        uv_buf_t buf = uv_buf_init(const_cast<char*>(static_cast<char const*>(buffer)), size);
-        uv_fs_write(nullptr, &write_req, file_, &buf, 1, offset, nullptr);
-        if (write_req.result < 0)
+    boost::asio::awaitable<std::size_t> async_write_at(std::int64_t offset, void const* buffer, std::size_t size, boost::system::error_code& ec)
+    {
+        std::size_t write_size = 0;
+        if (direct(offset, size))
         {
-            static constexpr boost::source_location loc = BOOST_CURRENT_LOCATION;
-            int err = uv_translate_sys_error(static_cast<int>(write_req.result));
-            ec.assign(err, boost::system::system_category(), &loc);
-            uv_fs_req_cleanup(&write_req);
-            return 0;
+            auto bounce = bounce_buffer(buffer, size);
+            if (bounce)
+            {
+                std::memcpy(bounce.get(), buffer, size);
+            }
+            write_size = co_await leaf::get_file_io().write_at(direct_file_, offset, bounce ? bounce.get() : buffer, size, ec);
+        }
+        else
+        {
+            write_size = co_await leaf::get_file_io().write_at(file_, offset, buffer, size, ec);
+        }
+        write_size_ += write_size;
+        co_return write_size;
+    }
+
+    std::size_t writev_at(std::int64_t offset, const std::vector<std::span<const uint8_t>>& buffers, boost::system::error_code& ec)
+    {
+        std::size_t size = 0;
+        for (const auto& b : buffers)
+        {
+            size += b.size();
         }
-        auto write_size = static_cast<std::size_t>(write_req.result);
-        write_size_ += write_req.result;
-        uv_fs_req_cleanup(&write_req);
+        std::size_t write_size = 0;
+        if (direct(offset, size))
+        {
+            // 各个块的地址不对齐, 拼到一个对齐的缓冲区后一次写入
+            aligned_buffer buffer(static_cast<uint8_t*>(::operator new(size, std::align_val_t{kDirectIoAlignment})));
+            std::size_t position = 0;
+            for (const auto& b : buffers)
+            {
+                std::memcpy(buffer.get() + position, b.data(), b.size());
+                position += b.size();
+            }
+            write_size = leaf::sync_write_at(direct_file_, offset, buffer.get(), size, ec);
+        }
+        else
+        {
+            write_size = leaf::sync_writev_at(file_, offset, buffers, ec);
+        }
+        write_size_ += write_size;
         return write_size;
     }
 
+    boost::system::error_code preallocate(std::int64_t offset, std::int64_t length)
+    {
+        boost::system::error_code ec;
+#ifdef __linux__
+        // 长度来自客户端, 超过上限或剩余空间的一半时不预分配, 按实际写入分配
+        if (length <= 0)
+        {
+            return ec;
+        }
+        if (static_cast<uint64_t>(length) > kPreallocateMaxSize)
+        {
+            return boost::system::errc::make_error_code(boost::system::errc::file_too_large);
+        }
+        std::error_code space_ec;
+        auto space = std::filesystem::space(std::filesystem::path(filename_).parent_path(), space_ec);
+        if (space_ec || static_cast<uint64_t>(length) > space.available / 2)
+        {
+            return boost::system::errc::make_error_code(boost::system::errc::no_space_on_device);
+        }
+        // KEEP_SIZE 只分配空间, 文件大小仍然是实际写入的位置, 断点续传不受影响
+        if (::fallocate(file_, FALLOC_FL_KEEP_SIZE, offset, length) != 0)
+        {
+            static constexpr boost::source_location loc = BOOST_CURRENT_LOCATION;
+            ec.assign(errno, boost::system::system_category(), &loc);
+            return ec;
+        }
+        preallocated_end_ = std::max<std::int64_t>(preallocated_end_, offset + length);
+#else
+        ec = boost::system::errc::make_error_code(boost::system::errc::not_supported);
+#endif
+        return ec;
+    }
+
     std::size_t read_size() const { return read_size_; }
     std::size_t write_size() const { return write_size_; }
     std::string name() const { return filename_; }
 
    private:
+    // 文件末尾之后预分配的块在关闭时打洞释放, 上传中断后不长期占用空间, 续传时重新预分配
+    void release_preallocated()
+    {
+#ifdef __linux__
+        if (file_ < 0 || preallocated_end_ <= 0)
+        {
+            return;
+        }
+        struct stat st = {};
+        if (::fstat(file_, &st) == 0 && st.st_size < preallocated_end_)
+        {
+            if (::fallocate(file_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, st.st_size, preallocated_end_ - st.st_size) != 0)
+            {
+                LOG_DEBUG("release preallocated {} {}:{} error {}", filename_, st.st_size, preallocated_end_, errno);
+            }
+        }
+        preallocated_end_ = 0;
+#endif
+    }
+
+    // 同一个文件另外打开一个 O_DIRECT 句柄, 对齐的读写绕过页缓存, 文件末尾等不对齐的部分仍然走 file_
+    void open_direct(int flag, int mode)
+    {
+#ifdef __linux__
+        uv_fs_t req;
+        uv_fs_open(nullptr, &req, filename_.c_str(), flag | UV_FS_O_DIRECT, mode, nullptr);
+        if (req.result >= 0)
+        {
+            direct_file_ = static_cast<int>(req.result);
+        }
+        else
+        {
+            // tmpfs 等不支持 O_DIRECT 的文件系统退回缓存读写
+            LOG_WARN("open direct {} error {}", filename_, uv_strerror(static_cast<int>(req.result)));
+        }
+        uv_fs_req_cleanup(&req);
+#endif
+    }
+
+    [[nodiscard]] bool direct(std::int64_t offset, std::size_t size) const
+    {
+        return direct_file_ >= 0 && offset >= 0 && size != 0 && offset % kDirectIoAlignment == 0 && size % kDirectIoAlignment == 0;
+    }
+
+   private:
+    bool direct_ = false;
     uv_file file_ = -1;
+    uv_file direct_file_ = -1;
+    std::int64_t preallocated_end_ = 0;
     std::size_t read_size_ = 0;
     std::size_t write_size_ = 0;
     std::string filename_;
 };
 //
-file_writer::file_writer(std::string filename) : impl_(new file_impl(std::move(filename))) {}
+file_writer::file_writer(std::string filename, bool direct) : impl_(new file_impl(std::move(filename), direct)) {}
 file_writer::~file_writer() { delete impl_; }
 boost::system::error_code file_writer::open() { return impl_->open(file_impl::file_operation::write); }
 boost::system::error_code file_writer::close() { return impl_->close(); }
@@ -294,8 +486,20 @@ std::size_t file_writer::write_at(std::int64_t offset,
 {
     return impl_->write_at(offset, buffer, size, ec);
 }
+std::size_t file_writer::writev_at(std::int64_t offset, const std::vector<std::span<const uint8_t>>& buffers, boost::system::error_code& ec)
+{
+    return impl_->writev_at(offset, buffers, ec);
+}
+boost::system::error_code file_writer::preallocate(std::int64_t offset, std::int64_t length) { return impl_->preallocate(offset, length); }
+boost::asio::awaitable<std::size_t> file_writer::async_write_at(std::int64_t offset,
+                                                                void const* buffer,
+                                                                std::size_t size,
+                                                                boost::system::error_code& ec)
+{
+    co_return co_await impl_->async_write_at(offset, buffer, size, ec);
+}
 //
-file_reader::file_reader(std::string filename) : impl_(new file_impl(std::move(filename))) {}
+file_reader::file_reader(std::string filename, bool direct) : impl_(new file_impl(std::move(filename), direct)) {}
 file_reader::~file_reader() { delete impl_; }
 boost::system::error_code file_reader::open() { return impl_->open(file_impl::file_operation::read); }
 boost::system::error_code file_reader::close() { return impl_->close(); }
@@ -310,5 +514,24 @@ std::size_t file_reader::read_at(std::int64_t offset, void* buffer, std::size_t
 {
     return impl_->read_at(offset, buffer, size, ec);
 }
+boost::asio::awaitable<std::size_t> file_reader::async_read_at(std::int64_t offset,
+                                                               void* buffer,
+                                                               std::size_t size,
+                                                               boost::system::error_code& ec)
+{
+    co_return co_await impl_->async_read_at(offset, buffer, size, ec);
+}
+//
+boost::asio::awaitable<std::size_t> writer::async_write_at(std::int64_t offset,
+                                                           void const* buffer,
+                                                           std::size_t size,
+                                                           boost::system::error_code& ec)
+{
+    co_return write_at(offset, buffer, size, ec);
+}
+boost::asio::awaitable<std::size_t> reader::async_read_at(std::int64_t offset, void* buffer, std::size_t size, boost::system::error_code& ec)
+{
+    co_return read_at(offset, buffer, size, ec);
+}
 
 }    // namespace leaf
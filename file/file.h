@@ -1,7 +1,10 @@
 #ifndef LEAF_FILE_FILE_H
 #define LEAF_FILE_FILE_H
 
+#include <span>
 #include <string>
+#include <vector>
+#include <boost/asio/awaitable.hpp>
 #include <boost/system/error_code.hpp>
 
 namespace leaf
@@ -11,6 +14,7 @@ std::string tmp_extension();
 std::string leaf_extension();
 std::string encode_tmp_filename(const std::string& p);
 std::string encode_leaf_filename(const std::string& p);
+std::string encode_state_filename(const std::string& p);
 std::string decode_tmp_filename(const std::string& p);
 std::string decode_leaf_filename(const std::string& p);
 std::string tmp_to_leaf_filename(const std::string& p);
@@ -21,6 +25,9 @@ bool is_dir(const std::string& path);
 bool is_file(const std::string& file);
 bool rename(const std::string& src, const std::string& dst);
 bool remove(const std::string& file);
+// 不小于 size 的文件在服务端绕过页缓存读写, 0 表示关闭
+void set_direct_io_size(uint64_t size);
+bool use_direct_io(uint64_t file_size);
 
 class file_impl;
 class writer
@@ -34,6 +41,11 @@ class writer
     virtual boost::system::error_code close() = 0;
     virtual std::size_t write(void const* buffer, std::size_t size, boost::system::error_code& ec) = 0;
     virtual std::size_t write_at(std::int64_t offset, void const* buffer, std::size_t size, boost::system::error_code& ec) = 0;
+    // 协程中写入, 默认直接调用同步版本
+    virtual boost::asio::awaitable<std::size_t> async_write_at(std::int64_t offset,
+                                                               void const* buffer,
+                                                               std::size_t size,
+                                                               boost::system::error_code& ec);
     virtual std::size_t size() = 0;
 };
 class reader
@@ -47,6 +59,8 @@ class reader
     virtual boost::system::error_code close() = 0;
     virtual std::size_t read(void* buffer, std::size_t size, boost::system::error_code& ec) = 0;
     virtual std::size_t read_at(std::int64_t offset, void* buffer, std::size_t size, boost::system::error_code& ec) = 0;
+    // 协程中读取, 默认直接调用同步版本
+    virtual boost::asio::awaitable<std::size_t> async_read_at(std::int64_t offset, void* buffer, std::size_t size, boost::system::error_code& ec);
     virtual std::size_t size() = 0;
 };
 
@@ -102,7 +116,8 @@ class null_reader : public reader
 class file_writer : public writer
 {
    public:
-    explicit file_writer(std::string filename);
+    // direct 为 true 时按 kDirectIoAlignment 对齐的读写使用 O_DIRECT, 其余仍走页缓存
+    explicit file_writer(std::string filename, bool direct = false);
     ~file_writer() override;
 
    public:
@@ -111,6 +126,15 @@ class file_writer : public writer
     boost::system::error_code close() override;
     std::size_t write(void const* buffer, std::size_t size, boost::system::error_code& ec) override;
     std::size_t write_at(std::int64_t offset, void const* buffer, std::size_t size, boost::system::error_code& ec) override;
+    // 由 get_file_io() 选择的后端执行
+    boost::asio::awaitable<std::size_t> async_write_at(std::int64_t offset,
+                                                       void const* buffer,
+                                                       std::size_t size,
+                                                       boost::system::error_code& ec) override;
+    // 连续的多个块一次写入
+    std::size_t writev_at(std::int64_t offset, const std::vector<std::span<const uint8_t>>& buffers, boost::system::error_code& ec);
+    // 为 [offset, offset + length) 预先分配磁盘空间, 不改变文件大小, 不支持的文件系统返回错误
+    boost::system::error_code preallocate(std::int64_t offset, std::int64_t length);
     std::size_t size() override;
 
    private:
@@ -120,7 +144,7 @@ class file_writer : public writer
 class file_reader : public reader
 {
    public:
-    explicit file_reader(std::string filename);
+    explicit file_reader(std::string filename, bool direct = false);
     ~file_reader() override;
 
    public:
@@ -129,6 +153,8 @@ class file_reader : public reader
     boost::system::error_code close() override;
     std::size_t read(void* buffer, std::size_t size, boost::system::error_code& ec) override;
     std::size_t read_at(std::int64_t offset, void* buffer, std::size_t size, boost::system::error_code& ec) override;
+    // 由 get_file_io() 选择的后端执行
+    boost::asio::awaitable<std::size_t> async_read_at(std::int64_t offset, void* buffer, std::size_t size, boost::system::error_code& ec) override;
     std::size_t size() override;
 
    private:
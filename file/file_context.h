@@ -12,6 +12,11 @@ struct file_info
     std::string filename;
     std::string local_path;
     std::string dir;
+    // 分段传输的范围, length 为 0 表示整个文件
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    uint64_t range_id = 0;    // 同一文件的所有分段共享
+    std::string hash;         // 整个文件的 blake2b hex 摘要, 秒传使用
 };
 
 }    // namespace leaf
@@ -1,15 +1,29 @@
+#include <charconv>
+#include <algorithm>
+#include <filesystem>
+#include <boost/url.hpp>
 #include <boost/algorithm/string.hpp>
 
 #include "log/log.h"
+#include "crypt/easy.h"
+#include "crypt/blake2b.h"
+#include "config/config.h"
+#include "net/scoped_exit.hpp"
 #include "crypt/passwd.h"
 #include "protocol/codec.h"
 #include "protocol/message.h"
+#include "file/file.h"
+#include "file/block_cache.h"
+#include "file/digest_index.h"
+#include "file/group_commit.h"
+#include "file/hash_manifest.h"
 #include "file/file_session.h"
 #include "file/file_http_handle.h"
 #include "file/cotrol_file_handle.h"
 #include "file/upload_file_handle.h"
 #include "file/download_file_handle.h"
 #include "file/file_session_manager.h"
+#include "file/metadata_executor.h"
 
 namespace leaf
 {
@@ -35,9 +49,417 @@ leaf::websocket_handle::ptr websocket_handle(const boost::asio::any_io_executor
     return nullptr;
 }
 
+static void write_status(const leaf::http_session::ptr &session, const leaf::http_session::http_request_ptr &req, boost::beast::http::status status)
+{
+    boost::beast::http::response<boost::beast::http::string_body> response{status, req->version()};
+    response.set(boost::beast::http::field::content_type, "text/plain");
+    response.prepare_payload();
+    response.keep_alive(req->keep_alive());
+    session->write(std::make_shared<boost::beast::http::message_generator>(std::move(response)));
+}
+
+static std::string make_etag(const leaf::block_cache::file_key &key)
+{
+    return fmt::format("\"{:x}-{:x}-{:x}\"", key.inode, key.size, static_cast<uint64_t>(key.mtime));
+}
+
+// If-None-Match 是逗号分隔的列表, 弱比较时去掉 W/ 前缀
+static bool etag_match(boost::beast::string_view header, const std::string &etag)
+{
+    std::vector<std::string> tags;
+    boost::split(tags, header, boost::is_any_of(","));
+    for (auto &tag : tags)
+    {
+        boost::trim(tag);
+        if (tag == "*" || boost::erase_first_copy(tag, "W/") == etag)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 只支持单个区间 bytes=a-b, bytes=a-, bytes=-n, 多个区间时返回 nullopt 按整个文件响应
+// 区间不能满足时 satisfiable 为 false
+struct byte_range
+{
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    bool satisfiable = true;
+};
+static std::optional<byte_range> parse_range(boost::beast::string_view header, uint64_t size)
+{
+    if (!header.starts_with("bytes=") || header.find(',') != boost::beast::string_view::npos)
+    {
+        return {};
+    }
+    std::string spec(header.substr(6));
+    boost::trim(spec);
+    auto dash = spec.find('-');
+    if (dash == std::string::npos)
+    {
+        return byte_range{0, 0, false};
+    }
+    std::string first = spec.substr(0, dash);
+    std::string last = spec.substr(dash + 1);
+    auto to_number = [](const std::string &s, uint64_t &v)
+    {
+        if (s.empty() || !std::all_of(s.begin(), s.end(), [](char c) { return c >= '0' && c <= '9'; }))
+        {
+            return false;
+        }
+        auto [ptr, err] = std::from_chars(s.data(), s.data() + s.size(), v);
+        return err == std::errc{} && ptr == s.data() + s.size();
+    };
+    uint64_t a = 0;
+    uint64_t b = 0;
+    if (first.empty())
+    {
+        // 最后 n 个字节
+        if (!to_number(last, b) || b == 0 || size == 0)
+        {
+            return byte_range{0, 0, false};
+        }
+        b = std::min(b, size);
+        return byte_range{size - b, b, true};
+    }
+    if (!to_number(first, a) || a >= size)
+    {
+        return byte_range{0, 0, false};
+    }
+    if (last.empty())
+    {
+        return byte_range{a, size - a, true};
+    }
+    if (!to_number(last, b) || b < a)
+    {
+        return byte_range{0, 0, false};
+    }
+    b = std::min(b, size - 1);
+    return byte_range{a, b - a + 1, true};
+}
+
+// dir 相对 kDefaultDir, 规范化之后必须仍在用户目录下
+static bool under_user_path(const std::string &token, const std::filesystem::path &dir)
+{
+    auto root = std::filesystem::path(leaf::make_user_path(token)).lexically_normal();
+    auto resolved = std::filesystem::path(leaf::kDefaultDir).append(dir.string()).lexically_normal();
+    auto rel = resolved.lexically_relative(root);
+    return !rel.empty() && *rel.begin() != "..";
+}
+
+// /download/<dir>/<filename> 和 /upload/<dir>/<filename> 共用, Authorization: Bearer <token>
+// 失败时已经写出错误响应
+struct http_target
+{
+    std::string token;
+    std::string dir;
+    std::string filename;
+};
+static std::optional<http_target> parse_target(const leaf::http_session::ptr &session, const leaf::http_session::http_request_ptr &req)
+{
+    std::string auth(req->base()[boost::beast::http::field::authorization]);
+    if (!boost::istarts_with(auth, "Bearer "))
+    {
+        write_status(session, req, boost::beast::http::status::unauthorized);
+        return {};
+    }
+    std::string token = boost::trim_copy(auth.substr(7));
+    if (token.empty() || leaf::fsm::instance().get_session(token) == nullptr)
+    {
+        write_status(session, req, boost::beast::http::status::unauthorized);
+        return {};
+    }
+    auto url = boost::urls::parse_origin_form(req->target());
+    if (!url)
+    {
+        write_status(session, req, boost::beast::http::status::bad_request);
+        return {};
+    }
+    std::vector<std::string> segments(url->segments().begin(), url->segments().end());
+    if (segments.size() < 2 || segments.back().empty())
+    {
+        write_status(session, req, boost::beast::http::status::bad_request);
+        return {};
+    }
+    // 解码后的路径段不能跳出用户目录, 以 / 开头的段会让 append 丢掉前面的 token
+    for (std::size_t i = 1; i < segments.size(); i++)
+    {
+        const auto &seg = segments[i];
+        if (seg.empty() || seg == "." || seg == ".." || seg.find_first_of("/\\") != std::string::npos)
+        {
+            write_status(session, req, boost::beast::http::status::bad_request);
+            return {};
+        }
+    }
+    auto dir = std::filesystem::path(token);
+    for (std::size_t i = 1; i + 1 < segments.size(); i++)
+    {
+        dir.append(segments[i]);
+    }
+    if (!under_user_path(token, dir))
+    {
+        write_status(session, req, boost::beast::http::status::forbidden);
+        return {};
+    }
+    return http_target{token, dir.string(), segments.back()};
+}
+
+// GET/HEAD /download/<dir>/<filename>
+static void download_handle(const leaf::http_session::ptr &session, const leaf::http_session::http_request_ptr &req)
+{
+    if (req->method() != boost::beast::http::verb::get && req->method() != boost::beast::http::verb::head)
+    {
+        write_status(session, req, boost::beast::http::status::method_not_allowed);
+        return;
+    }
+    auto target = parse_target(session, req);
+    if (!target.has_value())
+    {
+        return;
+    }
+    // 路径解析和 stat 在元数据线程池上执行, 响应通过 session 回到连接的执行器
+    boost::asio::post(leaf::metadata_executor(target->token),
+                      [session, req, dir = target->dir, filename = target->filename]()
+                      {
+                          auto file_path = leaf::make_file_path(dir, leaf::encode(filename));
+                          if (file_path.empty())
+                          {
+                              write_status(session, req, boost::beast::http::status::not_found);
+                              return;
+                          }
+                          auto leaf_path = leaf::encode_leaf_filename(file_path);
+                          auto key = leaf::block_cache::key_of(leaf_path);
+                          if (!key.has_value() || !leaf::is_file(leaf_path))
+                          {
+                              write_status(session, req, boost::beast::http::status::not_found);
+                              return;
+                          }
+                          auto etag = make_etag(*key);
+                          auto file = std::make_shared<leaf::http_file>();
+                          auto &header = file->header;
+                          header.version(req->version());
+                          header.keep_alive(req->keep_alive());
+                          header.set(boost::beast::http::field::etag, etag);
+                          header.set(boost::beast::http::field::accept_ranges, "bytes");
+
+                          auto if_none_match = req->base()[boost::beast::http::field::if_none_match];
+                          if (!if_none_match.empty() && etag_match(if_none_match, etag))
+                          {
+                              header.result(boost::beast::http::status::not_modified);
+                              session->write(std::make_shared<boost::beast::http::message_generator>(std::move(header)));
+                              return;
+                          }
+
+                          file->path = leaf_path;
+                          file->offset = 0;
+                          file->length = key->size;
+                          header.result(boost::beast::http::status::ok);
+                          auto range_header = req->base()[boost::beast::http::field::range];
+                          auto if_range = req->base()[boost::beast::http::field::if_range];
+                          // If-Range 不匹配时文件已变化, 忽略 Range 返回整个文件
+                          if (!range_header.empty() && (if_range.empty() || if_range == etag))
+                          {
+                              auto range = parse_range(range_header, key->size);
+                              if (range.has_value() && !range->satisfiable)
+                              {
+                                  header.result(boost::beast::http::status::range_not_satisfiable);
+                                  header.set(boost::beast::http::field::content_range, fmt::format("bytes */{}", key->size));
+                                  header.content_length(0);
+                                  session->write(std::make_shared<boost::beast::http::message_generator>(std::move(header)));
+                                  return;
+                              }
+                              if (range.has_value())
+                              {
+                                  file->offset = range->offset;
+                                  file->length = range->length;
+                                  header.result(boost::beast::http::status::partial_content);
+                                  header.set(boost::beast::http::field::content_range,
+                                             fmt::format("bytes {}-{}/{}", range->offset, range->offset + range->length - 1, key->size));
+                              }
+                          }
+                          header.set(boost::beast::http::field::content_type, "application/octet-stream");
+                          header.content_length(file->length);
+                          LOG_INFO("http download {} offset {} length {}", leaf_path, file->offset, file->length);
+                          if (req->method() == boost::beast::http::verb::head || file->length == 0)
+                          {
+                              session->write(std::make_shared<boost::beast::http::message_generator>(std::move(header)));
+                              return;
+                          }
+                          session->write_file(file);
+                      });
+}
+
+// 正文边读边写到临时文件并计算摘要, 读完后与 websocket 上传一样改名为 .leaf
+static boost::asio::awaitable<void> upload_coro(leaf::http_session::ptr session, leaf::http_session::http_request_ptr req, http_target target)
+{
+    boost::beast::error_code ec;
+    uint64_t content_length = 0;
+    auto length_header = req->base()[boost::beast::http::field::content_length];
+    if (!length_header.empty())
+    {
+        auto [ptr, err] = std::from_chars(length_header.data(), length_header.data() + length_header.size(), content_length);
+        if (err != std::errc{} || ptr != length_header.data() + length_header.size())
+        {
+            write_status(session, req, boost::beast::http::status::bad_request);
+            co_return;
+        }
+    }
+    // 上传会创建目录并提交文件, 写入前再确认目标在用户目录下
+    if (!under_user_path(target.token, target.dir))
+    {
+        write_status(session, req, boost::beast::http::status::forbidden);
+        co_return;
+    }
+    auto leaf_path = co_await leaf::offload_metadata(target.token,
+                                                     [&]()
+                                                     {
+                                                         auto file_path = leaf::make_file_path(target.dir, leaf::encode(target.filename));
+                                                         return file_path.empty() ? file_path : leaf::encode_leaf_filename(file_path);
+                                                     });
+    if (leaf_path.empty())
+    {
+        write_status(session, req, boost::beast::http::status::bad_request);
+        co_return;
+    }
+    // 临时文件名带唯一编号, 不会与同一文件上正在进行的 websocket 上传冲突
+    auto tmp_path = fmt::format("{}.{}{}", leaf_path, leaf::file_id(), kTmpFilenameSuffix);
+    auto remove_tmp = leaf::make_scoped_exit([&]() { leaf::remove(tmp_path); });
+    leaf::file_writer writer(tmp_path, leaf::use_direct_io(content_length));
+    ec = writer.open();
+    if (ec)
+    {
+        LOG_ERROR("http upload open {} error {}", tmp_path, ec.message());
+        write_status(session, req, boost::beast::http::status::internal_server_error);
+        co_return;
+    }
+    // 预分配受 kPreallocateMaxSize 和剩余空间限制, 关闭时释放没有写到的部分
+    if (content_length != 0)
+    {
+        auto pre_ec = writer.preallocate(0, static_cast<int64_t>(content_length));
+        if (pre_ec)
+        {
+            LOG_DEBUG("http upload preallocate {} error {}", tmp_path, pre_ec.message());
+        }
+    }
+    // 正文顺序到达, 摘要和清单一起计算
+    leaf::manifest_builder hash;
+    std::vector<uint8_t> buffer(kMaxBlockSize);
+    uint64_t size = 0;
+    while (true)
+    {
+        auto n = co_await session->read_body(buffer.data(), buffer.size(), ec);
+        if (ec)
+        {
+            // 连接上的正文已经不完整, 只能断开
+            LOG_ERROR("http upload {} read body error {}", leaf_path, ec.message());
+            auto _ = writer.close();
+            session->shutdown();
+            co_return;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        co_await writer.async_write_at(static_cast<int64_t>(size), buffer.data(), n, ec);
+        if (ec)
+        {
+            LOG_ERROR("http upload write {} error {}", tmp_path, ec.message());
+            auto _ = writer.close();
+            write_status(session, req, boost::beast::http::status::internal_server_error);
+            co_return;
+        }
+        hash.update(buffer.data(), n);
+        size += n;
+    }
+    ec = writer.close();
+    if (ec)
+    {
+        LOG_ERROR("http upload close {} error {}", tmp_path, ec.message());
+        write_status(session, req, boost::beast::http::status::internal_server_error);
+        co_return;
+    }
+    leaf::group_commit::files commit{{tmp_path, leaf_path}};
+    ec = co_await leaf::commit_files(target.token, std::move(commit));
+    if (ec)
+    {
+        LOG_ERROR("http upload commit {} error {}", leaf_path, ec.message());
+        write_status(session, req, boost::beast::http::status::internal_server_error);
+        co_return;
+    }
+    remove_tmp.cancel();
+    auto digest = hash.hex();
+    if (size >= kInstantSize)
+    {
+        co_await leaf::offload_metadata(target.token,
+                                        [&]()
+                                        {
+                                            leaf::digest_index::instance().put(target.token, digest, size, leaf_path);
+                                            if (size < kManifestMinSize)
+                                            {
+                                                return;
+                                            }
+                                            auto manifest_ec = hash.write(leaf_path);
+                                            if (manifest_ec)
+                                            {
+                                                LOG_WARN("http upload {} write hash manifest error {}", leaf_path, manifest_ec.message());
+                                            }
+                                        });
+    }
+    LOG_INFO("http upload {} size {} digest {}", leaf_path, size, digest);
+
+    boost::beast::http::response<boost::beast::http::string_body> response{boost::beast::http::status::created, req->version()};
+    response.set(boost::beast::http::field::content_type, "text/plain");
+    response.body() = digest;
+    response.prepare_payload();
+    response.keep_alive(req->keep_alive());
+    session->write(std::make_shared<boost::beast::http::message_generator>(std::move(response)));
+}
+
+// PUT /upload/<dir>/<filename>, 支持 Content-Length 和 chunked 编码
+static void upload_handle(const leaf::http_session::ptr &session, const leaf::http_session::http_request_ptr &req)
+{
+    if (req->method() != boost::beast::http::verb::put)
+    {
+        write_status(session, req, boost::beast::http::status::method_not_allowed);
+        return;
+    }
+    auto target = parse_target(session, req);
+    if (!target.has_value())
+    {
+        return;
+    }
+    boost::asio::co_spawn(session->get_executor(),
+                          upload_coro(session, req, std::move(*target)),
+                          [session](const std::exception_ptr &e)
+                          {
+                              if (e)
+                              {
+                                  LOG_ERROR("http upload exception");
+                                  session->shutdown();
+                              }
+                          });
+}
+
 void http_handle(const leaf::http_session::ptr &session, const leaf::http_session::http_request_ptr &req)
 {
     auto target = req->target();
+    if (target.starts_with("/download/"))
+    {
+        download_handle(session, req);
+        return;
+    }
+    if (target.starts_with("/upload/"))
+    {
+        upload_handle(session, req);
+        return;
+    }
+    // 其余 PUT 的正文没有读取, 连接在响应后关闭
+    if (req->method() == boost::beast::http::verb::put)
+    {
+        write_status(session, req, boost::beast::http::status::not_found);
+        return;
+    }
     if (!target.ends_with("login"))
     {
         session->shutdown();
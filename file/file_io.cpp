@@ -0,0 +1,283 @@
+#include <uv.h>
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <climits>
+#include <cstdlib>
+#include <boost/asio.hpp>
+#include <boost/asio/any_completion_handler.hpp>
+#include "log/log.h"
+#include "file/file_io.h"
+#include "file/thread_pools.h"
+
+namespace leaf
+{
+static std::size_t read_result(ssize_t result, boost::system::error_code& ec)
+{
+    if (result < 0)
+    {
+        static constexpr boost::source_location loc = BOOST_CURRENT_LOCATION;
+        int err = uv_translate_sys_error(static_cast<int>(result));
+        ec.assign(err, boost::system::generic_category(), &loc);
+        return 0;
+    }
+    if (result == 0)
+    {
+        ec = boost::asio::error::eof;
+        return 0;
+    }
+    ec = {};
+    return static_cast<std::size_t>(result);
+}
+
+static std::size_t write_result(ssize_t result, boost::system::error_code& ec)
+{
+    if (result < 0)
+    {
+        static constexpr boost::source_location loc = BOOST_CURRENT_LOCATION;
+        int err = uv_translate_sys_error(static_cast<int>(result));
+        ec.assign(err, boost::system::system_category(), &loc);
+        return 0;
+    }
+    return static_cast<std::size_t>(result);
+}
+
+static bool invalid_size(std::size_t size, boost::system::error_code& ec)
+{
+    if (size > SSIZE_MAX)
+    {
+        static constexpr boost::source_location loc = BOOST_CURRENT_LOCATION;
+        ec.assign(EINVAL, boost::system::generic_category(), &loc);
+        return true;
+    }
+    return false;
+}
+
+std::size_t sync_read_at(int file, std::int64_t offset, void* buffer, std::size_t size, boost::system::error_code& ec)
+{
+    if (invalid_size(size, ec))
+    {
+        return 0;
+    }
+    uv_fs_t read_req;
+    uv_buf_t buf = uv_buf_init(static_cast<char*>(buffer), size);
+    uv_fs_read(nullptr, &read_req, file, &buf, 1, offset, nullptr);
+    auto read_size = read_result(read_req.result, ec);
+    uv_fs_req_cleanup(&read_req);
+    return read_size;
+}
+
+std::size_t sync_write_at(int file, std::int64_t offset, void const* buffer, std::size_t size, boost::system::error_code& ec)
+{
+    if (invalid_size(size, ec))
+    {
+        return 0;
+    }
+    uv_fs_t write_req;
+    uv_buf_t buf = uv_buf_init(const_cast<char*>(static_cast<char const*>(buffer)), size);
+    uv_fs_write(nullptr, &write_req, file, &buf, 1, offset, nullptr);
+    auto write_size = write_result(write_req.result, ec);
+    uv_fs_req_cleanup(&write_req);
+    return write_size;
+}
+
+std::size_t sync_writev_at(int file, std::int64_t offset, const std::vector<std::span<const uint8_t>>& buffers, boost::system::error_code& ec)
+{
+    std::vector<uv_buf_t> bufs;
+    bufs.reserve(buffers.size());
+    std::size_t size = 0;
+    for (const auto& b : buffers)
+    {
+        bufs.push_back(uv_buf_init(const_cast<char*>(reinterpret_cast<char const*>(b.data())), b.size()));
+        size += b.size();
+    }
+    if (invalid_size(size, ec))
+    {
+        return 0;
+    }
+    uv_fs_t write_req;
+    uv_fs_write(nullptr, &write_req, file, bufs.data(), bufs.size(), offset, nullptr);
+    auto write_size = write_result(write_req.result, ec);
+    uv_fs_req_cleanup(&write_req);
+    return write_size;
+}
+
+class thread_pool_file_io : public file_io
+{
+   public:
+    [[nodiscard]] std::string name() const override { return "thread_pool"; }
+
+    boost::asio::awaitable<std::size_t> read_at(int file, std::int64_t offset, void* buffer, std::size_t size, boost::system::error_code& ec) override
+    {
+        co_return co_await boost::asio::co_spawn(
+            leaf::disk_pool(),
+            [file, offset, buffer, size, &ec]() -> boost::asio::awaitable<std::size_t> { co_return sync_read_at(file, offset, buffer, size, ec); },
+            boost::asio::use_awaitable);
+    }
+
+    boost::asio::awaitable<std::size_t> write_at(
+        int file, std::int64_t offset, void const* buffer, std::size_t size, boost::system::error_code& ec) override
+    {
+        co_return co_await boost::asio::co_spawn(
+            leaf::disk_pool(),
+            [file, offset, buffer, size, &ec]() -> boost::asio::awaitable<std::size_t> { co_return sync_write_at(file, offset, buffer, size, ec); },
+            boost::asio::use_awaitable);
+    }
+};
+
+// 所有请求在一个 libuv 循环线程上提交, 完成后回到发起协程的执行器
+class uv_file_io : public file_io
+{
+   private:
+    using handler = boost::asio::any_completion_handler<void(boost::system::error_code, std::size_t)>;
+    struct request
+    {
+        uv_fs_t req;
+        uv_buf_t buf;
+        int file = -1;
+        std::int64_t offset = 0;
+        bool write = false;
+        handler h;
+    };
+
+   public:
+    uv_file_io()
+    {
+        uv_loop_init(&loop_);
+        uv_async_init(&loop_, &async_, on_async);
+        async_.data = this;
+        thread_ = std::thread([this]() { uv_run(&loop_, UV_RUN_DEFAULT); });
+    }
+    ~uv_file_io() override
+    {
+        stop_ = true;
+        uv_async_send(&async_);
+        thread_.join();
+        uv_loop_close(&loop_);
+    }
+
+   public:
+    [[nodiscard]] std::string name() const override { return "libuv"; }
+
+    boost::asio::awaitable<std::size_t> read_at(int file, std::int64_t offset, void* buffer, std::size_t size, boost::system::error_code& ec) override
+    {
+        co_return co_await submit(file, offset, buffer, size, false, ec);
+    }
+
+    boost::asio::awaitable<std::size_t> write_at(
+        int file, std::int64_t offset, void const* buffer, std::size_t size, boost::system::error_code& ec) override
+    {
+        co_return co_await submit(file, offset, const_cast<void*>(buffer), size, true, ec);
+    }
+
+   private:
+    boost::asio::awaitable<std::size_t> submit(int file, std::int64_t offset, void* buffer, std::size_t size, bool write, boost::system::error_code& ec)
+    {
+        if (invalid_size(size, ec))
+        {
+            co_return 0;
+        }
+        auto token = boost::asio::redirect_error(boost::asio::use_awaitable, ec);
+        co_return co_await boost::asio::async_initiate<decltype(token), void(boost::system::error_code, std::size_t)>(
+            [this, file, offset, buffer, size, write](auto h)
+            {
+                auto req = std::make_unique<request>();
+                req->buf = uv_buf_init(static_cast<char*>(buffer), size);
+                req->file = file;
+                req->offset = offset;
+                req->write = write;
+                req->h = std::move(h);
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    queue_.push_back(std::move(req));
+                }
+                uv_async_send(&async_);
+            },
+            token);
+    }
+
+    static void on_async(uv_async_t* handle)
+    {
+        auto* self = static_cast<uv_file_io*>(handle->data);
+        std::deque<std::unique_ptr<request>> queue;
+        {
+            std::lock_guard<std::mutex> lock(self->mutex_);
+            queue.swap(self->queue_);
+        }
+        for (auto& r : queue)
+        {
+            auto* req = r.release();
+            req->req.data = req;
+            int ret = req->write ? uv_fs_write(&self->loop_, &req->req, req->file, &req->buf, 1, req->offset, on_fs)
+                                 : uv_fs_read(&self->loop_, &req->req, req->file, &req->buf, 1, req->offset, on_fs);
+            // 提交失败时不会有回调
+            if (ret < 0)
+            {
+                complete(std::unique_ptr<request>(req), ret);
+            }
+        }
+        // 没有活动的句柄和请求后循环退出
+        if (self->stop_)
+        {
+            uv_close(reinterpret_cast<uv_handle_t*>(&self->async_), nullptr);
+        }
+    }
+
+    static void on_fs(uv_fs_t* fs)
+    {
+        std::unique_ptr<request> req(static_cast<request*>(fs->data));
+        auto result = fs->result;
+        uv_fs_req_cleanup(fs);
+        complete(std::move(req), result);
+    }
+
+    static void complete(std::unique_ptr<request> req, ssize_t result)
+    {
+        boost::system::error_code ec;
+        auto size = req->write ? write_result(result, ec) : read_result(result, ec);
+        auto ex = boost::asio::get_associated_executor(req->h);
+        boost::asio::post(ex, [h = std::move(req->h), ec, size]() mutable { std::move(h)(ec, size); });
+    }
+
+   private:
+    uv_loop_t loop_;
+    uv_async_t async_;
+    std::thread thread_;
+    std::atomic<bool> stop_ = false;
+    std::mutex mutex_;
+    std::deque<std::unique_ptr<request>> queue_;
+};
+
+static std::unique_ptr<file_io>& backend()
+{
+    static std::unique_ptr<file_io> io = std::make_unique<thread_pool_file_io>();
+    return io;
+}
+
+bool set_file_io(const std::string& name)
+{
+    if (name == "thread_pool")
+    {
+        backend() = std::make_unique<thread_pool_file_io>();
+    }
+    else if (name == "libuv")
+    {
+#ifdef __linux__
+        // 新版本 libuv 默认不对文件读写使用 io_uring, 需要在创建循环前打开, 内核不支持时 libuv 自行退回线程池
+        setenv("UV_USE_IO_URING", "1", 0);
+#endif
+        backend() = std::make_unique<uv_file_io>();
+    }
+    else
+    {
+        LOG_WARN("unknown file io {}, keep {}", name, backend()->name());
+        return false;
+    }
+    LOG_INFO("file io {}", backend()->name());
+    return true;
+}
+
+file_io& get_file_io() { return *backend(); }
+}    // namespace leaf
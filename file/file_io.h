@@ -0,0 +1,40 @@
+#ifndef LEAF_FILE_FILE_IO_H
+#define LEAF_FILE_FILE_IO_H
+
+#include <span>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <boost/asio/awaitable.hpp>
+#include <boost/system/error_code.hpp>
+
+namespace leaf
+{
+// 异步文件读写后端, 协程等待读写完成, 磁盘慢时不阻塞网络线程
+// thread_pool 在 disk_pool 上执行阻塞读写
+// libuv 在独立的 libuv 循环上提交, 是否使用 io_uring 由 libuv 按版本和内核决定, 不支持时就是 libuv 线程池
+class file_io
+{
+   public:
+    virtual ~file_io() = default;
+
+   public:
+    [[nodiscard]] virtual std::string name() const = 0;
+    // 与同步版本一样, 读到文件末尾时 ec 为 eof
+    virtual boost::asio::awaitable<std::size_t> read_at(int file, std::int64_t offset, void* buffer, std::size_t size, boost::system::error_code& ec) = 0;
+    virtual boost::asio::awaitable<std::size_t> write_at(
+        int file, std::int64_t offset, void const* buffer, std::size_t size, boost::system::error_code& ec) = 0;
+};
+
+// 启动时选择后端, name 为 thread_pool 或 libuv, 不支持时返回 false 并保持原来的后端
+bool set_file_io(const std::string& name);
+file_io& get_file_io();
+
+// 阻塞读写, thread_pool 后端和 file_reader/file_writer 的同步接口共用
+std::size_t sync_read_at(int file, std::int64_t offset, void* buffer, std::size_t size, boost::system::error_code& ec);
+std::size_t sync_write_at(int file, std::int64_t offset, void const* buffer, std::size_t size, boost::system::error_code& ec);
+// 多个连续的缓冲区一次写入 (pwritev), 部分写入时继续写完
+std::size_t sync_writev_at(int file, std::int64_t offset, const std::vector<std::span<const uint8_t>>& buffers, boost::system::error_code& ec);
+}    // namespace leaf
+
+#endif
@@ -5,6 +5,7 @@
 
 #include "log/log.h"
 #include "crypt/random.h"
+#include "config/config.h"
 #include "net/exception.h"
 #include "protocol/message.h"
 #include "file/file_transfer_client.h"
@@ -36,9 +37,31 @@ void file_transfer_client::startup()
     cotrol_ = std::make_shared<leaf::cotrol_session>(id_, host_, port_, token_, executors.get_executor());
     upload_ = std::make_shared<leaf::upload_session>(id_, host_, port_, token_, executors.get_executor());
     download_ = std::make_shared<leaf::download_session>(id_, host_, port_, token_, executors.get_executor());
+    std::vector<std::weak_ptr<leaf::upload_session>> upload_sessions{upload_};
+    std::vector<std::weak_ptr<leaf::download_session>> download_sessions{download_};
+    for (int i = 1; i < kRangeConnections; i++)
+    {
+        auto range_id = fmt::format("{}-{}", id_, i);
+        auto u = std::make_shared<leaf::upload_session>(range_id, host_, port_, token_, executors.get_executor());
+        auto d = std::make_shared<leaf::download_session>(range_id, host_, port_, token_, executors.get_executor());
+        upload_sessions.push_back(u);
+        download_sessions.push_back(d);
+        upload_ranges_.push_back(u);
+        download_ranges_.push_back(d);
+    }
+    upload_->set_range_sessions(upload_sessions);
+    download_->set_range_sessions(download_sessions);
     cotrol_->startup();
     upload_->startup();
     download_->startup();
+    for (auto &u : upload_ranges_)
+    {
+        u->startup();
+    }
+    for (auto &d : download_ranges_)
+    {
+        d->startup();
+    }
 }
 
 void file_transfer_client::shutdown()
@@ -69,6 +92,16 @@ boost::asio::awaitable<void> file_transfer_client::shutdown_coro()
         download_->shutdown();
         download_.reset();
     }
+    for (auto &u : upload_ranges_)
+    {
+        u->shutdown();
+    }
+    upload_ranges_.clear();
+    for (auto &d : download_ranges_)
+    {
+        d->shutdown();
+    }
+    download_ranges_.clear();
     if (cotrol_)
     {
         cotrol_->shutdown();
@@ -46,6 +46,9 @@ class file_transfer_client : public std::enable_shared_from_this<file_transfer_c
     std::shared_ptr<leaf::cotrol_session> cotrol_;
     std::shared_ptr<leaf::upload_session> upload_;
     std::shared_ptr<leaf::download_session> download_;
+    // 大文件分段使用的额外连接
+    std::vector<std::shared_ptr<leaf::upload_session>> upload_ranges_;
+    std::vector<std::shared_ptr<leaf::download_session>> download_ranges_;
 };
 
 }    // namespace leaf
@@ -0,0 +1,196 @@
+#include <uv.h>
+#include <set>
+#include <map>
+#include <filesystem>
+#include "log/log.h"
+#include "file/file.h"
+#include "config/config.h"
+#include "file/group_commit.h"
+#include "file/thread_pools.h"
+#include "file/metadata_executor.h"
+
+namespace leaf
+{
+static boost::system::error_code uv_error(ssize_t result)
+{
+    static constexpr boost::source_location loc = BOOST_CURRENT_LOCATION;
+    boost::system::error_code ec;
+    ec.assign(uv_translate_sys_error(static_cast<int>(result)), boost::system::system_category(), &loc);
+    return ec;
+}
+
+// data 为 true 时 fdatasync 文件, 否则 fsync 目录
+static boost::system::error_code sync_path(const std::string& path, bool data)
+{
+#ifdef _WIN32
+    // Windows 不能打开目录同步, 改名由文件系统日志保证
+    if (!data)
+    {
+        return {};
+    }
+#endif
+    uv_fs_t open_req;
+    uv_fs_open(nullptr, &open_req, path.c_str(), data ? UV_FS_O_RDWR : UV_FS_O_RDONLY, 0, nullptr);
+    auto result = open_req.result;
+    uv_fs_req_cleanup(&open_req);
+    if (result < 0)
+    {
+        return uv_error(result);
+    }
+    auto file = static_cast<uv_file>(result);
+    uv_fs_t sync_req;
+    if (data)
+    {
+        uv_fs_fdatasync(nullptr, &sync_req, file, nullptr);
+    }
+    else
+    {
+        uv_fs_fsync(nullptr, &sync_req, file, nullptr);
+    }
+    result = sync_req.result;
+    uv_fs_req_cleanup(&sync_req);
+    uv_fs_t close_req;
+    uv_fs_close(nullptr, &close_req, file, nullptr);
+    uv_fs_req_cleanup(&close_req);
+    if (result < 0)
+    {
+        return uv_error(result);
+    }
+    return {};
+}
+
+group_commit& group_commit::instance()
+{
+    static group_commit instance;
+    return instance;
+}
+
+boost::asio::awaitable<boost::system::error_code> group_commit::commit(files f)
+{
+    boost::system::error_code ec;
+    auto token = boost::asio::redirect_error(boost::asio::use_awaitable, ec);
+    co_await boost::asio::async_initiate<decltype(token), void(boost::system::error_code)>(
+        [this, &f](auto h)
+        {
+            bool now = false;
+            bool schedule = false;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                pending_.push_back(entry{std::move(f), std::move(h)});
+                now = pending_.size() >= kGroupCommitFiles;
+                schedule = !now && !scheduled_;
+                scheduled_ = scheduled_ || schedule;
+            }
+            // 窗口内的提交合并到同一组, 文件数达到上限时不再等待
+            if (now)
+            {
+                boost::asio::post(leaf::disk_pool(), [this]() { flush(); });
+            }
+            else if (schedule)
+            {
+                auto timer = std::make_shared<boost::asio::steady_timer>(leaf::disk_pool(), std::chrono::milliseconds(kGroupCommitWindow));
+                timer->async_wait([this, timer](const boost::system::error_code&) { flush(); });
+            }
+        },
+        token);
+    co_return ec;
+}
+
+void group_commit::flush()
+{
+    std::vector<entry> batch;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        batch.swap(pending_);
+        scheduled_ = false;
+    }
+    if (batch.empty())
+    {
+        return;
+    }
+    std::vector<boost::system::error_code> results(batch.size());
+    // 1. 数据落盘
+    for (std::size_t i = 0; i < batch.size(); i++)
+    {
+        for (const auto& [tmp_path, leaf_path] : batch[i].f)
+        {
+            results[i] = sync_path(tmp_path, true);
+            if (results[i])
+            {
+                LOG_ERROR("group commit sync {} error {}", tmp_path, results[i].message());
+                break;
+            }
+        }
+    }
+    // 2. 改名
+    std::map<std::string, boost::system::error_code> dirs;
+    for (std::size_t i = 0; i < batch.size(); i++)
+    {
+        if (results[i])
+        {
+            continue;
+        }
+        for (const auto& [tmp_path, leaf_path] : batch[i].f)
+        {
+            if (!leaf::rename(tmp_path, leaf_path))
+            {
+                LOG_ERROR("group commit rename {} to {} error", tmp_path, leaf_path);
+                results[i] = boost::system::errc::make_error_code(boost::system::errc::io_error);
+                break;
+            }
+            dirs.emplace(std::filesystem::path(leaf_path).parent_path().string(), boost::system::error_code{});
+        }
+    }
+    // 3. 每个目录只 fsync 一次, 改名之后目录项才持久
+    for (auto& [dir, ec] : dirs)
+    {
+        ec = sync_path(dir, false);
+        if (ec)
+        {
+            LOG_ERROR("group commit sync dir {} error {}", dir, ec.message());
+        }
+    }
+    for (std::size_t i = 0; i < batch.size(); i++)
+    {
+        for (const auto& [tmp_path, leaf_path] : batch[i].f)
+        {
+            auto it = dirs.find(std::filesystem::path(leaf_path).parent_path().string());
+            if (!results[i] && it != dirs.end() && it->second)
+            {
+                results[i] = it->second;
+            }
+        }
+        auto ex = boost::asio::get_associated_executor(batch[i].h);
+        boost::asio::post(ex, [h = std::move(batch[i].h), ec = results[i]]() mutable { std::move(h)(ec); });
+    }
+    LOG_DEBUG("group commit {} uploads {} dirs", batch.size(), dirs.size());
+}
+
+boost::asio::awaitable<boost::system::error_code> commit_files(const std::string& user, group_commit::files files)
+{
+    boost::system::error_code ec;
+    if (group_commit::instance().durable())
+    {
+        ec = co_await group_commit::instance().commit(files);
+    }
+    else
+    {
+        ec = co_await leaf::offload_metadata(user,
+                                             [&files]()
+                                             {
+                                                 boost::system::error_code ec;
+                                                 for (const auto& [tmp_path, leaf_path] : files)
+                                                 {
+                                                     if (!leaf::rename(tmp_path, leaf_path))
+                                                     {
+                                                         LOG_ERROR("rename {} to {} error", tmp_path, leaf_path);
+                                                         ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+                                                         break;
+                                                     }
+                                                 }
+                                                 return ec;
+                                             });
+    }
+    co_return ec;
+}
+}    // namespace leaf
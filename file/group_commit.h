@@ -0,0 +1,53 @@
+#ifndef LEAF_FILE_GROUP_COMMIT_H
+#define LEAF_FILE_GROUP_COMMIT_H
+
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <utility>
+#include <boost/asio.hpp>
+#include <boost/asio/any_completion_handler.hpp>
+
+namespace leaf
+{
+// 上传完成时把临时文件改名为正式文件
+// 持久模式下先 fdatasync 文件数据, 改名后再 fsync 所在目录, 断电后不会留下改过名的空文件
+// 所有连接在一个时间窗口内完成的文件合并成一组, 每个目录只 fsync 一次, 小文件不必逐个等待磁盘
+class group_commit
+{
+   public:
+    using files = std::vector<std::pair<std::string, std::string>>;    // 临时文件 -> 正式文件
+
+   public:
+    static group_commit& instance();
+
+   public:
+    void set_durable(bool durable) { durable_ = durable; }
+    [[nodiscard]] bool durable() const { return durable_; }
+    // 所在的组全部落盘后返回, 一次提交的文件任何一个数据落盘失败都不改名
+    boost::asio::awaitable<boost::system::error_code> commit(files f);
+
+   private:
+    using handler = boost::asio::any_completion_handler<void(boost::system::error_code)>;
+    struct entry
+    {
+        files f;
+        handler h;
+    };
+
+   private:
+    void flush();
+
+   private:
+    std::atomic<bool> durable_ = false;
+    std::mutex mutex_;
+    std::vector<entry> pending_;
+    bool scheduled_ = false;
+};
+
+// 非持久模式直接在用户的元数据队列上改名, 持久模式交给组提交
+boost::asio::awaitable<boost::system::error_code> commit_files(const std::string& user, group_commit::files files);
+}    // namespace leaf
+
+#endif
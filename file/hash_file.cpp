@@ -1,9 +1,11 @@
 #include <vector>
 #include <boost/asio.hpp>
+#include <boost/algorithm/hex.hpp>
 #include <boost/system/error_code.hpp>
 
 #include "file/file.h"
 #include "crypt/blake2b.h"
+#include "config/config.h"
 #include "file/hash_file.h"
 
 namespace leaf
@@ -18,7 +20,7 @@ std::string hash_file(const std::string& file, boost::system::error_code& ec, st
         return {};
     }
     leaf::blake2b b;
-    constexpr auto kBufferSize = 4096;
+    constexpr auto kBufferSize = kMaxBlockSize;
     std::vector<uint8_t> buffer(kBufferSize, '0');
     std::size_t read_size = 0;
     while (read_size < read_limit)
@@ -54,4 +56,28 @@ std::string hash_file(const std::string& file, boost::system::error_code& ec, st
     }
     return b.hex();
 }
+
+bool verify_block_hash(const leaf::blake2b& hash, std::span<const uint8_t> expect)
+{
+    if (expect.size() == leaf::blake2b::kDigestSize)
+    {
+        return hash.equal(expect);
+    }
+    if (expect.size() != leaf::blake2b::kDigestSize * 2)
+    {
+        return false;
+    }
+    // 旧版本对端
+    std::vector<uint8_t> raw;
+    raw.reserve(leaf::blake2b::kDigestSize);
+    try
+    {
+        boost::algorithm::unhex(expect.begin(), expect.end(), std::back_inserter(raw));
+    }
+    catch (const boost::algorithm::hex_decode_error&)
+    {
+        return false;
+    }
+    return hash.equal(raw);
+}
 }    // namespace leaf
@@ -2,12 +2,16 @@
 #define LEAF_FILE_HASH_FILE_H
 
 #include <limits>
+#include <span>
 #include <string>
 #include <boost/system/error_code.hpp>
 
 namespace leaf
 {
+class blake2b;
 std::string hash_file(const std::string& file, boost::system::error_code& ec, std::size_t read_limit = std::numeric_limits<std::size_t>::max());
+// 校验块摘要, 原始摘要走常量时间比较, 兼容旧版本的 hex 摘要
+bool verify_block_hash(const leaf::blake2b& hash, std::span<const uint8_t> expect);
 }
 
 #endif
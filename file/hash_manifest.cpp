@@ -0,0 +1,389 @@
+#include <map>
+#include <mutex>
+#include <cstring>
+#include <boost/asio/post.hpp>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#endif
+#include "log/log.h"
+#include "file/file.h"
+#include "config/config.h"
+#include "file/hash_file.h"
+#include "file/thread_pools.h"
+#include "file/hash_manifest.h"
+
+namespace leaf
+{
+// 头部: magic + 摘要块大小 + 检查点间隔 + 文件大小/inode/修改时间 + 整个文件的摘要
+// 之后依次是每个摘要块的摘要和每个检查点的前缀摘要, 整数按本机字节序, 清单不跨机器使用
+static constexpr char kManifestMagic[8] = {'L', 'E', 'A', 'F', 'M', 'F', '0', '1'};
+static constexpr std::size_t kHeaderSize = sizeof(kManifestMagic) + 5 * sizeof(uint64_t) + leaf::blake2b::kDigestSize;
+
+struct manifest_header
+{
+    uint64_t block_size = 0;
+    uint64_t checkpoint = 0;
+    uint64_t file_size = 0;
+    uint64_t inode = 0;
+    int64_t mtime = 0;
+    leaf::blake2b::digest file_digest = {};
+};
+
+static uint64_t block_count(uint64_t file_size) { return (file_size + kManifestBlockSize - 1) / kManifestBlockSize; }
+
+static void encode_header(const manifest_header& h, std::vector<uint8_t>& out)
+{
+    out.insert(out.end(), std::begin(kManifestMagic), std::end(kManifestMagic));
+    for (uint64_t v : {h.block_size, h.checkpoint, h.file_size, h.inode, static_cast<uint64_t>(h.mtime)})
+    {
+        const auto* p = reinterpret_cast<const uint8_t*>(&v);
+        out.insert(out.end(), p, p + sizeof(v));
+    }
+    out.insert(out.end(), h.file_digest.begin(), h.file_digest.end());
+}
+
+// 读满 size 字节, 不足时返回 false
+static bool read_full(leaf::file_reader& reader, uint64_t offset, void* buffer, std::size_t size)
+{
+    auto* p = static_cast<uint8_t*>(buffer);
+    std::size_t done = 0;
+    while (done < size)
+    {
+        boost::system::error_code ec;
+        auto n = reader.read_at(static_cast<int64_t>(offset + done), p + done, size - done, ec);
+        if (ec || n == 0)
+        {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+// 读取并校验头部, 参数或文件不符时返回空
+static std::optional<manifest_header> read_header(leaf::file_reader& reader, const block_cache::file_key& key)
+{
+    std::array<uint8_t, kHeaderSize> buffer;
+    if (!read_full(reader, 0, buffer.data(), buffer.size()) || std::memcmp(buffer.data(), kManifestMagic, sizeof(kManifestMagic)) != 0)
+    {
+        return {};
+    }
+    manifest_header h;
+    const auto* p = buffer.data() + sizeof(kManifestMagic);
+    for (auto* v : {&h.block_size, &h.checkpoint, &h.file_size, &h.inode, reinterpret_cast<uint64_t*>(&h.mtime)})
+    {
+        std::memcpy(v, p, sizeof(uint64_t));
+        p += sizeof(uint64_t);
+    }
+    std::copy(p, p + leaf::blake2b::kDigestSize, h.file_digest.begin());
+    if (h.block_size != kManifestBlockSize || h.checkpoint != kManifestCheckpoint)
+    {
+        return {};
+    }
+    // 改名不改变 inode, 只比较文件内容相关的字段
+    if (h.file_size != key.size || h.inode != key.inode || h.mtime != key.mtime)
+    {
+        return {};
+    }
+    return h;
+}
+
+void manifest_builder::update(const uint8_t* data, std::size_t size)
+{
+    // 检查点间隔整除摘要块大小, 按检查点切开输入, 两种边界都落在切点上
+    static_assert(kManifestBlockSize % kManifestCheckpoint == 0);
+    while (size > 0 && !final_)
+    {
+        auto n = static_cast<std::size_t>(std::min<uint64_t>(size, kManifestCheckpoint - size_ % kManifestCheckpoint));
+        file_hash_.update(data, static_cast<uint32_t>(n));
+        block_hash_.update(data, static_cast<uint32_t>(n));
+        size_ += n;
+        data += n;
+        size -= n;
+        if (size_ % kManifestCheckpoint == 0)
+        {
+            prefixes_.push_back(file_hash_.peek());
+        }
+        if (size_ % kManifestBlockSize == 0)
+        {
+            block_hash_.final();
+            blocks_.push_back(block_hash_.raw());
+            block_hash_.reset();
+        }
+    }
+}
+
+void manifest_builder::final()
+{
+    if (final_)
+    {
+        return;
+    }
+    final_ = true;
+    if (size_ % kManifestBlockSize != 0)
+    {
+        block_hash_.final();
+        blocks_.push_back(block_hash_.raw());
+    }
+    file_hash_.final();
+}
+
+std::string manifest_builder::hex()
+{
+    final();
+    return file_hash_.hex();
+}
+
+boost::system::error_code manifest_builder::write(const std::string& leaf_path)
+{
+    final();
+    auto key = block_cache::key_of(leaf_path);
+    if (!key.has_value())
+    {
+        return boost::system::errc::make_error_code(boost::system::errc::no_such_file_or_directory);
+    }
+    // 提交后文件又被覆盖
+    if (key->size != size_)
+    {
+        return boost::system::errc::make_error_code(boost::system::errc::resource_unavailable_try_again);
+    }
+    manifest_header h;
+    h.block_size = kManifestBlockSize;
+    h.checkpoint = kManifestCheckpoint;
+    h.file_size = key->size;
+    h.inode = key->inode;
+    h.mtime = key->mtime;
+    h.file_digest = file_hash_.raw();
+    std::vector<uint8_t> data;
+    data.reserve(kHeaderSize + (blocks_.size() + prefixes_.size()) * leaf::blake2b::kDigestSize);
+    encode_header(h, data);
+    for (const auto& d : blocks_)
+    {
+        data.insert(data.end(), d.begin(), d.end());
+    }
+    for (const auto& d : prefixes_)
+    {
+        data.insert(data.end(), d.begin(), d.end());
+    }
+
+    // 写临时文件后改名, 读取方不会看到写了一半的清单
+    auto manifest_path = hash_manifest::path_of(leaf_path);
+    auto tmp_path = fmt::format("{}.{}{}", manifest_path, leaf::file_id(), kTmpFilenameSuffix);
+    boost::system::error_code ec;
+    {
+        leaf::file_writer writer(tmp_path);
+        ec = writer.open();
+        if (ec)
+        {
+            return ec;
+        }
+        std::size_t written = 0;
+        while (written < data.size() && !ec)
+        {
+            written += writer.write_at(static_cast<int64_t>(written), data.data() + written, data.size() - written, ec);
+        }
+        auto close_ec = writer.close();
+        if (!ec)
+        {
+            ec = close_ec;
+        }
+    }
+    if (ec || !leaf::rename(tmp_path, manifest_path))
+    {
+        leaf::remove(tmp_path);
+        return ec ? ec : boost::system::errc::make_error_code(boost::system::errc::io_error);
+    }
+    return {};
+}
+
+std::string hash_manifest::path_of(const std::string& leaf_path) { return leaf_path + kManifestFilenameSuffix; }
+
+boost::system::error_code hash_manifest::build(const std::string& leaf_path, std::string& digest)
+{
+    auto key = block_cache::key_of(leaf_path);
+    if (!key.has_value())
+    {
+        return boost::system::errc::make_error_code(boost::system::errc::no_such_file_or_directory);
+    }
+    leaf::file_reader reader(leaf_path);
+    auto ec = reader.open();
+    if (ec)
+    {
+        return ec;
+    }
+    std::vector<uint8_t> buffer(kManifestCheckpoint);
+    manifest_builder builder;
+    uint64_t offset = 0;
+    while (offset < key->size)
+    {
+        auto size = static_cast<std::size_t>(std::min<uint64_t>(kManifestCheckpoint, key->size - offset));
+        if (!read_full(reader, offset, buffer.data(), size))
+        {
+            auto _ = reader.close();
+            return boost::system::errc::make_error_code(boost::system::errc::io_error);
+        }
+        builder.update(buffer.data(), size);
+        offset += size;
+    }
+    auto _ = reader.close();
+    // 生成期间文件被覆盖
+    if (key != block_cache::key_of(leaf_path))
+    {
+        return boost::system::errc::make_error_code(boost::system::errc::resource_unavailable_try_again);
+    }
+    digest = builder.hex();
+    return builder.write(leaf_path);
+}
+
+// 后台线程的 CPU 和 I/O 优先级降到最低, 只在上传下载空闲时读盘
+static void lower_priority()
+{
+#ifdef __linux__
+    static thread_local bool lowered = false;
+    if (lowered)
+    {
+        return;
+    }
+    lowered = true;
+    constexpr int kIoprioClassIdle = 3;
+    constexpr int kIoprioClassShift = 13;
+    constexpr int kIoprioWhoProcess = 1;
+    ::syscall(SYS_ioprio_set, kIoprioWhoProcess, 0, kIoprioClassIdle << kIoprioClassShift);
+    ::setpriority(PRIO_PROCESS, static_cast<id_t>(::syscall(SYS_gettid)), 19);
+#endif
+}
+
+void hash_manifest::schedule(const std::string& leaf_path, std::function<void(const std::string& digest)> built)
+{
+    using callbacks = std::vector<std::function<void(const std::string&)>>;
+    static std::mutex mutex;
+    static std::map<std::string, callbacks> building;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto [it, inserted] = building.try_emplace(leaf_path);
+        if (built)
+        {
+            it->second.push_back(std::move(built));
+        }
+        if (!inserted)
+        {
+            return;
+        }
+    }
+    boost::asio::post(leaf::background_pool(),
+                      [leaf_path]()
+                      {
+                          lower_priority();
+                          bool want_digest = false;
+                          {
+                              std::lock_guard<std::mutex> lock(mutex);
+                              want_digest = !building[leaf_path].empty();
+                          }
+                          std::string digest;
+                          boost::system::error_code ec;
+                          auto key = block_cache::key_of(leaf_path);
+                          if (!key.has_value())
+                          {
+                              ec = boost::system::errc::make_error_code(boost::system::errc::no_such_file_or_directory);
+                          }
+                          else if (key->size >= kManifestMinSize)
+                          {
+                              ec = build(leaf_path, digest);
+                          }
+                          else if (want_digest)
+                          {
+                              digest = leaf::hash_file(leaf_path, ec);
+                          }
+                          if (ec)
+                          {
+                              LOG_WARN("build hash manifest {} error {}", leaf_path, ec.message());
+                          }
+                          else
+                          {
+                              LOG_DEBUG("build hash manifest {} size {}", leaf_path, key->size);
+                          }
+                          callbacks done;
+                          {
+                              std::lock_guard<std::mutex> lock(mutex);
+                              // 生成期间又登记的回调也用这次的结果
+                              done = std::move(building[leaf_path]);
+                              building.erase(leaf_path);
+                          }
+                          if (ec || digest.empty())
+                          {
+                              return;
+                          }
+                          for (const auto& f : done)
+                          {
+                              f(digest);
+                          }
+                      });
+}
+
+std::shared_ptr<hash_manifest> hash_manifest::load(const std::string& leaf_path, const block_cache::file_key& key)
+{
+    leaf::file_reader reader(path_of(leaf_path));
+    if (reader.open())
+    {
+        return nullptr;
+    }
+    auto h = read_header(reader, key);
+    if (!h.has_value())
+    {
+        auto _ = reader.close();
+        return nullptr;
+    }
+    auto m = std::make_shared<hash_manifest>();
+    m->file_size_ = h->file_size;
+    m->file_digest_ = h->file_digest;
+    m->blocks_.resize(block_count(h->file_size));
+    bool ok = read_full(reader, kHeaderSize, m->blocks_.data(), m->blocks_.size() * leaf::blake2b::kDigestSize);
+    auto _ = reader.close();
+    return ok ? m : nullptr;
+}
+
+std::optional<leaf::blake2b::digest> hash_manifest::prefix_digest(const std::string& leaf_path, const block_cache::file_key& key, uint64_t offset)
+{
+    if (offset == 0 || offset > key.size || (offset % kManifestCheckpoint != 0 && offset != key.size))
+    {
+        return {};
+    }
+    leaf::file_reader reader(path_of(leaf_path));
+    if (reader.open())
+    {
+        return {};
+    }
+    auto h = read_header(reader, key);
+    std::optional<leaf::blake2b::digest> digest;
+    if (h.has_value() && offset == key.size)
+    {
+        digest = h->file_digest;
+    }
+    else if (h.has_value())
+    {
+        auto position = kHeaderSize + (block_count(key.size) + offset / kManifestCheckpoint - 1) * leaf::blake2b::kDigestSize;
+        leaf::blake2b::digest d;
+        if (read_full(reader, position, d.data(), d.size()))
+        {
+            digest = d;
+        }
+    }
+    auto _ = reader.close();
+    return digest;
+}
+
+std::optional<leaf::blake2b::digest> hash_manifest::block_digest(uint64_t start, uint64_t end) const
+{
+    if (start % kManifestBlockSize != 0 || start / kManifestBlockSize >= blocks_.size())
+    {
+        return {};
+    }
+    if (end != std::min<uint64_t>(start + kManifestBlockSize, file_size_))
+    {
+        return {};
+    }
+    return blocks_[start / kManifestBlockSize];
+}
+}    // namespace leaf
@@ -0,0 +1,67 @@
+#ifndef LEAF_FILE_HASH_MANIFEST_H
+#define LEAF_FILE_HASH_MANIFEST_H
+
+#include <memory>
+#include <string>
+#include <functional>
+#include <vector>
+#include <cstdint>
+#include <optional>
+#include <boost/system/error_code.hpp>
+#include "crypt/blake2b.h"
+#include "file/block_cache.h"
+
+namespace leaf
+{
+// 从文件开头顺序输入数据, 同时得到整个文件的摘要, 每个摘要块的摘要和每个检查点的前缀摘要
+// 上传顺序到达的数据直接输入, 提交后写清单, 不再重读文件
+class manifest_builder
+{
+   public:
+    void update(const uint8_t* data, std::size_t size);
+    // 输入结束, 之后不能再 update
+    void final();
+    [[nodiscard]] uint64_t size() const { return size_; }
+    [[nodiscard]] std::string hex();
+    // 写到 leaf_path 的清单, 文件大小与输入不一致时不写
+    boost::system::error_code write(const std::string& leaf_path);
+
+   private:
+    uint64_t size_ = 0;
+    bool final_ = false;
+    leaf::blake2b file_hash_;
+    leaf::blake2b block_hash_;
+    std::vector<leaf::blake2b::digest> blocks_;
+    std::vector<leaf::blake2b::digest> prefixes_;
+};
+
+// .leaf 文件旁边的摘要清单, 上传完成后生成一次
+// 续传校验按检查点查前缀摘要, 下载按摘要块查块摘要, 都不再重读文件
+// 文件被覆盖后 inode/大小/修改时间对不上, 清单失效, 下次下载时重新生成
+class hash_manifest
+{
+   public:
+    static std::string path_of(const std::string& leaf_path);
+    // 读整个文件生成清单, digest 为整个文件的 hex 摘要, 阻塞, 只在 background_pool 上调用
+    static boost::system::error_code build(const std::string& leaf_path, std::string& digest);
+    // 数据不是顺序到达的上传和没有清单的旧文件, 投递到 background_pool 后台生成, 同一文件同时只生成一次
+    // 成功后在后台线程上用整个文件的摘要调用 built, 小于 kManifestMinSize 的文件不生成清单, 有 built 时只计算摘要
+    static void schedule(const std::string& leaf_path, std::function<void(const std::string& digest)> built = nullptr);
+    // 读取头部和全部块摘要, 清单不存在或与文件不符时返回 nullptr
+    static std::shared_ptr<hash_manifest> load(const std::string& leaf_path, const block_cache::file_key& key);
+    // [0, offset) 的摘要, offset 不在检查点上且不是文件末尾时返回空, 只读一条记录
+    static std::optional<leaf::blake2b::digest> prefix_digest(const std::string& leaf_path, const block_cache::file_key& key, uint64_t offset);
+
+   public:
+    // 摘要块 [start, end) 的摘要, start 不在块边界或 end 不是块的结尾时返回空
+    [[nodiscard]] std::optional<leaf::blake2b::digest> block_digest(uint64_t start, uint64_t end) const;
+    [[nodiscard]] const leaf::blake2b::digest& file_digest() const { return file_digest_; }
+
+   private:
+    uint64_t file_size_ = 0;
+    leaf::blake2b::digest file_digest_ = {};
+    std::vector<leaf::blake2b::digest> blocks_;
+};
+}    // namespace leaf
+
+#endif
@@ -0,0 +1,19 @@
+#include <array>
+#include <functional>
+#include "config/config.h"
+#include "file/thread_pools.h"
+#include "file/metadata_executor.h"
+
+namespace leaf
+{
+static std::array<metadata_strand, kMetadataStrands>& strands()
+{
+    static auto strands = []<std::size_t... I>(std::index_sequence<I...>)
+    {
+        return std::array<metadata_strand, kMetadataStrands>{((void)I, boost::asio::make_strand(metadata_pool().get_executor()))...};
+    }(std::make_index_sequence<kMetadataStrands>{});
+    return strands;
+}
+
+metadata_strand& metadata_executor(const std::string& user) { return strands()[std::hash<std::string>{}(user) % kMetadataStrands]; }
+}    // namespace leaf
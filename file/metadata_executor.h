@@ -0,0 +1,26 @@
+#ifndef LEAF_FILE_METADATA_EXECUTOR_H
+#define LEAF_FILE_METADATA_EXECUTOR_H
+
+#include <string>
+#include <type_traits>
+#include <boost/asio.hpp>
+
+namespace leaf
+{
+using metadata_strand = boost::asio::strand<boost::asio::thread_pool::executor_type>;
+
+// 按用户散列到固定的串行队列, 同一用户的元数据操作按提交顺序执行
+metadata_strand& metadata_executor(const std::string& user);
+
+// 在元数据线程池上执行阻塞的文件系统操作, 网络线程只等待结果
+// 函数在另一个线程上执行, 捕获的引用在等待期间有效, 不能访问连接上的其他状态
+template <typename Function>
+boost::asio::awaitable<std::invoke_result_t<Function&>> offload_metadata(const std::string& user, Function f)
+{
+    using result = std::invoke_result_t<Function&>;
+    co_return co_await boost::asio::co_spawn(
+        metadata_executor(user), [&f]() -> boost::asio::awaitable<result> { co_return f(); }, boost::asio::use_awaitable);
+}
+}    // namespace leaf
+
+#endif
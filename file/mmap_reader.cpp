@@ -0,0 +1,132 @@
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <boost/asio/error.hpp>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "log/log.h"
+#include "file/mmap_reader.h"
+
+namespace leaf
+{
+#ifndef _WIN32
+static boost::system::error_code errno_error()
+{
+    static constexpr boost::source_location loc = BOOST_CURRENT_LOCATION;
+    boost::system::error_code ec;
+    ec.assign(errno, boost::system::system_category(), &loc);
+    return ec;
+}
+#endif
+
+mmap_reader::mmap_reader(std::string filename) : filename_(std::move(filename)) {}
+
+mmap_reader::~mmap_reader() { auto _ = close(); }
+
+boost::system::error_code mmap_reader::open()
+{
+#ifdef _WIN32
+    return boost::system::errc::make_error_code(boost::system::errc::not_supported);
+#else
+    file_ = ::open(filename_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file_ < 0)
+    {
+        return errno_error();
+    }
+    struct stat st = {};
+    if (::fstat(file_, &st) != 0)
+    {
+        auto ec = errno_error();
+        auto _ = close();
+        return ec;
+    }
+    file_size_ = static_cast<uint64_t>(st.st_size);
+    // 空文件不能映射, 读取时直接返回 eof
+    if (file_size_ == 0)
+    {
+        return {};
+    }
+    void* data = ::mmap(nullptr, file_size_, PROT_READ, MAP_SHARED, file_, 0);
+    if (data == MAP_FAILED)
+    {
+        auto ec = errno_error();
+        auto _ = close();
+        return ec;
+    }
+    data_ = static_cast<uint8_t*>(data);
+    ::madvise(data_, file_size_, MADV_SEQUENTIAL);
+#ifdef POSIX_FADV_SEQUENTIAL
+    ::posix_fadvise(file_, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    return {};
+#endif
+}
+
+boost::system::error_code mmap_reader::close()
+{
+#ifndef _WIN32
+    if (data_ != nullptr)
+    {
+        ::munmap(data_, file_size_);
+        data_ = nullptr;
+    }
+    if (file_ >= 0)
+    {
+        if (::close(file_) != 0)
+        {
+            file_ = -1;
+            return errno_error();
+        }
+        file_ = -1;
+    }
+#endif
+    return {};
+}
+
+std::span<const uint8_t> mmap_reader::view_at(uint64_t offset, std::size_t size, boost::system::error_code& ec)
+{
+    if (size == 0 || offset >= file_size_ || data_ == nullptr)
+    {
+        ec = boost::asio::error::eof;
+        return {};
+    }
+    ec = {};
+    auto view_size = static_cast<std::size_t>(std::min<uint64_t>(size, file_size_ - offset));
+    read_size_ += view_size;
+    return {data_ + offset, view_size};
+}
+
+void mmap_reader::will_need(uint64_t offset, uint64_t length)
+{
+#ifndef _WIN32
+    if (data_ == nullptr || offset >= file_size_)
+    {
+        return;
+    }
+    length = std::min<uint64_t>(length, file_size_ - offset);
+    // madvise 要求起点按页对齐
+    static const auto page_size = static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+    auto start = offset - offset % page_size;
+    ::madvise(data_ + start, length + (offset - start), MADV_WILLNEED);
+#endif
+}
+
+std::size_t mmap_reader::read(void* buffer, std::size_t size, boost::system::error_code& ec)
+{
+    return read_at(static_cast<std::int64_t>(read_size_), buffer, size, ec);
+}
+
+std::size_t mmap_reader::read_at(std::int64_t offset, void* buffer, std::size_t size, boost::system::error_code& ec)
+{
+    auto view = view_at(static_cast<uint64_t>(offset), size, ec);
+    if (!view.empty())
+    {
+        std::memcpy(buffer, view.data(), view.size());
+    }
+    return view.size();
+}
+}    // namespace leaf
@@ -0,0 +1,44 @@
+#ifndef LEAF_FILE_MMAP_READER_H
+#define LEAF_FILE_MMAP_READER_H
+
+#include <span>
+#include <string>
+#include <cstdint>
+#include "file/file.h"
+
+namespace leaf
+{
+// 整个文件映射到内存, 下载时直接把映射的页交给帧编码, 不需要 read 系统调用和中间缓冲区
+// 打开时提示内核顺序访问, 映射期间文件被改名覆盖不影响已经映射的旧文件
+// 缺页在调用线程上发生, 适合热点文件, 大文件仍然使用 file_reader
+class mmap_reader : public reader
+{
+   public:
+    explicit mmap_reader(std::string filename);
+    ~mmap_reader() override;
+
+   public:
+    [[nodiscard]] std::string name() const override { return filename_; }
+    // 不支持的平台返回 not_supported, 调用方退回 file_reader
+    boost::system::error_code open() override;
+    boost::system::error_code close() override;
+    std::size_t read(void* buffer, std::size_t size, boost::system::error_code& ec) override;
+    std::size_t read_at(std::int64_t offset, void* buffer, std::size_t size, boost::system::error_code& ec) override;
+    std::size_t size() override { return read_size_; }
+
+   public:
+    // 返回映射内存中的一段, 在 close 之前有效, 读到文件末尾时 ec 为 eof
+    std::span<const uint8_t> view_at(uint64_t offset, std::size_t size, boost::system::error_code& ec);
+    // 预读 [offset, offset + length), 分段下载只预读自己的范围
+    void will_need(uint64_t offset, uint64_t length);
+
+   private:
+    std::string filename_;
+    int file_ = -1;
+    uint8_t* data_ = nullptr;
+    uint64_t file_size_ = 0;
+    std::size_t read_size_ = 0;
+};
+}    // namespace leaf
+
+#endif
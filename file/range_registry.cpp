@@ -0,0 +1,323 @@
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <boost/asio/steady_timer.hpp>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "log/log.h"
+#include "file/file.h"
+#include "config/config.h"
+#include "net/reflect.hpp"
+#include "file/thread_pools.h"
+#include "file/range_registry.h"
+
+namespace leaf
+{
+// .state 文件内容
+struct range_state
+{
+    uint64_t offset = 0;
+    uint64_t verified = 0;
+    bool done = false;
+};
+struct upload_state
+{
+    uint64_t range_id = 0;
+    uint64_t file_size = 0;
+    std::vector<range_state> ranges;
+};
+}    // namespace leaf
+
+namespace reflect
+{
+REFLECT_STRUCT(leaf::range_state, (offset)(verified)(done));
+REFLECT_STRUCT(leaf::upload_state, (range_id)(file_size)(ranges));
+}    // namespace reflect
+
+namespace leaf
+{
+range_registry& range_registry::instance()
+{
+    static range_registry instance;
+    return instance;
+}
+
+std::string range_registry::encode(const range_file& f)
+{
+    upload_state state;
+    state.range_id = f.range_id;
+    state.file_size = f.file_size;
+    for (const auto& [offset, verified] : f.verified)
+    {
+        state.ranges.push_back(range_state{offset, verified, f.offsets.contains(offset)});
+    }
+    for (const auto& offset : f.offsets)
+    {
+        if (!f.verified.contains(offset))
+        {
+            state.ranges.push_back(range_state{offset, 0, true});
+        }
+    }
+    return reflect::serialize_struct(state);
+}
+
+// data 为 true 时只同步数据, 写入的连接用的是另一个文件描述符, 同一个文件的脏页一起落盘
+static bool sync_file(const std::string& path, bool data)
+{
+#ifdef _WIN32
+    return true;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+#ifdef __linux__
+    bool ok = (data ? ::fdatasync(fd) : ::fsync(fd)) == 0;
+#else
+    bool ok = ::fsync(fd) == 0;
+#endif
+    ::close(fd);
+    return ok;
+#endif
+}
+
+void range_registry::save(const std::string& path, const std::string& state)
+{
+    // 先写临时文件, 落盘后再改名, 中途崩溃或断电不会留下半个状态文件
+    auto state_path = leaf::encode_state_filename(path);
+    auto tmp_path = state_path + kTmpFilenameSuffix;
+    {
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        out << state;
+        if (!out)
+        {
+            LOG_ERROR("range file {} save state error", path);
+            return;
+        }
+    }
+    if (!sync_file(tmp_path, false))
+    {
+        LOG_ERROR("range file {} sync state error", path);
+        return;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp_path, state_path, ec);
+    if (ec)
+    {
+        LOG_ERROR("range file {} rename state error {}", path, ec.message());
+    }
+}
+
+void range_registry::touch(const std::string& path)
+{
+    dirty_.insert(path);
+    schedule();
+}
+
+void range_registry::schedule()
+{
+    if (scheduled_)
+    {
+        return;
+    }
+    scheduled_ = true;
+    auto timer = std::make_shared<boost::asio::steady_timer>(leaf::metadata_pool(), std::chrono::milliseconds(kRangeStateInterval));
+    timer->async_wait([this, timer](const boost::system::error_code&) { flush(); });
+}
+
+void range_registry::flush()
+{
+    std::lock_guard<std::mutex> save_lock(save_mutex_);
+    std::vector<std::pair<std::string, std::string>> states;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        scheduled_ = false;
+        for (const auto& path : dirty_)
+        {
+            auto it = files_.find(path);
+            if (it != files_.end())
+            {
+                states.emplace_back(path, encode(it->second));
+            }
+        }
+        dirty_.clear();
+        // 断开后不再继续的上传不一直占用内存, 断点已经在 .state 文件中
+        auto now = std::chrono::steady_clock::now();
+        for (auto it = files_.begin(); it != files_.end();)
+        {
+            if (now - it->second.active > std::chrono::seconds(kRangeIdleTimeout))
+            {
+                LOG_INFO("range file {} id {} idle evict received {}/{}", it->first, it->second.range_id, it->second.received, it->second.file_size);
+                it = files_.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+        // 还有进行中的上传时继续定时检查空闲
+        if (!files_.empty())
+        {
+            schedule();
+        }
+    }
+    for (const auto& [path, state] : states)
+    {
+        // 状态中的断点之前的数据都已经写入, 先落盘再记录, 断电后续传不会相信没有落盘的数据
+        // 刚登记还没有写入时临时文件可能还不存在, 只保存空的状态
+        std::error_code exists_ec;
+        if (std::filesystem::exists(path, exists_ec) && !sync_file(path, true))
+        {
+            LOG_ERROR("range file {} sync data error", path);
+            continue;
+        }
+        save(path, state);
+    }
+}
+
+bool range_registry::load(const std::string& path, range_file& f)
+{
+    std::ifstream in(leaf::encode_state_filename(path), std::ios::binary);
+    if (!in)
+    {
+        return false;
+    }
+    std::stringstream ss;
+    ss << in.rdbuf();
+    upload_state state;
+    if (!reflect::deserialize_struct(state, ss.str()))
+    {
+        return false;
+    }
+    f.range_id = state.range_id;
+    f.file_size = state.file_size;
+    for (const auto& r : state.ranges)
+    {
+        f.verified[r.offset] = r.verified;
+        if (r.done && f.offsets.insert(r.offset).second)
+        {
+            f.received += r.verified;
+        }
+    }
+    return true;
+}
+
+range_registry::range_file* range_registry::find(const std::string& path, uint64_t range_id)
+{
+    auto it = files_.find(path);
+    if (it == files_.end())
+    {
+        // 空闲移除后连接又回来了
+        range_file f;
+        if (!load(path, f) || f.range_id != range_id || !std::filesystem::exists(path))
+        {
+            return nullptr;
+        }
+        LOG_INFO("range file {} id {} reload received {}", path, range_id, f.received);
+        it = files_.emplace(path, f).first;
+        schedule();
+    }
+    if (it->second.range_id != range_id)
+    {
+        return nullptr;
+    }
+    it->second.active = std::chrono::steady_clock::now();
+    return &it->second;
+}
+
+boost::system::error_code range_registry::join(const std::string& path, uint64_t range_id, uint64_t file_size)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto* f = find(path, range_id);
+    if (f != nullptr && f->file_size == file_size)
+    {
+        return {};
+    }
+    std::error_code ec;
+    std::filesystem::remove(path, ec);
+    if (ec)
+    {
+        LOG_ERROR("range file {} remove error {}", path, ec.message());
+        return boost::system::errc::make_error_code(boost::system::errc::file_exists);
+    }
+    std::filesystem::remove(leaf::encode_state_filename(path), ec);
+    range_file nf;
+    nf.range_id = range_id;
+    nf.file_size = file_size;
+    nf.active = std::chrono::steady_clock::now();
+    files_[path] = nf;
+    // 立即登记状态文件, 空闲移除后总能从状态文件恢复
+    touch(path);
+    LOG_INFO("range file {} id {} size {} begin", path, range_id, file_size);
+    return {};
+}
+
+uint64_t range_registry::start(const std::string& path, uint64_t range_id, uint64_t offset, bool resume)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto* f = find(path, range_id);
+    if (f == nullptr)
+    {
+        return 0;
+    }
+    // 重新上传已完成的分段, 需要重新计数
+    if (f->offsets.erase(offset) != 0)
+    {
+        f->received -= f->verified[offset];
+    }
+    if (!resume)
+    {
+        f->verified.erase(offset);
+        return 0;
+    }
+    auto v = f->verified.find(offset);
+    return v == f->verified.end() ? 0 : v->second;
+}
+
+void range_registry::verify(const std::string& path, uint64_t range_id, uint64_t offset, uint64_t verified)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto* f = find(path, range_id);
+    if (f == nullptr)
+    {
+        return;
+    }
+    f->verified[offset] = verified;
+    touch(path);
+}
+
+bool range_registry::complete(const std::string& path, uint64_t range_id, uint64_t offset, uint64_t length, boost::system::error_code& ec)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto* f = find(path, range_id);
+        if (f == nullptr)
+        {
+            LOG_ERROR("range file {} id {} offset {} complete without state", path, range_id, offset);
+            ec = boost::system::errc::make_error_code(boost::system::errc::no_such_file_or_directory);
+            return false;
+        }
+        f->verified[offset] = length;
+        if (f->offsets.insert(offset).second)
+        {
+            f->received += length;
+        }
+        LOG_DEBUG("range file {} id {} offset {} length {} received {}/{}", path, range_id, offset, length, f->received, f->file_size);
+        if (f->received < f->file_size)
+        {
+            touch(path);
+            return false;
+        }
+        files_.erase(path);
+        dirty_.erase(path);
+    }
+    // 等正在写的快照完成后再删除
+    std::lock_guard<std::mutex> save_lock(save_mutex_);
+    std::error_code remove_ec;
+    std::filesystem::remove(leaf::encode_state_filename(path), remove_ec);
+    return true;
+}
+}    // namespace leaf
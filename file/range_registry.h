@@ -0,0 +1,65 @@
+#ifndef LEAF_FILE_RANGE_REGISTRY_H
+#define LEAF_FILE_RANGE_REGISTRY_H
+
+#include <set>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <boost/system/error_code.hpp>
+
+namespace leaf
+{
+// 分段上传的服务端状态, 多个连接并行写同一个临时文件
+// 所有分段完成后由最后一个连接改名
+// 每个分段已校验的字节数保存在临时文件旁边的 .state 文件中, 重连或服务端重启后从断点继续
+// 断点在 metadata_pool 上按 kRangeStateInterval 合并写入, 空闲的上传从内存移除, 再次使用时从 .state 文件恢复
+class range_registry
+{
+   public:
+    static range_registry& instance();
+
+   public:
+    // range_id 不同说明是新的一次上传, 丢弃旧状态并删除临时文件
+    boost::system::error_code join(const std::string& path, uint64_t range_id, uint64_t file_size);
+    // 分段开始传输, resume 为 false 时从头开始, 返回可以跳过的已校验字节数
+    uint64_t start(const std::string& path, uint64_t range_id, uint64_t offset, bool resume);
+    // 摘要块校验通过, verified 为分段内累计的字节数
+    void verify(const std::string& path, uint64_t range_id, uint64_t offset, uint64_t verified);
+    // 返回 true 表示文件的所有分段都已完成, 状态丢失 (被新的上传替换或状态文件被删除) 时设置 ec
+    bool complete(const std::string& path, uint64_t range_id, uint64_t offset, uint64_t length, boost::system::error_code& ec);
+
+   private:
+    struct range_file
+    {
+        uint64_t range_id = 0;
+        uint64_t file_size = 0;
+        uint64_t received = 0;
+        std::set<uint64_t> offsets;              // 已完成的分段, 重传的分段不重复计数
+        std::map<uint64_t, uint64_t> verified;    // 分段起点 -> 已校验的字节数
+        std::chrono::steady_clock::time_point active;
+    };
+
+   private:
+    // 内存中没有时从 .state 文件恢复, range_id 不一致返回 nullptr, 调用方持有 mutex_
+    range_file* find(const std::string& path, uint64_t range_id);
+    // 标记需要保存, 调用方持有 mutex_
+    void touch(const std::string& path);
+    // 定时在 metadata_pool 上保存并检查空闲, 调用方持有 mutex_
+    void schedule();
+    void flush();
+    static std::string encode(const range_file& f);
+    static void save(const std::string& path, const std::string& state);
+    static bool load(const std::string& path, range_file& f);
+
+   private:
+    std::mutex mutex_;
+    std::map<std::string, range_file> files_;
+    std::set<std::string> dirty_;
+    bool scheduled_ = false;
+    // 写 .state 文件和删除 .state 文件串行, 删除后不会被之前的快照重新写回
+    std::mutex save_mutex_;
+};
+}    // namespace leaf
+
+#endif
@@ -0,0 +1,130 @@
+#include "log/log.h"
+#include "file/file.h"
+#include "config/config.h"
+#include "crypt/blake2b.h"
+#include "net/exception.h"
+#include "file/read_ahead.h"
+#include "file/thread_pools.h"
+
+namespace leaf
+{
+read_ahead::read_ahead(const boost::asio::any_io_executor& io,
+                       std::string path,
+                       uint64_t offset,
+                       uint64_t length,
+                       uint64_t skip,
+                       uint32_t block_size,
+                       uint32_t hash_block_size,
+                       bool raw_digest)
+    : path_(std::move(path)),
+      offset_(offset),
+      length_(length),
+      skip_(skip),
+      block_size_(block_size),
+      hash_block_size_(hash_block_size),
+      raw_digest_(raw_digest),
+      channel_(io, kReadAheadBlocks)
+{
+}
+
+void read_ahead::start()
+{
+    auto msg = fmt::format("read ahead {}", path_);
+    boost::asio::co_spawn(
+        leaf::disk_pool(),
+        [self = shared_from_this()]() -> boost::asio::awaitable<void> { co_await self->produce(); },
+        [msg](const std::exception_ptr& e) { leaf::cache_exception(msg, e); });
+}
+
+// 关闭队列后预读协程的发送失败退出
+void read_ahead::stop() { channel_.close(); }
+
+boost::asio::awaitable<read_ahead::block> read_ahead::next(boost::system::error_code& ec)
+{
+    co_return co_await channel_.async_receive(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+}
+
+void read_ahead::recycle(std::vector<uint8_t> data)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (buffers_.size() < kReadAheadBlocks)
+    {
+        buffers_.push_back(std::move(data));
+    }
+}
+
+std::vector<uint8_t> read_ahead::take()
+{
+    std::vector<uint8_t> data;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!buffers_.empty())
+        {
+            data = std::move(buffers_.back());
+            buffers_.pop_back();
+        }
+    }
+    data.resize(block_size_);
+    return data;
+}
+
+boost::asio::awaitable<void> read_ahead::produce()
+{
+    leaf::file_reader reader(path_);
+    auto ec = reader.open();
+    if (ec)
+    {
+        boost::system::error_code send_ec;
+        co_await channel_.async_send(ec, block{}, boost::asio::redirect_error(boost::asio::use_awaitable, send_ec));
+        co_return;
+    }
+    leaf::blake2b hash;
+    uint64_t position = skip_;
+    while (true)
+    {
+        block b;
+        b.data = take();
+        auto size = std::min<uint64_t>(b.data.size(), length_ - position);
+        auto read_size = reader.read_at(static_cast<int64_t>(offset_ + position), b.data.data(), size, ec);
+        if (ec && ec != boost::asio::error::eof)
+        {
+            LOG_ERROR("read ahead {} offset {} error {}", path_, offset_ + position, ec.message());
+            boost::system::error_code send_ec;
+            co_await channel_.async_send(ec, block{}, boost::asio::redirect_error(boost::asio::use_awaitable, send_ec));
+            break;
+        }
+        position += read_size;
+        b.data.resize(read_size);
+        if (read_size != 0)
+        {
+            hash.update(b.data.data(), read_size);
+        }
+        // block count hash or eof hash
+        b.last = ec == boost::asio::error::eof || position == length_;
+        if ((position != 0 && position % hash_block_size_ == 0) || b.last)
+        {
+            hash.final();
+            if (raw_digest_)
+            {
+                const auto& raw = hash.raw();
+                b.hash.assign(reinterpret_cast<const char*>(raw.data()), raw.size());
+            }
+            else
+            {
+                b.hash = hash.hex();
+            }
+            hash.reset();
+        }
+        b.position = position;
+        ec = {};
+        bool last = b.last;
+        boost::system::error_code send_ec;
+        co_await channel_.async_send(boost::system::error_code{}, std::move(b), boost::asio::redirect_error(boost::asio::use_awaitable, send_ec));
+        if (send_ec || last)
+        {
+            break;
+        }
+    }
+    auto _ = reader.close();
+}
+}    // namespace leaf
@@ -0,0 +1,64 @@
+#ifndef LEAF_FILE_READ_AHEAD_H
+#define LEAF_FILE_READ_AHEAD_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <boost/asio.hpp>
+#include <boost/asio/experimental/concurrent_channel.hpp>
+
+namespace leaf
+{
+// 上传的预读流水线, 读文件和计算摘要在独立的 I/O 线程上提前进行
+// 网络协程只从有界队列中取已经准备好的块, 磁盘/CPU/网络同时工作
+class read_ahead : public std::enable_shared_from_this<read_ahead>
+{
+   public:
+    struct block
+    {
+        uint64_t position = 0;    // 读完这一块后分段内的累计字节数
+        std::vector<uint8_t> data;
+        std::string hash;    // 摘要块结束时的摘要, raw 或 hex
+        bool last = false;
+    };
+
+   public:
+    // 读取 [offset + skip, offset + length), 摘要边界按分段内的位置计算
+    read_ahead(const boost::asio::any_io_executor& io,
+               std::string path,
+               uint64_t offset,
+               uint64_t length,
+               uint64_t skip,
+               uint32_t block_size,
+               uint32_t hash_block_size,
+               bool raw_digest);
+
+   public:
+    void start();
+    void stop();
+    boost::asio::awaitable<block> next(boost::system::error_code& ec);
+    // 发送完的缓冲区还给预读线程复用
+    void recycle(std::vector<uint8_t> data);
+
+   private:
+    boost::asio::awaitable<void> produce();
+    std::vector<uint8_t> take();
+
+   private:
+    using channel = boost::asio::experimental::concurrent_channel<void(boost::system::error_code, block)>;
+    std::string path_;
+    uint64_t offset_ = 0;
+    uint64_t length_ = 0;
+    uint64_t skip_ = 0;
+    uint32_t block_size_ = 0;
+    uint32_t hash_block_size_ = 0;
+    bool raw_digest_ = true;
+    channel channel_;
+    std::mutex mutex_;
+    std::vector<std::vector<uint8_t>> buffers_;
+};
+}    // namespace leaf
+
+#endif
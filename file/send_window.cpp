@@ -0,0 +1,106 @@
+#include <algorithm>
+#include "file/send_window.h"
+
+namespace leaf
+{
+void send_window::reset(uint64_t min_bytes, uint64_t max_bytes)
+{
+    min_ = min_bytes;
+    max_ = std::max(min_bytes, max_bytes);
+    window_ = min_;
+    inflight_ = 0;
+    rate_ = 0;
+    srtt_ = std::chrono::microseconds(0);
+    last_ack_ = {};
+    streams_.clear();
+}
+
+bool send_window::has_room(uint64_t bytes) const
+{
+    // 窗口为空时总是允许发送, 避免单个数据块大于窗口时卡死
+    return inflight_ == 0 || inflight_ + bytes <= window_;
+}
+
+void send_window::on_start(uint32_t id, uint64_t offset)
+{
+    auto& s = streams_[id];
+    inflight_ -= s.sent - s.acked;
+    s.sent = offset;
+    s.acked = offset;
+    s.marks.clear();
+}
+
+void send_window::on_send(uint32_t id, uint64_t offset, uint64_t bytes)
+{
+    auto& s = streams_[id];
+    s.sent = offset + bytes;
+    s.marks.emplace_back(s.sent, clock::now());
+    inflight_ += bytes;
+}
+
+void send_window::on_ack(uint32_t id, uint64_t offset)
+{
+    auto it = streams_.find(id);
+    if (it == streams_.end())
+    {
+        return;
+    }
+    auto& s = it->second;
+    if (offset <= s.acked || offset > s.sent)
+    {
+        return;
+    }
+    auto now = clock::now();
+    // 用被确认的最后一个数据块的发送时间计算 rtt
+    std::chrono::microseconds sample{0};
+    while (!s.marks.empty() && s.marks.front().first <= offset)
+    {
+        sample = std::chrono::duration_cast<std::chrono::microseconds>(now - s.marks.front().second);
+        s.marks.pop_front();
+    }
+    if (sample.count() > 0)
+    {
+        srtt_ = srtt_.count() == 0 ? sample : (srtt_ * 7 + sample) / 8;
+    }
+    uint64_t delivered = offset - s.acked;
+    inflight_ -= delivered;
+    s.acked = offset;
+
+    if (last_ack_ != clock::time_point{})
+    {
+        auto interval = std::chrono::duration_cast<std::chrono::microseconds>(now - last_ack_).count();
+        if (interval > 0)
+        {
+            double sample_rate = static_cast<double>(delivered) / static_cast<double>(interval);
+            rate_ = rate_ == 0 ? sample_rate : (rate_ * 7 + sample_rate) / 8;
+        }
+    }
+    last_ack_ = now;
+    if (rate_ > 0 && srtt_.count() > 0)
+    {
+        auto target = static_cast<uint64_t>(rate_ * static_cast<double>(srtt_.count()) * 2);
+        window_ = std::clamp(target, min_, max_);
+    }
+}
+
+void send_window::on_done(uint32_t id)
+{
+    auto it = streams_.find(id);
+    if (it == streams_.end())
+    {
+        return;
+    }
+    inflight_ -= it->second.sent - it->second.acked;
+    streams_.erase(it);
+}
+
+uint64_t send_window::acked(uint32_t id) const
+{
+    auto it = streams_.find(id);
+    if (it == streams_.end())
+    {
+        return 0;
+    }
+    return it->second.acked;
+}
+}    // namespace leaf
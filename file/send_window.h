@@ -0,0 +1,52 @@
+#ifndef LEAF_FILE_SEND_WINDOW_H
+#define LEAF_FILE_SEND_WINDOW_H
+
+#include <map>
+#include <deque>
+#include <chrono>
+#include <cstdint>
+
+namespace leaf
+{
+// 流水线上传的发送窗口, 按累计 ack 释放未确认字节
+// 窗口大小取 2 倍的 带宽 * rtt, 限制在 [min, max] 之间
+class send_window
+{
+   public:
+    send_window() = default;
+
+   public:
+    void reset(uint64_t min_bytes, uint64_t max_bytes);
+    bool has_room(uint64_t bytes) const;
+    // 续传从 offset 开始发送, 对端的累计 ack 也从 offset 开始
+    void on_start(uint32_t id, uint64_t offset);
+    void on_send(uint32_t id, uint64_t offset, uint64_t bytes);
+    void on_ack(uint32_t id, uint64_t offset);
+    void on_done(uint32_t id);
+    uint64_t acked(uint32_t id) const;
+    uint64_t window() const { return window_; }
+    uint64_t inflight() const { return inflight_; }
+    std::chrono::microseconds srtt() const { return srtt_; }
+
+   private:
+    using clock = std::chrono::steady_clock;
+    struct stream
+    {
+        uint64_t sent = 0;
+        uint64_t acked = 0;
+        std::deque<std::pair<uint64_t, clock::time_point>> marks;
+    };
+
+   private:
+    uint64_t min_ = 0;
+    uint64_t max_ = 0;
+    uint64_t window_ = 0;
+    uint64_t inflight_ = 0;
+    double rate_ = 0;    // 字节每微秒
+    std::chrono::microseconds srtt_{0};
+    clock::time_point last_ack_;
+    std::map<uint32_t, stream> streams_;
+};
+}    // namespace leaf
+
+#endif
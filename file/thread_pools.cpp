@@ -0,0 +1,31 @@
+#include <thread>
+#include <algorithm>
+#include "config/config.h"
+#include "file/thread_pools.h"
+
+namespace leaf
+{
+boost::asio::thread_pool& cpu_pool()
+{
+    static boost::asio::thread_pool pool(std::max(2U, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+boost::asio::thread_pool& disk_pool()
+{
+    static boost::asio::thread_pool pool(kDiskThreads);
+    return pool;
+}
+
+boost::asio::thread_pool& metadata_pool()
+{
+    static boost::asio::thread_pool pool(kMetadataThreads);
+    return pool;
+}
+
+boost::asio::thread_pool& background_pool()
+{
+    static boost::asio::thread_pool pool(1);
+    return pool;
+}
+}    // namespace leaf
@@ -0,0 +1,17 @@
+#ifndef LEAF_FILE_THREAD_POOLS_H
+#define LEAF_FILE_THREAD_POOLS_H
+
+#include <boost/asio/thread_pool.hpp>
+
+namespace leaf
+{
+// 文件传输共享的工作线程池, 摘要计算和阻塞的磁盘读写分开, 都不占用网络线程
+boost::asio::thread_pool& cpu_pool();
+boost::asio::thread_pool& disk_pool();
+// stat/rename/目录遍历等阻塞的元数据操作, 与数据读写分开, 慢的元数据操作不占满磁盘线程
+boost::asio::thread_pool& metadata_pool();
+// 后台补建摘要清单等可以延后的整文件读取, 单线程低优先级, 不与上传下载争用 disk_pool
+boost::asio::thread_pool& background_pool();
+}    // namespace leaf
+
+#endif
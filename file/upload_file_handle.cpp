@@ -1,20 +1,33 @@
 #include <utility>
 #include <filesystem>
+#include <boost/asio/experimental/awaitable_operators.hpp>
 #include "log/log.h"
 #include "file/file.h"
 #include "crypt/easy.h"
 #include "crypt/passwd.h"
+#include "net/buffer.h"
 #include "net/exception.h"
 #include "config/config.h"
 #include "protocol/codec.h"
 #include "protocol/message.h"
+#include "file/hash_file.h"
+#include "file/chunk_store.h"
+#include "file/digest_index.h"
+#include "file/range_registry.h"
+#include "file/thread_pools.h"
+#include "file/group_commit.h"
+#include "file/metadata_executor.h"
 #include "file/upload_file_handle.h"
 
 namespace leaf
 {
 
 upload_file_handle::upload_file_handle(const boost::asio::any_io_executor& io, std::string id, leaf::websocket_session::ptr& session)
-    : id_(std::move(id)), session_(session), io_(io)
+    : id_(std::move(id)),
+      cpu_strand_(boost::asio::make_strand(leaf::cpu_pool())),
+      disk_strand_(boost::asio::make_strand(leaf::disk_pool())),
+      session_(session),
+      io_(io)
 {
     LOG_INFO("create {}", id_);
     key_ = leaf::passwd_key();
@@ -35,6 +48,12 @@ void upload_file_handle::startup()
 
 boost::asio::awaitable<void> upload_file_handle::write(const std::vector<uint8_t>& msg, boost::beast::error_code& ec)
 {
+    // 流水线模式下所有发送由 send_loop 排队写出
+    if (send_timer_ != nullptr)
+    {
+        send(msg);
+        co_return;
+    }
     co_await session_->write(ec, msg.data(), msg.size());
 }
 
@@ -78,6 +97,12 @@ boost::asio::awaitable<void> upload_file_handle::loop()
         co_return;
     }
     LOG_INFO("{} login success token {}", id_, token_);
+    if (options_.version >= kPipelineProtocolVersion)
+    {
+        co_await pipeline_loop(ec);
+        LOG_INFO("{} pipeline shutdown {}", id_, ec.message());
+        co_return;
+    }
     boost::beast::flat_buffer buffer;
     while (true)
     {
@@ -137,59 +162,51 @@ boost::asio::awaitable<void> upload_file_handle::wait_login(boost::beast::error_
     {
         co_return;
     }
-    auto message = boost::beast::buffers_to_string(buffer.data());
-    auto type = leaf::get_message_type(message);
-    auto bytes = std::vector<uint8_t>(message.begin(), message.end());
-    if (type != leaf::message_type::login)
-    {
-        ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
-        co_return;
-    }
-    auto login = leaf::deserialize_login_token(bytes);
-    if (!login.has_value())
+    auto message = leaf::decode(leaf::buffers_to_span(buffer.cdata()));
+    const auto* login = std::get_if<leaf::login_token>(&message);
+    if (login == nullptr)
     {
         ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
         co_return;
     }
 
     token_ = login->token;
-    co_await write(leaf::serialize_login_token(login.value()), ec);
+    options_ = leaf::negotiate_transfer_options(*login);
+    LOG_INFO("{} login version {} codec {} block size {} hash block size {} digest {} window {}",
+             id_,
+             options_.version,
+             static_cast<int>(options_.codec),
+             options_.block_size,
+             options_.hash_block_size,
+             static_cast<int>(options_.digest),
+             options_.window);
+    auto response = *login;
+    leaf::set_transfer_options(response, options_);
+    co_await write(leaf::serialize_login_token(response), ec);
 }
 
-boost::asio::awaitable<leaf::file_info> upload_file_handle::wait_upload_file_request(boost::beast::error_code& ec)
+leaf::file_info upload_file_handle::prepare_upload_file(const leaf::upload_file_request& req, boost::beast::error_code& ec)
 {
     leaf::file_info file;
-    boost::beast::flat_buffer buffer;
-    co_await session_->read(ec, buffer);
-    if (ec)
-    {
-        co_return file;
-    }
-    auto message = boost::beast::buffers_to_string(buffer.data());
-    buffer.consume(buffer.size());
-    auto type = leaf::get_message_type(message);
-    if (type != leaf::message_type::upload_file_request)
-    {
-        ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
-        co_return file;
-    }
-    auto bytes = std::vector<uint8_t>(message.begin(), message.end());
-    auto req = leaf::deserialize_upload_file_request(bytes);
-    if (!req.has_value())
+    auto local_path = std::filesystem::path(token_).append(req.dir).string();
+    auto file_path = leaf::make_file_path(local_path, leaf::encode(req.filename));
+    auto upload_file_path = leaf::encode_tmp_filename(file_path);
+    // 分段上传由多个连接共享临时文件, 只有新的一次上传才删除
+    if (req.length != 0)
     {
-        ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
-        co_return file;
+        ec = leaf::range_registry::instance().join(upload_file_path, req.range_id, req.filesize);
+        if (ec)
+        {
+            return file;
+        }
     }
-    auto local_path = std::filesystem::path(token_).append(req->dir).string();
-    auto file_path = leaf::make_file_path(local_path, leaf::encode(req->filename));
-    auto upload_file_path = leaf::encode_tmp_filename(file_path);
     bool exist = std::filesystem::exists(upload_file_path, ec);
     if (ec)
     {
         LOG_ERROR("{} upload request file {} exist failed {}", id_, upload_file_path, ec.message());
-        co_return file;
+        return file;
     }
-    if (exist)
+    if (exist && req.length == 0)
     {
         ec = {};
         LOG_ERROR("{} upload request file {} exist", id_, upload_file_path);
@@ -197,29 +214,72 @@ boost::asio::awaitable<leaf::file_info> upload_file_handle::wait_upload_file_req
         if (ec)
         {
             ec = boost::system::errc::make_error_code(boost::system::errc::file_exists);
-            co_return file;
+            return file;
         }
         LOG_WARN("{} upload request file {} remove success", id_, upload_file_path);
     }
-    LOG_INFO("{} upload request file size {} name {} path {} dir {} local path {}",
+    LOG_INFO("{} upload request {} file size {} range {}:{} name {} path {} dir {} local path {}",
              id_,
-             req->filesize,
-             req->filename,
-             req->dir,
+             req.id,
+             req.filesize,
+             req.offset,
+             req.length,
+             req.filename,
+             req.dir,
              upload_file_path,
              local_path);
 
-    file.filename = req->filename;
-    file.file_size = req->filesize;
+    file.filename = req.filename;
+    file.file_size = req.filesize;
     file.dir = local_path;
     file.local_path = upload_file_path;
+    file.offset = req.offset;
+    file.length = req.length;
+    file.range_id = req.range_id;
+    file.hash = req.hash;
+    return file;
+}
+
+boost::asio::awaitable<leaf::file_info> upload_file_handle::wait_upload_file_request(boost::beast::error_code& ec)
+{
+    leaf::file_info file;
+    boost::beast::flat_buffer buffer;
+    co_await session_->read(ec, buffer);
+    if (ec)
+    {
+        co_return file;
+    }
+    auto message = leaf::decode(leaf::buffers_to_span(buffer.cdata()));
+    const auto* req = std::get_if<leaf::upload_file_request>(&message);
+    if (req == nullptr)
+    {
+        ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
+        co_return file;
+    }
+    file = co_await leaf::offload_metadata(token_, [&]() { return prepare_upload_file(*req, ec); });
+    if (ec)
+    {
+        co_return file;
+    }
     leaf::upload_file_response ufr;
     ufr.id = req->id;
     ufr.filename = req->filename;
-    co_await write(leaf::serialize_upload_file_response(ufr), ec);
+    co_await write(leaf::serialize_upload_file_response(ufr, options_.codec), ec);
     co_return file;
 }
 
+void upload_file_handle::preallocate(leaf::file_writer& writer, const leaf::file_info& file)
+{
+    // 按文件大小一次分配, 避免逐块追加产生碎片, 失败不影响上传
+    auto offset = static_cast<int64_t>(file.offset);
+    auto length = static_cast<int64_t>(file.length != 0 ? file.length : file.file_size);
+    auto ec = writer.preallocate(offset, length);
+    if (ec)
+    {
+        LOG_DEBUG("{} preallocate {} {}:{} error {}", id_, file.local_path, offset, length, ec.message());
+    }
+}
+
 boost::asio::awaitable<void> upload_file_handle::wait_ack(boost::beast::error_code& ec)
 {
     boost::beast::flat_buffer buffer;
@@ -228,10 +288,8 @@ boost::asio::awaitable<void> upload_file_handle::wait_ack(boost::beast::error_co
     {
         co_return;
     }
-    auto message = boost::beast::buffers_to_string(buffer.data());
-    buffer.consume(buffer.size());
-    auto type = leaf::get_message_type(message);
-    if (type != leaf::message_type::ack)
+    auto message = leaf::decode(leaf::buffers_to_span(buffer.cdata()));
+    if (!std::holds_alternative<leaf::ack>(message))
     {
         ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
         co_return;
@@ -247,63 +305,72 @@ boost::asio::awaitable<void> upload_file_handle::send_file_done(boost::beast::er
 boost::asio::awaitable<void> upload_file_handle::wait_file_data(leaf::file_info& file, boost::beast::error_code& ec)
 {
     auto hash = std::make_shared<leaf::blake2b>();
-    auto writer = std::make_shared<leaf::file_writer>(file.local_path);
+    auto file_hash = file.file_size >= kInstantSize ? std::make_shared<leaf::manifest_builder>() : nullptr;
+    auto writer = std::make_shared<leaf::file_writer>(file.local_path, leaf::use_direct_io(file.file_size));
     ec = writer->open();
     if (ec)
     {
         LOG_ERROR("{} open file {} error {}", id_, file.local_path, ec.message());
         co_return;
     }
+    preallocate(*writer, file);
     bool done = false;
     auto filename = leaf::encode_leaf_filename(file.local_path);
     while (true)
     {
-        boost::beast::flat_buffer buffer;
-        co_await session_->read(ec, buffer);
+        recv_buffer_.consume(recv_buffer_.size());
+        co_await session_->read(ec, recv_buffer_);
         if (ec)
         {
             break;
         }
-        auto message = boost::beast::buffers_to_string(buffer.data());
-        auto type = leaf::get_message_type(message);
-        if (type == leaf::message_type::done)
+        auto message = leaf::decode(leaf::buffers_to_span(recv_buffer_.cdata()));
+        if (std::holds_alternative<leaf::done>(message))
         {
+            leaf::group_commit::files commit{{file.local_path, filename}};
+            ec = co_await leaf::commit_files(token_, std::move(commit));
+            if (ec)
+            {
+                LOG_ERROR("{} upload file {} commit error {}", id_, file.filename, ec.message());
+                break;
+            }
             done = true;
-            leaf::rename(file.local_path, filename);
 
             LOG_INFO("{} upload file {} done", id_, file.filename);
             break;
         }
-        if (type != leaf::message_type::file_data)
+        const auto* d = std::get_if<leaf::file_data_view>(&message);
+        if (d == nullptr)
         {
             ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
             break;
         }
-        auto bytes = std::vector<uint8_t>(message.begin(), message.end());
-        auto d = leaf::deserialize_file_data(bytes);
-        if (!d.has_value())
+        if (d->data.size() > options_.block_size)
         {
+            LOG_ERROR("{} file {} data size {} over block size {}", id_, file.filename, d->data.size(), options_.block_size);
+            ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
             break;
         }
-        assert(d->data.size() <= kBlockSize);
-        writer->write_at(static_cast<int64_t>(writer->size()), d->data.data(), d->data.size(), ec);
+        co_await writer->async_write_at(static_cast<int64_t>(writer->size()), d->data.data(), d->data.size(), ec);
         if (ec)
         {
             LOG_ERROR("{} file write error {} {}", id_, file.filename, ec.message());
             break;
         }
         hash->update(d->data.data(), d->data.size());
+        if (file_hash != nullptr)
+        {
+            file_hash->update(d->data.data(), d->data.size());
+        }
 
-        LOG_DEBUG(
-            "{} file {} hash {} data size {} write size {}", id_, file.filename, d->hash.empty() ? "empty" : d->hash, d->data.size(), writer->size());
+        LOG_DEBUG("{} file {} hash size {} data size {} write size {}", id_, file.filename, d->hash.size(), d->data.size(), writer->size());
 
         if (!d->hash.empty())
         {
             hash->final();
-            auto hex_str = hash->hex();
-            if (hex_str != d->hash)
+            if (!leaf::verify_block_hash(*hash, d->hash))
             {
-                LOG_ERROR("{} file hash not match {} {} {}", id_, file.filename, hex_str, d->hash);
+                LOG_ERROR("{} file hash not match {} {}", id_, file.filename, hash->hex());
                 break;
             }
             hash->reset();
@@ -322,9 +389,860 @@ boost::asio::awaitable<void> upload_file_handle::wait_file_data(leaf::file_info&
     {
         co_return;
     }
+    co_await leaf::offload_metadata(token_, [&]() { index_upload(file, file_hash); });
     LOG_INFO("{} upload file {} done", id_, file.filename);
 }
 
+boost::asio::awaitable<void> upload_file_handle::pipeline_loop(boost::beast::error_code& ec)
+{
+    using boost::asio::experimental::awaitable_operators::operator||;
+
+    send_timer_ = std::make_shared<boost::asio::steady_timer>(io_);
+    stage_timer_ = std::make_shared<boost::asio::steady_timer>(io_);
+    pipeline_stop_ = false;
+    boost::beast::error_code send_ec;
+    co_await (receive_loop(ec) || send_loop(send_ec));
+    if (!ec)
+    {
+        ec = send_ec;
+    }
+    // 阶段中的块全部完成后才能关闭文件
+    co_await wait_stages([this]() { return stage_pending_ == 0; });
+    // 未完成的临时文件保留, 客户端重连后从断点续传
+    for (auto& [id, ctx] : uploads_)
+    {
+        auto file_ec = ctx.writer->close();
+        if (file_ec)
+        {
+            LOG_ERROR("{} upload {} close file {} error {}", id_, id, ctx.file.local_path, file_ec.message());
+        }
+    }
+    uploads_.clear();
+    batches_.clear();
+    outbox_.clear();
+}
+
+boost::asio::awaitable<void> upload_file_handle::receive_loop(boost::beast::error_code& ec)
+{
+    while (true)
+    {
+        recv_buffer_.consume(recv_buffer_.size());
+        co_await session_->read(ec, recv_buffer_);
+        if (ec)
+        {
+            break;
+        }
+        auto message = leaf::decode(leaf::buffers_to_span(recv_buffer_.cdata()));
+        if (std::holds_alternative<std::monostate>(message))
+        {
+            ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
+            break;
+        }
+        co_await std::visit(leaf::overloaded{[&](const leaf::keepalive& msg) { return on_keepalive(msg, ec); },
+                                             [&](const leaf::upload_file_request& msg) { return on_upload_file_request(msg, ec); },
+                                             [&](const leaf::file_data_view& msg) { return on_file_data(msg, ec); },
+                                             [&](const leaf::done& msg) { return on_file_done(msg, ec); },
+                                             [&](const leaf::chunk_offer& msg) { return on_chunk_offer(msg, ec); },
+                                             [&](const leaf::upload_batch_request& msg) { return on_upload_batch_request(msg, ec); },
+                                             [&](const auto&) -> boost::asio::awaitable<void>
+                                             {
+                                                 ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
+                                                 co_return;
+                                             }},
+                            message);
+        if (ec)
+        {
+            LOG_ERROR("{} pipeline message {} error {}", id_, message.index(), ec.message());
+            break;
+        }
+    }
+    pipeline_stop_ = true;
+    send_timer_->cancel();
+}
+
+boost::asio::awaitable<void> upload_file_handle::send_loop(boost::beast::error_code& ec)
+{
+    while (!pipeline_stop_)
+    {
+        if (outbox_.empty())
+        {
+            // 有消息排队时取消定时器唤醒
+            boost::beast::error_code wait_ec;
+            send_timer_->expires_at(std::chrono::steady_clock::time_point::max());
+            co_await send_timer_->async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, wait_ec));
+            continue;
+        }
+        auto msg = std::move(outbox_.front());
+        outbox_.pop_front();
+        co_await session_->write(ec, msg.data(), msg.size());
+        if (ec)
+        {
+            LOG_ERROR("{} pipeline send error {}", id_, ec.message());
+            break;
+        }
+    }
+    pipeline_stop_ = true;
+}
+
+void upload_file_handle::send(std::vector<uint8_t> msg)
+{
+    outbox_.push_back(std::move(msg));
+    send_timer_->cancel();
+}
+
+boost::asio::awaitable<void> upload_file_handle::wait_stages(const std::function<bool()>& ready)
+{
+    // 阶段完成时取消定时器唤醒
+    while (!ready())
+    {
+        boost::beast::error_code wait_ec;
+        stage_timer_->expires_at(std::chrono::steady_clock::time_point::max());
+        co_await stage_timer_->async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, wait_ec));
+    }
+}
+
+void upload_file_handle::submit(const std::shared_ptr<stage_job>& job)
+{
+    stage_pending_++;
+    job->state->pending++;
+    // 同一个连接的块在各自的 strand 上按顺序执行, 摘要状态不需要加锁
+    boost::asio::post(cpu_strand_,
+                      [this, self = shared_from_this(), job]()
+                      {
+                          verify_stage(*job);
+                          boost::asio::post(disk_strand_,
+                                            [this, self, job]()
+                                            {
+                                                write_stage(*job);
+                                                boost::asio::post(io_, [this, self, job]() { on_stage_done(*job); });
+                                            });
+                      });
+}
+
+void upload_file_handle::verify_stage(stage_job& job)
+{
+    if (job.state->failed)
+    {
+        return;
+    }
+    job.hash->update(job.data.data(), job.data.size());
+    if (job.file_hash != nullptr)
+    {
+        job.file_hash->update(job.data.data(), job.data.size());
+    }
+    if (job.expect.empty())
+    {
+        return;
+    }
+    job.hash->final();
+    job.verified = leaf::verify_block_hash(*job.hash, job.expect);
+    if (!job.verified)
+    {
+        LOG_ERROR("{} upload {} file hash not match {}", id_, job.id, job.hash->hex());
+        job.ec = boost::system::errc::make_error_code(boost::system::errc::illegal_byte_sequence);
+        job.state->failed = true;
+    }
+    job.hash->reset();
+}
+
+void upload_file_handle::write_stage(stage_job& job)
+{
+    auto& state = *job.state;
+    if (state.failed)
+    {
+        return;
+    }
+    // 连续的块攒到一起用一次 pwritev 写入, 不连续时先写出已有的部分
+    if (!state.blocks.empty() && state.write_offset + static_cast<int64_t>(state.buffered) != job.offset)
+    {
+        flush_stage(job);
+    }
+    if (!job.ec)
+    {
+        if (state.blocks.empty())
+        {
+            state.write_offset = job.offset;
+        }
+        state.buffered += job.data.size();
+        state.blocks.push_back(std::move(job.data));
+        if (job.flush || state.buffered >= kWriteBatchSize)
+        {
+            flush_stage(job);
+        }
+    }
+    if (job.ec)
+    {
+        state.failed = true;
+    }
+}
+
+void upload_file_handle::flush_stage(stage_job& job)
+{
+    auto& state = *job.state;
+    std::vector<std::span<const uint8_t>> buffers(state.blocks.begin(), state.blocks.end());
+    auto size = job.writer->writev_at(state.write_offset, buffers, job.ec);
+    if (!job.ec && size != state.buffered)
+    {
+        job.ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+    }
+    state.write_offset += static_cast<int64_t>(size);
+    state.buffered = 0;
+    state.blocks.clear();
+}
+
+void upload_file_handle::on_stage_done(const stage_job& job)
+{
+    stage_pending_--;
+    job.state->pending--;
+    stage_timer_->cancel();
+    auto it = uploads_.find(job.id);
+    if (it == uploads_.end() || it->second.state != job.state)
+    {
+        // 已经失败的上传, 最后一个块完成后关闭文件
+        if (job.state->closing && job.state->pending == 0)
+        {
+            auto _ = job.writer->close();
+        }
+        return;
+    }
+    auto& ctx = it->second;
+    if (job.ec)
+    {
+        LOG_ERROR("{} upload {} file {} error {}", id_, job.id, ctx.file.filename, job.ec.message());
+        close_upload(ctx);
+        uploads_.erase(it);
+        leaf::error_message e;
+        e.id = job.id;
+        e.error = job.ec.value();
+        send(leaf::serialize_error_message(e, options_.codec));
+        return;
+    }
+    // 每个摘要块校验并写盘后回复累计偏移, 客户端据此滑动窗口
+    if (!job.verified)
+    {
+        return;
+    }
+    // 分段上传记录断点, 断线重连后从这里继续
+    if (ctx.file.length != 0)
+    {
+        leaf::range_registry::instance().verify(ctx.file.local_path, ctx.file.range_id, ctx.file.offset, job.received);
+    }
+    leaf::ack a;
+    a.id = job.id;
+    a.offset = job.received;
+    send(leaf::serialize_ack(a));
+}
+
+void upload_file_handle::close_upload(upload_context& ctx)
+{
+    ctx.state->failed = true;
+    ctx.state->closing = true;
+    if (ctx.state->pending == 0)
+    {
+        auto _ = ctx.writer->close();
+    }
+}
+
+boost::asio::awaitable<void> upload_file_handle::on_keepalive(const leaf::keepalive& k, boost::beast::error_code& ec)
+{
+    auto sk = k;
+    sk.server_timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    co_await write(serialize_keepalive(sk, options_.codec), ec);
+}
+
+boost::asio::awaitable<void> upload_file_handle::on_upload_file_request(const leaf::upload_file_request& req, boost::beast::error_code& ec)
+{
+    if (uploads_.contains(req.id) || batches_.contains(req.id))
+    {
+        LOG_ERROR("{} upload {} duplicate request {}", id_, req.id, req.filename);
+        ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
+        co_return;
+    }
+    boost::beast::error_code file_ec;
+    if (req.length != 0 && (options_.version < kRangeProtocolVersion || req.offset + req.length > req.filesize))
+    {
+        LOG_ERROR("{} upload {} invalid range {}:{} file size {}", id_, req.id, req.offset, req.length, req.filesize);
+        file_ec = boost::system::errc::make_error_code(boost::system::errc::invalid_argument);
+    }
+    if (req.dedup && (options_.version < kDedupProtocolVersion || options_.block_size < kChunkMaxSize))
+    {
+        LOG_ERROR("{} upload {} dedup not supported version {} block size {}", id_, req.id, options_.version, options_.block_size);
+        file_ec = boost::system::errc::make_error_code(boost::system::errc::not_supported);
+    }
+    if (!file_ec && !req.hash.empty() && co_await instant_upload(req, ec))
+    {
+        co_return;
+    }
+    upload_context ctx;
+    if (!file_ec)
+    {
+        ctx.file = co_await leaf::offload_metadata(token_, [&]() { return prepare_upload_file(req, file_ec); });
+    }
+    if (!file_ec)
+    {
+        ctx.writer = std::make_shared<leaf::file_writer>(ctx.file.local_path, leaf::use_direct_io(ctx.file.file_size));
+        file_ec = ctx.writer->open();
+    }
+    if (!file_ec)
+    {
+        preallocate(*ctx.writer, ctx.file);
+    }
+    // 单个文件失败只通知客户端, 不断开连接
+    if (file_ec)
+    {
+        LOG_ERROR("{} upload {} open file {} error {}", id_, req.id, ctx.file.local_path, file_ec.message());
+        co_await error_message(req.id, file_ec.value(), ec);
+        co_return;
+    }
+    ctx.hash = std::make_shared<leaf::blake2b>();
+    ctx.dedup = req.dedup;
+    if (req.length != 0)
+    {
+        ctx.skip = leaf::range_registry::instance().start(ctx.file.local_path, req.range_id, req.offset, req.resume);
+        LOG_INFO("{} upload {} file {} range {}:{} resume {}", id_, req.id, req.filename, req.offset, req.length, ctx.skip);
+    }
+    // 从文件开头顺序到达的数据顺便计算整个文件的摘要, 其余情况完成后重新读取
+    if (!ctx.dedup && ctx.skip == 0 && req.offset == 0 && (req.length == 0 || req.length == req.filesize) && req.filesize >= kInstantSize)
+    {
+        ctx.file_hash = std::make_shared<leaf::manifest_builder>();
+    }
+    leaf::upload_file_response ufr;
+    ufr.id = req.id;
+    ufr.filename = req.filename;
+    ufr.offset = ctx.skip;
+    uploads_.emplace(req.id, std::move(ctx));
+
+    co_await write(leaf::serialize_upload_file_response(ufr, options_.codec), ec);
+}
+
+boost::asio::awaitable<void> upload_file_handle::on_file_data(const leaf::file_data_view& d, boost::beast::error_code& ec)
+{
+    // 校验和写盘在工作线程上进行, 阶段中的块达到上限时不再读取网络
+    // 等待期间 recv_buffer_ 不会被覆盖, d 仍然有效
+    co_await wait_stages([this]() { return stage_pending_ < kReceiveQueueBlocks; });
+    auto batch = batches_.find(d.id);
+    if (batch != batches_.end())
+    {
+        co_await on_batch_data(batch->second, d, ec);
+        co_return;
+    }
+    auto it = uploads_.find(d.id);
+    if (it == uploads_.end())
+    {
+        // 已经失败的传输, 剩余数据直接丢弃
+        co_return;
+    }
+    auto& ctx = it->second;
+    if (ctx.dedup)
+    {
+        co_await on_chunk_data(ctx, d, ec);
+        co_return;
+    }
+    auto received = ctx.skip + ctx.queued;
+    if (d.data.size() > options_.block_size || (ctx.file.length != 0 && received + d.data.size() > ctx.file.length))
+    {
+        co_await fail_upload(d.id, boost::system::errc::make_error_code(boost::system::errc::protocol_error), ec);
+        co_return;
+    }
+    auto job = std::make_shared<stage_job>();
+    job->id = d.id;
+    job->state = ctx.state;
+    job->hash = ctx.hash;
+    job->file_hash = ctx.file_hash;
+    job->writer = ctx.writer;
+    job->data.assign(d.data.begin(), d.data.end());
+    job->expect.assign(d.hash.begin(), d.hash.end());
+    // 分段数据写到各自的偏移上, 摘要按分段独立计算
+    job->offset = static_cast<int64_t>(ctx.file.offset + received);
+    job->received = received + d.data.size();
+    job->flush = !d.hash.empty() || job->received == (ctx.file.length != 0 ? ctx.file.length : ctx.file.file_size);
+    ctx.queued += d.data.size();
+    submit(job);
+}
+
+boost::asio::awaitable<void> upload_file_handle::on_chunk_offer(const leaf::chunk_offer& o, boost::beast::error_code& ec)
+{
+    auto it = uploads_.find(o.id);
+    if (it == uploads_.end())
+    {
+        co_return;
+    }
+    auto& ctx = it->second;
+    if (!ctx.dedup || o.hashes.size() != o.sizes.size() * leaf::blake2b::kDigestSize || !ctx.missing.empty())
+    {
+        co_await fail_upload(o.id, boost::system::errc::make_error_code(boost::system::errc::protocol_error), ec);
+        co_return;
+    }
+    auto& store = leaf::chunk_store::instance();
+    uint64_t length = ctx.file.length != 0 ? ctx.file.length : ctx.file.file_size;
+    leaf::chunk_need need;
+    need.id = o.id;
+    for (std::size_t i = 0; i < o.sizes.size(); i++)
+    {
+        auto size = o.sizes[i];
+        if (size == 0 || size > kChunkMaxSize || ctx.chunk_offset + size > length)
+        {
+            co_await fail_upload(o.id, boost::system::errc::make_error_code(boost::system::errc::protocol_error), ec);
+            co_return;
+        }
+        leaf::chunk c;
+        c.offset = ctx.chunk_offset;
+        c.size = size;
+        std::copy_n(reinterpret_cast<const uint8_t*>(o.hashes.data()) + i * c.digest.size(), c.digest.size(), c.digest.begin());
+        ctx.chunk_offset += size;
+        // 仓库中已有的分块直接复制到目标文件, 查找和读取都在 disk_pool 上
+        boost::beast::error_code file_ec;
+        bool found = false;
+        auto data = co_await boost::asio::co_spawn(
+            leaf::disk_pool(),
+            [&store, &c, &found, &file_ec]() -> boost::asio::awaitable<std::vector<uint8_t>>
+            {
+                found = store.contains(c.digest);
+                co_return found ? store.get(c.digest, file_ec) : std::vector<uint8_t>{};
+            },
+            boost::asio::use_awaitable);
+        if (found)
+        {
+            if (!file_ec && data.size() == c.size)
+            {
+                auto offset = static_cast<int64_t>(ctx.file.offset + c.offset);
+                co_await ctx.writer->async_write_at(offset, data.data(), data.size(), file_ec);
+                if (!file_ec)
+                {
+                    continue;
+                }
+            }
+            LOG_WARN("{} upload {} chunk {} copy error {}, request it", id_, o.id, c.offset, file_ec.message());
+        }
+        ctx.missing.push_back(c);
+        need.indexes.push_back(static_cast<uint32_t>(i));
+    }
+    LOG_DEBUG("{} upload {} chunk offer {} need {} offset {}", id_, o.id, o.sizes.size(), need.indexes.size(), ctx.chunk_offset);
+    co_await write(leaf::serialize_chunk_need(need, options_.codec), ec);
+}
+
+boost::asio::awaitable<void> upload_file_handle::on_chunk_data(upload_context& ctx, const leaf::file_data_view& d, boost::beast::error_code& ec)
+{
+    boost::beast::error_code file_ec;
+    if (ctx.missing.empty() || ctx.missing.front().size != d.data.size())
+    {
+        file_ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
+    }
+    else
+    {
+        const auto& c = ctx.missing.front();
+        leaf::blake2b hash;
+        hash.update(d.data.data(), static_cast<uint32_t>(d.data.size()));
+        hash.final();
+        if (!hash.equal(c.digest))
+        {
+            LOG_ERROR("{} upload {} chunk {} hash not match", id_, d.id, c.offset);
+            file_ec = boost::system::errc::make_error_code(boost::system::errc::illegal_byte_sequence);
+        }
+        else
+        {
+            co_await ctx.writer->async_write_at(static_cast<int64_t>(ctx.file.offset + c.offset), d.data.data(), d.data.size(), file_ec);
+        }
+        // 写入仓库失败不影响本次上传, 只是下次不能去重
+        if (!file_ec)
+        {
+            auto store_ec = co_await boost::asio::co_spawn(
+                leaf::disk_pool(),
+                [&c, &d]() -> boost::asio::awaitable<boost::system::error_code> { co_return leaf::chunk_store::instance().put(c.digest, d.data); },
+                boost::asio::use_awaitable);
+            if (store_ec)
+            {
+                LOG_WARN("{} upload {} chunk {} store error {}", id_, d.id, c.offset, store_ec.message());
+            }
+        }
+    }
+    if (file_ec)
+    {
+        co_await fail_upload(d.id, file_ec, ec);
+        co_return;
+    }
+    ctx.missing.pop_front();
+    ctx.chunk_received += d.data.size();
+    // 去重模式下只对实际传输的字节确认
+    leaf::ack a;
+    a.id = d.id;
+    a.offset = ctx.chunk_received;
+    co_await write(leaf::serialize_ack(a), ec);
+}
+
+boost::asio::awaitable<void> upload_file_handle::fail_upload(uint32_t id, boost::beast::error_code file_ec, boost::beast::error_code& ec)
+{
+    auto it = uploads_.find(id);
+    if (it == uploads_.end())
+    {
+        co_return;
+    }
+    LOG_ERROR("{} upload {} file {} error {}", id_, id, it->second.file.filename, file_ec.message());
+    close_upload(it->second);
+    uploads_.erase(it);
+    co_await error_message(id, file_ec.value(), ec);
+}
+
+boost::asio::awaitable<void> upload_file_handle::on_file_done(const leaf::done& d, boost::beast::error_code& ec)
+{
+    auto batch = batches_.find(d.id);
+    if (batch != batches_.end())
+    {
+        auto b = std::move(batch->second);
+        batches_.erase(batch);
+        co_await on_batch_done(std::move(b), ec);
+        co_return;
+    }
+    auto it = uploads_.find(d.id);
+    if (it == uploads_.end())
+    {
+        co_return;
+    }
+    // 等待这个文件的块全部校验并写盘, 期间失败的上传已经回复错误
+    auto state = it->second.state;
+    co_await wait_stages([&state]() { return state->pending == 0; });
+    it = uploads_.find(d.id);
+    if (it == uploads_.end() || it->second.state != state)
+    {
+        co_return;
+    }
+    // 去重模式下所有分块都要到齐
+    const auto& file = it->second.file;
+    uint64_t length = file.length != 0 ? file.length : file.file_size;
+    if (it->second.dedup && (!it->second.missing.empty() || it->second.writer->size() != length || it->second.chunk_offset != length))
+    {
+        co_await fail_upload(d.id, boost::system::errc::make_error_code(boost::system::errc::io_error), ec);
+        co_return;
+    }
+    auto ctx = std::move(it->second);
+    uploads_.erase(it);
+    auto file_ec = ctx.writer->close();
+    if (file_ec)
+    {
+        LOG_ERROR("{} upload {} close file {} error {}", id_, d.id, ctx.file.local_path, file_ec.message());
+        co_await error_message(d.id, file_ec.value(), ec);
+        co_return;
+    }
+    if (ctx.file.length != 0)
+    {
+        auto& registry = leaf::range_registry::instance();
+        if (ctx.skip + ctx.writer->size() != ctx.file.length)
+        {
+            LOG_ERROR("{} upload {} range {}:{} short write {}", id_, d.id, ctx.file.offset, ctx.file.length, ctx.skip + ctx.writer->size());
+            co_await error_message(d.id, boost::system::errc::io_error, ec);
+            co_return;
+        }
+        // 其他分段还没有完成, 只确认本分段
+        auto complete = registry.complete(ctx.file.local_path, ctx.file.range_id, ctx.file.offset, ctx.file.length, file_ec);
+        if (file_ec)
+        {
+            co_await error_message(d.id, file_ec.value(), ec);
+            co_return;
+        }
+        if (!complete)
+        {
+            LOG_INFO("{} upload {} file {} range {}:{} done", id_, d.id, ctx.file.filename, ctx.file.offset, ctx.file.length);
+            co_await write(leaf::serialize_done(d), ec);
+            co_return;
+        }
+    }
+    // 持久模式下 done 在组提交落盘后才回复
+    leaf::group_commit::files commit{{ctx.file.local_path, leaf::encode_leaf_filename(ctx.file.local_path)}};
+    file_ec = co_await leaf::commit_files(token_, std::move(commit));
+    if (file_ec)
+    {
+        LOG_ERROR("{} upload {} commit file {} error {}", id_, d.id, ctx.file.local_path, file_ec.message());
+        co_await error_message(d.id, file_ec.value(), ec);
+        co_return;
+    }
+    co_await leaf::offload_metadata(token_, [&]() { index_upload(ctx.file, ctx.file_hash); });
+    LOG_INFO("{} upload {} file {} done", id_, d.id, ctx.file.filename);
+    co_await write(leaf::serialize_done(d), ec);
+}
+
+boost::asio::awaitable<void> upload_file_handle::on_upload_batch_request(const leaf::upload_batch_request& req, boost::beast::error_code& ec)
+{
+    if (uploads_.contains(req.id) || batches_.contains(req.id))
+    {
+        LOG_ERROR("{} upload {} duplicate batch request", id_, req.id);
+        ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
+        co_return;
+    }
+    auto count = req.filenames.size();
+    bool valid = options_.version >= kBatchProtocolVersion && count <= kBatchFiles && req.sizes.size() == count &&
+                 req.hashes.size() == count * leaf::blake2b::kDigestSize;
+    uint64_t size = 0;
+    for (std::size_t i = 0; valid && i < count; i++)
+    {
+        valid = req.sizes[i] <= kBatchFileSize && !req.filenames[i].empty();
+        size += req.sizes[i];
+    }
+    // 数据不能超过上限, 否则整批拒绝, 后续数据直接丢弃
+    if (!valid || size > kBatchSize)
+    {
+        LOG_ERROR("{} upload {} invalid batch files {} size {}", id_, req.id, count, size);
+        co_await error_message(req.id, boost::system::errc::invalid_argument, ec);
+        co_return;
+    }
+    batch_context batch;
+    batch.req = req;
+    batch.dir = std::filesystem::path(token_).append(req.dir).string();
+    batch.size = size;
+    batch.data.reserve(size);
+    LOG_INFO("{} upload {} batch files {} size {} dir {}", id_, req.id, count, size, batch.dir);
+    batches_.emplace(req.id, std::move(batch));
+}
+
+boost::asio::awaitable<void> upload_file_handle::on_batch_data(batch_context& batch, const leaf::file_data_view& d, boost::beast::error_code& ec)
+{
+    if (d.data.size() > options_.block_size || batch.data.size() + d.data.size() > batch.size)
+    {
+        LOG_ERROR("{} upload {} batch data {} over size {}", id_, d.id, batch.data.size() + d.data.size(), batch.size);
+        batches_.erase(d.id);
+        co_await error_message(d.id, boost::system::errc::protocol_error, ec);
+        co_return;
+    }
+    auto before = batch.data.size();
+    batch.data.insert(batch.data.end(), d.data.begin(), d.data.end());
+    // 每个摘要块确认一次, 摘要在 done 时按文件校验
+    if (before / options_.hash_block_size != batch.data.size() / options_.hash_block_size || batch.data.size() == batch.size)
+    {
+        leaf::ack a;
+        a.id = d.id;
+        a.offset = batch.data.size();
+        co_await write(leaf::serialize_ack(a), ec);
+    }
+}
+
+boost::asio::awaitable<void> upload_file_handle::on_batch_done(batch_context batch, boost::beast::error_code& ec)
+{
+    auto id = batch.req.id;
+    boost::system::error_code file_ec;
+    if (batch.data.size() != batch.size)
+    {
+        LOG_ERROR("{} upload {} batch short data {}/{}", id_, id, batch.data.size(), batch.size);
+        file_ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+    }
+    leaf::group_commit::files renames;
+    if (!file_ec)
+    {
+        file_ec = co_await leaf::offload_metadata(token_, [&]() { return write_batch(batch, renames); });
+    }
+    if (!file_ec)
+    {
+        file_ec = co_await leaf::commit_files(token_, renames);
+        if (file_ec)
+        {
+            LOG_ERROR("{} upload {} batch dir {} commit error {}", id_, id, batch.dir, file_ec.message());
+            co_await leaf::offload_metadata(token_,
+                                            [&renames]()
+                                            {
+                                                for (const auto& [tmp_path, leaf_path] : renames)
+                                                {
+                                                    leaf::remove(tmp_path);
+                                                }
+                                            });
+        }
+    }
+    if (file_ec)
+    {
+        co_await error_message(id, file_ec.value(), ec);
+        co_return;
+    }
+    LOG_INFO("{} upload {} batch files {} size {} done", id_, id, batch.req.filenames.size(), batch.size);
+    leaf::done d;
+    d.id = id;
+    co_await write(leaf::serialize_done(d), ec);
+}
+
+boost::system::error_code upload_file_handle::write_batch(const batch_context& batch, leaf::group_commit::files& renames)
+{
+    // 先校验所有文件的摘要, 整批成功或者整批失败
+    const auto* hashes = reinterpret_cast<const uint8_t*>(batch.req.hashes.data());
+    uint64_t offset = 0;
+    for (std::size_t i = 0; i < batch.req.filenames.size(); i++)
+    {
+        leaf::blake2b hash;
+        hash.update(batch.data.data() + offset, static_cast<uint32_t>(batch.req.sizes[i]));
+        hash.final();
+        if (!hash.equal(std::span<const uint8_t>(hashes + i * leaf::blake2b::kDigestSize, leaf::blake2b::kDigestSize)))
+        {
+            LOG_ERROR("{} upload {} batch file {} hash not match", id_, batch.req.id, batch.req.filenames[i]);
+            return boost::system::errc::make_error_code(boost::system::errc::illegal_byte_sequence);
+        }
+        offset += batch.req.sizes[i];
+    }
+    // 所有文件写成临时文件后统一提交改名, 临时文件名唯一, 不影响同名文件正在进行的上传
+    boost::system::error_code ec;
+    offset = 0;
+    for (std::size_t i = 0; i < batch.req.filenames.size() && !ec; i++)
+    {
+        auto file_path = leaf::make_file_path(batch.dir, leaf::encode(batch.req.filenames[i]));
+        if (file_path.empty())
+        {
+            ec = boost::system::errc::make_error_code(boost::system::errc::invalid_argument);
+            break;
+        }
+        auto leaf_path = leaf::encode_leaf_filename(file_path);
+        auto tmp_path = fmt::format("{}.{}{}", leaf_path, leaf::file_id(), kTmpFilenameSuffix);
+        leaf::file_writer writer(tmp_path);
+        ec = writer.open();
+        if (ec)
+        {
+            break;
+        }
+        renames.emplace_back(tmp_path, leaf_path);
+        auto size = batch.req.sizes[i];
+        if (size != 0 && writer.write_at(0, batch.data.data() + offset, size, ec) != size && !ec)
+        {
+            ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+        }
+        auto close_ec = writer.close();
+        if (!ec)
+        {
+            ec = close_ec;
+        }
+        offset += size;
+    }
+    if (ec)
+    {
+        LOG_ERROR("{} upload {} batch dir {} write error {}", id_, batch.req.id, batch.dir, ec.message());
+        for (const auto& [tmp_path, leaf_path] : renames)
+        {
+            leaf::remove(tmp_path);
+        }
+        renames.clear();
+    }
+    return ec;
+}
+
+boost::asio::awaitable<bool> upload_file_handle::instant_upload(const leaf::upload_file_request& req, boost::beast::error_code& ec)
+{
+    auto source = co_await leaf::offload_metadata(token_, [&]() { return link_instant_file(req); });
+    if (!source)
+    {
+        co_return false;
+    }
+    LOG_INFO("{} upload {} file {} instant from {}", id_, req.id, req.filename, *source);
+    leaf::upload_file_response ufr;
+    ufr.id = req.id;
+    ufr.filename = req.filename;
+    ufr.instant = true;
+    co_await write(leaf::serialize_upload_file_response(ufr, options_.codec), ec);
+    if (ec)
+    {
+        co_return true;
+    }
+    leaf::done d;
+    d.id = req.id;
+    co_await write(leaf::serialize_done(d), ec);
+    co_return true;
+}
+
+std::optional<std::string> upload_file_handle::link_instant_file(const leaf::upload_file_request& req)
+{
+    auto source = leaf::digest_index::instance().find(token_, req.hash, req.filesize);
+    if (!source)
+    {
+        return {};
+    }
+    auto local_path = std::filesystem::path(token_).append(req.dir).string();
+    auto file_path = leaf::make_file_path(local_path, leaf::encode(req.filename));
+    if (file_path.empty())
+    {
+        return {};
+    }
+    auto leaf_path = leaf::encode_leaf_filename(file_path);
+    // 先链接到临时文件再改名, 目标已经存在时整体替换
+    if (*source != leaf_path)
+    {
+        std::error_code link_ec;
+        auto link_path = fmt::format("{}.{}{}", leaf_path, leaf::file_id(), kTmpFilenameSuffix);
+        std::filesystem::create_hard_link(*source, link_path, link_ec);
+        if (!link_ec)
+        {
+            std::filesystem::rename(link_path, leaf_path, link_ec);
+            if (link_ec)
+            {
+                std::error_code remove_ec;
+                std::filesystem::remove(link_path, remove_ec);
+            }
+        }
+        // 跨文件系统等情况链接失败, 退回正常上传
+        if (link_ec)
+        {
+            LOG_WARN("{} upload {} instant link {} to {} error {}", id_, req.id, *source, leaf_path, link_ec.message());
+            return {};
+        }
+        // 硬链接与源文件 inode 相同, 源文件的清单同样有效, 失败时下载时再补建
+        auto manifest_link = fmt::format("{}.{}{}", leaf::hash_manifest::path_of(leaf_path), leaf::file_id(), kTmpFilenameSuffix);
+        std::filesystem::create_hard_link(leaf::hash_manifest::path_of(*source), manifest_link, link_ec);
+        if (!link_ec && !leaf::rename(manifest_link, leaf::hash_manifest::path_of(leaf_path)))
+        {
+            leaf::remove(manifest_link);
+        }
+    }
+    leaf::digest_index::instance().put(token_, req.hash, req.filesize, leaf_path);
+    return source;
+}
+
+// 客户端读取文件时文件被修改, 摘要对不上的不登记
+static void put_digest(const std::string& id,
+                       const std::string& user,
+                       const std::string& leaf_path,
+                       uint64_t size,
+                       const std::string& client_hash,
+                       const std::string& digest)
+{
+    if (!client_hash.empty() && client_hash != digest)
+    {
+        LOG_WARN("{} file {} digest not match client {} server {}", id, leaf_path, client_hash, digest);
+        return;
+    }
+    leaf::digest_index::instance().put(user, digest, size, leaf_path);
+}
+
+void upload_file_handle::index_upload(const leaf::file_info& file, const std::shared_ptr<leaf::manifest_builder>& file_hash)
+{
+    if (file.file_size < kInstantSize)
+    {
+        return;
+    }
+    auto leaf_path = leaf::encode_leaf_filename(file.local_path);
+    // 顺序到达的数据已经算好清单和摘要
+    if (file_hash != nullptr)
+    {
+        if (file.file_size >= kManifestMinSize)
+        {
+            auto manifest_ec = file_hash->write(leaf_path);
+            if (manifest_ec)
+            {
+                LOG_WARN("{} write hash manifest {} error {}", id_, leaf_path, manifest_ec.message());
+            }
+        }
+        put_digest(id_, token_, leaf_path, file.file_size, file.hash, file_hash->hex());
+        return;
+    }
+    // 分段/续传/去重的数据不是顺序到达, 在后台低优先级补建清单时得到摘要再登记
+    // 没有清单的小文件只在客户端提供了摘要时才重新读取
+    if (file.file_size < kManifestMinSize && file.hash.empty())
+    {
+        return;
+    }
+    leaf::hash_manifest::schedule(
+        leaf_path,
+        [id = id_, user = token_, leaf_path, size = file.file_size, client_hash = file.hash](const std::string& digest)
+        { put_digest(id, user, leaf_path, size, client_hash, digest); });
+}
+
+boost::asio::awaitable<void> upload_file_handle::error_message(uint32_t id, int32_t error_code, boost::beast::error_code& ec)
+{
+    leaf::error_message e;
+    e.id = id;
+    e.error = error_code;
+    co_await write(leaf::serialize_error_message(e, options_.codec), ec);
+}
+
 boost::asio::awaitable<leaf::keepalive> upload_file_handle::wait_keepalive(boost::beast::error_code& ec)
 {
     leaf::keepalive k;
@@ -334,26 +1252,20 @@ boost::asio::awaitable<leaf::keepalive> upload_file_handle::wait_keepalive(boost
     {
         co_return k;
     }
-    auto message = boost::beast::buffers_to_string(buffer.data());
-    auto type = leaf::get_message_type(message);
-    if (type != leaf::message_type::keepalive)
-    {
-        ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
-        co_return k;
-    }
-    auto keepalive_request = leaf::deserialize_keepalive(std::vector<uint8_t>(message.begin(), message.end()));
-    if (!keepalive_request.has_value())
+    auto message = leaf::decode(leaf::buffers_to_span(buffer.cdata()));
+    const auto* keepalive_request = std::get_if<leaf::keepalive>(&message);
+    if (keepalive_request == nullptr)
     {
         ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
         co_return k;
     }
 
-    k = keepalive_request.value();
+    k = *keepalive_request;
 
     k.server_timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
     LOG_DEBUG(
         "{} keepalive client {} server_timestamp {} client_timestamp {} token {}", id_, k.client_id, k.server_timestamp, k.client_timestamp, token_);
-    co_await write(serialize_keepalive(k), ec);
-    co_return keepalive_request.value();
+    co_await write(serialize_keepalive(k, options_.codec), ec);
+    co_return *keepalive_request;
 }
 }    // namespace leaf
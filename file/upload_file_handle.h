@@ -1,10 +1,21 @@
 #ifndef LEAF_FILE_UPLOAD_FILE_HANDLE_H
 #define LEAF_FILE_UPLOAD_FILE_HANDLE_H
 
+#include <map>
+#include <deque>
 #include <mutex>
+#include <atomic>
+#include <optional>
+#include <functional>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/thread_pool.hpp>
 #include "protocol/message.h"
 #include "crypt/blake2b.h"
+#include "file/hash_manifest.h"
+#include "file/file.h"
+#include "file/chunker.h"
 #include "file/file_context.h"
+#include "file/group_commit.h"
 #include "net/websocket_handle.h"
 
 namespace leaf
@@ -31,13 +42,117 @@ class upload_file_handle : public websocket_handle
     boost::asio::awaitable<void> wait_ack(boost::beast::error_code& ec);
     boost::asio::awaitable<void> wait_file_data(leaf::file_info& file, boost::beast::error_code& ec);
     boost::asio::awaitable<void> send_file_done(boost::beast::error_code& ec);
+    leaf::file_info prepare_upload_file(const leaf::upload_file_request& req, boost::beast::error_code& ec);
+    // 流水线模式, 请求和数据按传输 id 交错到达
+    // 网络读写在连接的线程上, 摘要校验和写盘分别在 cpu_pool/disk_pool 上, 发送统一排队
+    boost::asio::awaitable<void> pipeline_loop(boost::beast::error_code& ec);
+    boost::asio::awaitable<void> receive_loop(boost::beast::error_code& ec);
+    boost::asio::awaitable<void> send_loop(boost::beast::error_code& ec);
+    void send(std::vector<uint8_t> msg);
+    boost::asio::awaitable<void> on_keepalive(const leaf::keepalive& k, boost::beast::error_code& ec);
+    boost::asio::awaitable<void> on_upload_file_request(const leaf::upload_file_request& req, boost::beast::error_code& ec);
+    boost::asio::awaitable<void> on_file_data(const leaf::file_data_view& d, boost::beast::error_code& ec);
+    boost::asio::awaitable<void> on_file_done(const leaf::done& d, boost::beast::error_code& ec);
+    boost::asio::awaitable<void> on_chunk_offer(const leaf::chunk_offer& o, boost::beast::error_code& ec);
+    boost::asio::awaitable<void> on_upload_batch_request(const leaf::upload_batch_request& req, boost::beast::error_code& ec);
+    void preallocate(leaf::file_writer& writer, const leaf::file_info& file);
+    // 秒传, 索引中有相同摘要的文件时直接硬链接, 返回 true 表示已经处理
+    boost::asio::awaitable<bool> instant_upload(const leaf::upload_file_request& req, boost::beast::error_code& ec);
+    // 在元数据线程上查索引并链接, 返回源文件路径
+    std::optional<std::string> link_instant_file(const leaf::upload_file_request& req);
+    // 上传完成后登记整个文件的摘要并写摘要清单, file_hash 为空时重新读取文件计算
+    void index_upload(const leaf::file_info& file, const std::shared_ptr<leaf::manifest_builder>& file_hash);
+    // 单个文件失败只通知客户端, 不断开连接
+    boost::asio::awaitable<void> fail_upload(uint32_t id, boost::beast::error_code file_ec, boost::beast::error_code& ec);
+    boost::asio::awaitable<void> error_message(uint32_t id, int32_t error_code, boost::beast::error_code& ec);
+
+   private:
+    // 一个上传在校验/写盘阶段中的状态
+    struct receive_state
+    {
+        std::atomic<bool> failed = false;    // 失败后阶段中剩余的块直接丢弃
+        uint32_t pending = 0;                // 阶段中的块数, 只在连接的线程上修改
+        bool closing = false;                // 阶段中的块都完成后关闭文件
+        // 等待合并写盘的连续块, 只在 disk_strand_ 上访问
+        std::vector<std::vector<uint8_t>> blocks;
+        int64_t write_offset = 0;
+        uint64_t buffered = 0;
+    };
+    struct upload_context
+    {
+        leaf::file_info file;
+        std::shared_ptr<receive_state> state = std::make_shared<receive_state>();
+        uint64_t queued = 0;    // 已经交给校验/写盘阶段的字节数
+        std::shared_ptr<leaf::blake2b> hash;
+        std::shared_ptr<leaf::manifest_builder> file_hash;    // 数据从文件开头顺序写入时计算整个文件的摘要和清单
+        std::shared_ptr<leaf::file_writer> writer;
+        uint64_t skip = 0;    // 续传时分段内跳过的已校验字节数
+        // 去重上传
+        bool dedup = false;
+        uint64_t chunk_offset = 0;      // 已经登记的分块总长度, 相对分段起点
+        uint64_t chunk_received = 0;    // 实际传输的分块字节数
+        std::deque<leaf::chunk> missing;
+    };
+    // 小文件批量上传, 数据全部到齐后统一校验和写入
+    struct batch_context
+    {
+        leaf::upload_batch_request req;
+        std::string dir;
+        uint64_t size = 0;
+        std::vector<uint8_t> data;
+    };
+
+   private:
+    boost::asio::awaitable<void> on_chunk_data(upload_context& ctx, const leaf::file_data_view& d, boost::beast::error_code& ec);
+    boost::asio::awaitable<void> on_batch_data(batch_context& batch, const leaf::file_data_view& d, boost::beast::error_code& ec);
+    boost::asio::awaitable<void> on_batch_done(batch_context batch, boost::beast::error_code& ec);
+    // 写出临时文件, renames 为需要提交的 临时文件 -> 正式文件
+    boost::system::error_code write_batch(const batch_context& batch, leaf::group_commit::files& renames);
+
+   private:
+    struct stage_job
+    {
+        uint32_t id = 0;
+        std::shared_ptr<receive_state> state;
+        std::shared_ptr<leaf::blake2b> hash;
+        std::shared_ptr<leaf::manifest_builder> file_hash;
+        std::shared_ptr<leaf::file_writer> writer;
+        std::vector<uint8_t> data;
+        std::vector<uint8_t> expect;    // 摘要块结束时客户端发送的摘要
+        int64_t offset = 0;             // 文件内的写入偏移
+        uint64_t received = 0;          // 写入后分段内的累计字节数
+        bool flush = false;             // 摘要块或分段结束, 合并的块必须落盘后才能确认
+        bool verified = false;
+        boost::system::error_code ec;
+    };
+
+   private:
+    void submit(const std::shared_ptr<stage_job>& job);
+    void verify_stage(stage_job& job);
+    void write_stage(stage_job& job);
+    void flush_stage(stage_job& job);
+    void on_stage_done(const stage_job& job);
+    // 阶段中还有块时延迟到全部完成再关闭文件
+    static void close_upload(upload_context& ctx);
+    boost::asio::awaitable<void> wait_stages(const std::function<bool()>& ready);
 
    private:
     std::string id_;
     std::string user_;
     std::string token_;
+    leaf::transfer_options options_;
     std::vector<uint8_t> key_;
     std::once_flag shutdown_flag_;
+    boost::beast::flat_buffer recv_buffer_;
+    std::map<uint32_t, upload_context> uploads_;
+    std::map<uint32_t, batch_context> batches_;
+    bool pipeline_stop_ = false;
+    uint32_t stage_pending_ = 0;
+    std::deque<std::vector<uint8_t>> outbox_;
+    std::shared_ptr<boost::asio::steady_timer> send_timer_;
+    std::shared_ptr<boost::asio::steady_timer> stage_timer_;
+    boost::asio::strand<boost::asio::thread_pool::executor_type> cpu_strand_;
+    boost::asio::strand<boost::asio::thread_pool::executor_type> disk_strand_;
     leaf::websocket_session::ptr session_;
     const boost::asio::any_io_executor& io_;
 };
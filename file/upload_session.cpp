@@ -1,13 +1,19 @@
 #include <utility>
+#include <filesystem>
 #include "log/log.h"
 #include "file/file.h"
 #include "file/event.h"
+#include "net/buffer.h"
 #include "net/exception.h"
 #include "config/config.h"
 #include "crypt/blake2b.h"
 #include "protocol/codec.h"
 #include "protocol/message.h"
 #include "net/scoped_exit.hpp"
+#include "file/chunker.h"
+#include "file/hash_file.h"
+#include "file/read_ahead.h"
+#include "file/thread_pools.h"
 #include "file/event_manager.h"
 #include "file/upload_session.h"
 
@@ -25,6 +31,7 @@ void upload_session::startup()
 {
     LOG_INFO("{} startup", id_);
     timer_ = std::make_shared<boost::asio::steady_timer>(io_);
+    window_timer_ = std::make_shared<boost::asio::steady_timer>(io_);
     auto msg = fmt::format("loop exception {}", token_);
     boost::asio::co_spawn(
         io_,
@@ -35,9 +42,11 @@ void upload_session::startup()
 boost::asio::awaitable<void> upload_session::login(boost::beast::error_code& ec)
 {
     LOG_INFO("{} connect ws client will login use token {}", id_, token_);
+    options_ = leaf::transfer_options{};
     leaf::login_token lt;
     lt.id = 0x01;
     lt.token = token_;
+    leaf::set_transfer_options(lt, leaf::preferred_transfer_options());
     co_await write(leaf::serialize_login_token(lt), ec);
     if (ec)
     {
@@ -67,6 +76,7 @@ boost::asio::awaitable<void> upload_session::login(boost::beast::error_code& ec)
         ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
         co_return;
     }
+    options_ = leaf::negotiate_transfer_options(login.value());
 }
 boost::asio::awaitable<void> upload_session::loop()
 {
@@ -103,7 +113,13 @@ boost::asio::awaitable<void> upload_session::loop1(boost::beast::error_code& ec)
         LOG_ERROR("{} login error {}", id_, ec.message());
         co_return;
     }
-    LOG_INFO("{} login success token {}", id_, token_);
+    LOG_INFO("{} login success token {} block size {} window {}", id_, token_, options_.block_size, options_.window);
+    if (options_.version >= kPipelineProtocolVersion)
+    {
+        co_await pipeline(ec);
+        LOG_INFO("{} pipeline quit {}", id_, ec.message());
+        co_return;
+    }
     while (true)
     {
         co_await send_keepalive(ec);
@@ -119,7 +135,7 @@ boost::asio::awaitable<void> upload_session::loop1(boost::beast::error_code& ec)
         auto file = padding_files_.front();
         // send upload file request
         LOG_INFO("{} send upload request file {} name {} dir {}", id_, file.local_path, file.filename, file.dir);
-        co_await send_upload_file_request(file, ec);
+        co_await send_upload_file_request(file, seq_++, ec);
         if (ec)
         {
             LOG_ERROR("{} send upload file request error {} {}", id_, ec.message(), file.local_path);
@@ -143,7 +159,7 @@ boost::asio::awaitable<void> upload_session::loop1(boost::beast::error_code& ec)
         }
         // send file data
         LOG_INFO("{} send file data {}", id_, file.local_path);
-        co_await send_file_data(file, ec);
+        co_await send_file_data(file, 0, 0, ec);
         if (ec)
         {
             LOG_ERROR("{} send file data error {} {}", id_, ec.message(), file.local_path);
@@ -168,6 +184,13 @@ boost::asio::awaitable<void> upload_session::write(const std::vector<uint8_t>& d
     co_await ws_client_->write(ec, data.data(), data.size());
 }
 
+boost::asio::awaitable<void> upload_session::write(const leaf::file_data_view& fd, boost::system::error_code& ec)
+{
+    auto header = leaf::serialize_file_data_header(fd);
+    std::vector<boost::asio::const_buffer> buffers{boost::asio::buffer(header), boost::asio::buffer(fd.data.data(), fd.data.size())};
+    co_await ws_client_->write(ec, buffers);
+}
+
 boost::asio::awaitable<void> upload_session::delay(int second)
 {
     boost::beast::error_code ec;
@@ -182,6 +205,10 @@ boost::asio::awaitable<void> upload_session::shutdown_coro()
         timer_->cancel();
         timer_ = nullptr;
     }
+    if (window_timer_ != nullptr)
+    {
+        window_timer_->cancel();
+    }
     if (ws_client_)
     {
         ws_client_->close();
@@ -213,6 +240,79 @@ void upload_session::safe_add_files(const std::vector<file_info>& files)
     timer_->cancel();
 }
 
+void upload_session::set_range_sessions(std::vector<std::weak_ptr<upload_session>> sessions) { range_sessions_ = std::move(sessions); }
+
+// 同一个本地文件的 range_id 不变, 客户端重启后服务端仍然可以续传
+static uint64_t range_id_of(const file_info& file)
+{
+    std::error_code ec;
+    auto mtime = std::filesystem::last_write_time(file.local_path, ec).time_since_epoch().count();
+    return std::hash<std::string>{}(fmt::format("{}:{}:{}:{}", file.local_path, file.dir, file.file_size, mtime));
+}
+
+// 足够大的分段先等待服务端的断点, 小文件保持流水线不等待
+// 去重模式下已经收到的分块会被跳过, 不需要断点
+bool upload_session::resumable(const file_info& file) const { return !dedup() && file.length >= kResumeSize; }
+
+// 带有整个文件摘要的请求可能被服务端秒传, 也要等待响应
+bool upload_session::needs_response(const file_info& file) const { return resumable(file) || !file.hash.empty(); }
+
+bool upload_session::dedup() const
+{
+    return options_.version >= kDedupProtocolVersion && options_.codec == leaf::codec_type::binary && options_.block_size >= kChunkMaxSize;
+}
+
+bool upload_session::batchable(const file_info& file) const
+{
+    return options_.version >= kBatchProtocolVersion && file.length == 0 && file.file_size <= kBatchFileSize;
+}
+
+// 从队列中取出同一目录下连续的小文件, 与 file 组成一批
+std::vector<file_info> upload_session::take_batch(const file_info& file)
+{
+    std::vector<file_info> files{file};
+    if (!batchable(file))
+    {
+        return files;
+    }
+    uint64_t size = file.file_size;
+    while (!padding_files_.empty() && files.size() < kBatchFiles)
+    {
+        const auto& next = padding_files_.front();
+        if (!batchable(next) || next.dir != file.dir || size + next.file_size > kBatchSize)
+        {
+            break;
+        }
+        size += next.file_size;
+        files.push_back(next);
+        padding_files_.pop_front();
+    }
+    return files;
+}
+
+void upload_session::split_ranges(const file_info& file)
+{
+    auto range_id = range_id_of(file);
+    std::size_t index = 0;
+    for (uint64_t offset = 0; offset < file.file_size; offset += kRangeSize, index++)
+    {
+        auto range = file;
+        range.offset = offset;
+        range.length = std::min<uint64_t>(kRangeSize, file.file_size - offset);
+        range.range_id = range_id;
+        auto session = range_sessions_[index % range_sessions_.size()].lock();
+        if (session != nullptr)
+        {
+            session->add_file(range);
+        }
+        else
+        {
+            padding_files_.push_back(range);
+        }
+    }
+    LOG_INFO("{} split file {} size {} into {} ranges id {}", id_, file.local_path, file.file_size, index, range_id);
+}
+
 void upload_session::add_file(const file_info& file)
 {
     boost::asio::post(io_, [this, file, self = shared_from_this()]() { safe_add_file(file); });
@@ -223,15 +323,28 @@ void upload_session::add_files(const std::vector<file_info>& files)
     boost::asio::post(io_, [this, files, self = shared_from_this()]() { safe_add_files(files); });
 }
 
-boost::asio::awaitable<void> upload_session::send_upload_file_request(const file_info& file, boost::beast::error_code& ec)
+boost::asio::awaitable<void> upload_session::send_upload_file_request(const file_info& file, uint32_t id, boost::beast::error_code& ec)
 {
     leaf::upload_file_request u;
-    u.id = seq_++;
+    u.id = id;
     u.dir = file.dir;
     u.filename = file.filename;
     u.filesize = file.file_size;
-    LOG_DEBUG("{} upload request {} dir {} filename {} filesize {}", id_, u.id, file.dir, file.local_path, file.file_size);
-    co_await write(leaf::serialize_upload_file_request(u), ec);
+    u.offset = file.offset;
+    u.length = file.length;
+    u.range_id = file.range_id;
+    u.resume = resumable(file);
+    u.dedup = dedup();
+    u.hash = file.hash;
+    LOG_DEBUG("{} upload request {} dir {} filename {} filesize {} range {}:{}",
+              id_,
+              u.id,
+              file.dir,
+              file.local_path,
+              file.file_size,
+              file.offset,
+              file.length);
+    co_await write(leaf::serialize_upload_file_request(u, options_.codec), ec);
 }
 
 boost::asio::awaitable<void> upload_session::send_ack(boost::beast::error_code& ec)
@@ -264,70 +377,53 @@ boost::asio::awaitable<void> upload_session::wait_upload_file_response(boost::be
     }
     LOG_DEBUG("{} upload file response {} filename {}", id_, response->id, response->filename);
 }
-boost::asio::awaitable<void> upload_session::send_file_data(const file_info& file, boost::beast::error_code& ec)
+boost::asio::awaitable<void> upload_session::send_file_data(const file_info& file, uint32_t id, uint64_t skip, boost::beast::error_code& ec)
 {
-    auto reader = std::make_shared<leaf::file_reader>(file.local_path);
-    if (reader == nullptr)
-    {
-        ec = boost::system::errc::make_error_code(boost::system::errc::not_enough_memory);
-        co_return;
-    }
-    ec = reader->open();
-    if (ec)
+    // 分段只读取自己的范围, 摘要从分段起点或断点重新计算
+    uint64_t range_size = file.length != 0 ? file.length : file.file_size;
+    // 旧版本对端仍发送 hex 摘要
+    auto reader = std::make_shared<leaf::read_ahead>(io_.get_executor(),
+                                                     file.local_path,
+                                                     file.offset,
+                                                     range_size,
+                                                     skip,
+                                                     options_.block_size,
+                                                     options_.hash_block_size,
+                                                     options_.digest == leaf::digest_type::raw);
+    reader->start();
+    auto _ = leaf::make_scoped_exit([&reader]() { reader->stop(); });
+
+    // 流水线模式下受发送窗口限制
+    bool windowed = options_.version >= kPipelineProtocolVersion;
+    if (windowed)
     {
-        co_return;
+        window_.on_start(id, skip);
     }
-
-    auto _ = leaf::make_scoped_exit([&reader]() { auto _ = reader->close(); });
-
-    auto hash = std::make_shared<leaf::blake2b>();
-
-    uint8_t buffer[kBlockSize] = {0};
-    int64_t read_offset = 0;
     auto start_time = std::chrono::steady_clock::now();
     while (true)
     {
-        assert(reader->size() <= file.file_size);
-        LOG_DEBUG("{} read file {} size {} offset {} block size {}", id_, file.local_path, reader->size(), read_offset, kBlockSize);
-        auto read_size = reader->read_at(read_offset, buffer, kBlockSize, ec);
-        if (ec && ec != boost::asio::error::eof)
-        {
-            LOG_ERROR("{} read file {} size {} offset {} block size {} error {}",
-                      id_,
-                      file.local_path,
-                      reader->size(),
-                      read_offset,
-                      kBlockSize,
-                      ec.message());
-            break;
-        }
-        read_offset += static_cast<int64_t>(read_size);
-        leaf::file_data fd;
-        fd.data.insert(fd.data.end(), buffer, buffer + read_size);
-        if (read_size != 0)
-        {
-            hash->update(buffer, read_size);
-        }
-        // block count hash or eof hash
-        auto reader_size = reader->size();
-        if ((reader_size != 0 && read_size % kHashBlockSize == 0) || read_size == file.file_size || ec == boost::asio::error::eof)
+        auto b = co_await reader->next(ec);
+        if (ec)
         {
-            hash->final();
-            fd.hash = hash->hex();
-            hash->reset();
+            LOG_ERROR("{} read file {} range {}:{} error {}", id_, file.local_path, file.offset, range_size, ec.message());
+            break;
         }
-        LOG_DEBUG("{} read file {} size {} offset {} read size {} block size {} hash {}",
+        auto read_size = b.data.size();
+        leaf::file_data_view fd;
+        fd.id = id;
+        fd.data = std::span<const uint8_t>(b.data.data(), read_size);
+        fd.hash = std::span<const uint8_t>(reinterpret_cast<const uint8_t *>(b.hash.data()), b.hash.size());
+        LOG_DEBUG("{} read file {} offset {} read size {} block size {} hash size {}",
                   id_,
                   file.local_path,
-                  reader->size(),
-                  read_offset,
-                  reader_size,
-                  kBlockSize,
-                  fd.hash.empty() ? "empty" : fd.hash);
+                  file.offset + b.position,
+                  read_size,
+                  options_.block_size,
+                  fd.hash.size());
 
         file_event u;
-        u.process_size = reader->size();
-        u.offset = read_offset;
+        u.process_size = file.offset + b.position;
+        u.offset = file.offset + b.position;
         u.file_size = file.file_size;
         u.filename = file.local_path;
         u.remaining_time_mil = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_time).count();
@@ -335,17 +431,29 @@ boost::asio::awaitable<void> upload_session::send_file_data(const file_info& fil
 
         if (!fd.data.empty())
         {
-            co_await write(leaf::serialize_file_data(fd), ec);
+            if (windowed)
+            {
+                co_await wait_window(fd.data.size(), ec);
+                if (ec)
+                {
+                    break;
+                }
+            }
+            co_await write(fd, ec);
             if (ec)
             {
                 break;
             }
+            if (windowed)
+            {
+                window_.on_send(id, b.position - read_size, read_size);
+            }
         }
-        if (ec == boost::asio::error::eof || reader->size() == file.file_size)
+        reader->recycle(std::move(b.data));
+        if (b.last)
         {
-            ec = {};
             LOG_DEBUG("{} send file done", file.local_path);
-            co_await send_file_done(ec);
+            co_await send_file_done(id, ec);
             break;
         }
     }
@@ -355,6 +463,190 @@ boost::asio::awaitable<void> upload_session::send_file_data(const file_info& fil
     }
 }
 
+boost::asio::awaitable<void> upload_session::send_file_chunks(const file_info& file, uint32_t id, boost::beast::error_code& ec)
+{
+    auto reader = std::make_shared<leaf::file_reader>(file.local_path);
+    ec = reader->open();
+    if (ec)
+    {
+        co_return;
+    }
+    auto _ = leaf::make_scoped_exit([&reader]() { auto _ = reader->close(); });
+
+    uint64_t range_size = file.length != 0 ? file.length : file.file_size;
+    leaf::chunker chunker(*reader, file.offset, range_size);
+    std::vector<uint8_t> buffer(kChunkMaxSize, 0);
+    uint64_t offered = 0;
+    uint64_t sent = 0;
+    auto start_time = std::chrono::steady_clock::now();
+    while (true)
+    {
+        auto chunks = chunker.next(kChunkBatch, ec);
+        if (ec || chunks.empty())
+        {
+            break;
+        }
+        // 先发送摘要, 只传输服务端缺少的分块
+        leaf::chunk_offer offer;
+        offer.id = id;
+        for (const auto& c : chunks)
+        {
+            offer.sizes.push_back(c.size);
+            offer.hashes.append(reinterpret_cast<const char*>(c.digest.data()), c.digest.size());
+        }
+        co_await write(leaf::serialize_chunk_offer(offer, options_.codec), ec);
+        if (ec)
+        {
+            co_return;
+        }
+        if (!co_await wait_response(id, [&]() { return chunk_needs_.contains(id); }, ec))
+        {
+            co_return;
+        }
+        auto need = std::move(chunk_needs_[id]);
+        chunk_needs_.erase(id);
+        for (auto index : need)
+        {
+            if (index >= chunks.size())
+            {
+                ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
+                co_return;
+            }
+            const auto& c = chunks[index];
+            auto read_size = reader->read_at(static_cast<int64_t>(file.offset + c.offset), buffer.data(), c.size, ec);
+            if (ec || read_size != c.size)
+            {
+                LOG_ERROR("{} read file {} chunk {} size {} error {}", id_, file.local_path, c.offset, c.size, ec.message());
+                ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+                co_return;
+            }
+            leaf::file_data_view fd;
+            fd.id = id;
+            fd.hash = c.digest;
+            fd.data = std::span<const uint8_t>(buffer.data(), c.size);
+            co_await wait_window(c.size, ec);
+            if (ec)
+            {
+                co_return;
+            }
+            co_await write(fd, ec);
+            if (ec)
+            {
+                co_return;
+            }
+            window_.on_send(id, sent, c.size);
+            sent += c.size;
+        }
+        offered = chunks.back().offset + chunks.back().size;
+        LOG_DEBUG("{} dedup file {} offered {} chunks {} sent {} total sent {}", id_, file.local_path, offered, chunks.size(), need.size(), sent);
+
+        file_event u;
+        u.process_size = file.offset + offered;
+        u.offset = file.offset + offered;
+        u.file_size = file.file_size;
+        u.filename = file.local_path;
+        u.remaining_time_mil = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_time).count();
+        leaf::event_manager::instance().post("upload", u);
+    }
+    if (ec)
+    {
+        LOG_ERROR("{} chunk file {} error {}", id_, file.local_path, ec.message());
+        co_return;
+    }
+    LOG_INFO("{} dedup file {} size {} sent {}", id_, file.local_path, offered, sent);
+    co_await send_file_done(id, ec);
+}
+
+// 读取整个小文件, 文件变短时返回错误
+static std::vector<uint8_t> read_small_file(const file_info& file, boost::beast::error_code& ec)
+{
+    std::vector<uint8_t> data(file.file_size);
+    leaf::file_reader reader(file.local_path);
+    ec = reader.open();
+    if (ec)
+    {
+        return {};
+    }
+    std::size_t read_size = 0;
+    while (read_size < data.size())
+    {
+        auto n = reader.read_at(static_cast<int64_t>(read_size), data.data() + read_size, data.size() - read_size, ec);
+        if (ec)
+        {
+            break;
+        }
+        read_size += n;
+    }
+    auto _ = reader.close();
+    if (ec == boost::asio::error::eof)
+    {
+        ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+    }
+    return data;
+}
+
+boost::asio::awaitable<void> upload_session::send_batch(const std::vector<file_info>& files, boost::beast::error_code& ec)
+{
+    auto id = seq_++;
+    leaf::upload_batch_request req;
+    req.id = id;
+    req.dir = files.front().dir;
+    std::vector<uint8_t> data;
+    std::vector<file_info> batch;
+    // 读取失败的文件跳过, 与服务端拒绝的文件一样不再重试
+    for (const auto& file : files)
+    {
+        boost::beast::error_code read_ec;
+        auto bytes = read_small_file(file, read_ec);
+        if (read_ec)
+        {
+            LOG_ERROR("{} batch upload {} read file {} error {}", id_, id, file.local_path, read_ec.message());
+            continue;
+        }
+        leaf::blake2b hash;
+        hash.update(bytes.data(), static_cast<uint32_t>(bytes.size()));
+        hash.final();
+        auto digest = hash.raw();
+        req.filenames.push_back(file.filename);
+        req.sizes.push_back(bytes.size());
+        req.hashes.append(reinterpret_cast<const char*>(digest.data()), digest.size());
+        data.insert(data.end(), bytes.begin(), bytes.end());
+        batch.push_back(file);
+    }
+    if (batch.empty())
+    {
+        co_return;
+    }
+    inflight_.emplace(id, batch.front());
+    batches_.emplace(id, batch);
+    LOG_INFO("{} pipeline upload {} batch files {} size {} dir {}", id_, id, batch.size(), data.size(), req.dir);
+    co_await write(leaf::serialize_upload_batch_request(req, options_.codec), ec);
+    if (ec)
+    {
+        LOG_ERROR("{} pipeline upload {} batch request error {}", id_, id, ec.message());
+        co_return;
+    }
+    for (std::size_t offset = 0; offset < data.size(); offset += options_.block_size)
+    {
+        auto size = std::min<std::size_t>(options_.block_size, data.size() - offset);
+        co_await wait_window(size, ec);
+        if (ec)
+        {
+            co_return;
+        }
+        leaf::file_data_view fd;
+        fd.id = id;
+        fd.data = std::span<const uint8_t>(data.data() + offset, size);
+        co_await write(fd, ec);
+        if (ec)
+        {
+            co_return;
+        }
+        window_.on_send(id, offset, size);
+    }
+    co_await send_file_done(id, ec);
+}
+
 boost::asio::awaitable<void> upload_session::wait_file_done(boost::beast::error_code& ec)
 {
     boost::beast::flat_buffer buffer;
@@ -375,12 +667,321 @@ boost::asio::awaitable<void> upload_session::wait_file_done(boost::beast::error_
     u.file_size = 0;
     leaf::event_manager::instance().post("upload", u);
 }
-boost::asio::awaitable<void> upload_session::send_file_done(boost::beast::error_code& ec)
+boost::asio::awaitable<void> upload_session::send_file_done(uint32_t id, boost::beast::error_code& ec)
 {
     leaf::done d;
+    d.id = id;
     co_await write(leaf::serialize_done(d), ec);
 }
 
+boost::asio::awaitable<void> upload_session::pipeline(boost::beast::error_code& ec)
+{
+    using boost::asio::experimental::awaitable_operators::operator||;
+
+    boost::beast::error_code send_ec;
+    boost::beast::error_code recv_ec;
+    // 摘要块校验后才有 ack, 窗口至少容纳两个摘要块
+    window_.reset(2ULL * options_.hash_block_size, static_cast<uint64_t>(options_.window) * options_.hash_block_size);
+    pipeline_stop_ = false;
+    co_await (pipeline_send(send_ec) || pipeline_recv(recv_ec));
+    ec = send_ec ? send_ec : recv_ec;
+    // 没有收到完成的文件放回队列头部, 重连后重新上传
+    for (auto it = inflight_.rbegin(); it != inflight_.rend(); ++it)
+    {
+        auto batch = batches_.find(it->first);
+        if (batch == batches_.end())
+        {
+            padding_files_.push_front(it->second);
+            continue;
+        }
+        padding_files_.insert(padding_files_.begin(), batch->second.begin(), batch->second.end());
+    }
+    inflight_.clear();
+    batches_.clear();
+    responses_.clear();
+    chunk_needs_.clear();
+}
+
+boost::asio::awaitable<void> upload_session::pipeline_send(boost::beast::error_code& ec)
+{
+    while (!shutdown_ && !pipeline_stop_)
+    {
+        if (padding_files_.empty() || inflight_.size() >= kMaxPipelineFiles)
+        {
+            co_await delay(3);
+            if (!shutdown_ && !pipeline_stop_ && padding_files_.empty() && inflight_.empty())
+            {
+                co_await write_keepalive(ec);
+                if (ec)
+                {
+                    break;
+                }
+            }
+            continue;
+        }
+        auto file = padding_files_.front();
+        padding_files_.pop_front();
+        auto batch = take_batch(file);
+        if (batch.size() > 1)
+        {
+            co_await send_batch(batch, ec);
+            if (ec)
+            {
+                break;
+            }
+            continue;
+        }
+        // 秒传, 切分分段之前计算一次整个文件的摘要, 所有分段都携带
+        // 在磁盘线程上读文件计算, 等待期间 pipeline_recv 继续处理 ack 和响应
+        if (file.length == 0 && file.hash.empty() && file.file_size >= kInstantSize && file.file_size <= kInstantMaxSize)
+        {
+            boost::system::error_code hash_ec;
+            file.hash = co_await boost::asio::co_spawn(
+                leaf::disk_pool(),
+                [&file, &hash_ec]() -> boost::asio::awaitable<std::string> { co_return leaf::hash_file(file.local_path, hash_ec); },
+                boost::asio::use_awaitable);
+            if (hash_ec)
+            {
+                LOG_WARN("{} hash file {} error {}", id_, file.local_path, hash_ec.message());
+                file.hash.clear();
+            }
+        }
+        if (file.length == 0 && options_.version >= kRangeProtocolVersion)
+        {
+            if (file.file_size > kRangeSize && !range_sessions_.empty())
+            {
+                split_ranges(file);
+                continue;
+            }
+            // 不需要切分的大文件作为一个分段上传, 断线后可以续传
+            if (file.file_size >= kResumeSize)
+            {
+                file.length = file.file_size;
+                file.range_id = range_id_of(file);
+            }
+        }
+        auto id = seq_++;
+        inflight_.emplace(id, file);
+        // 不等待服务端响应, 请求/数据/完成连续发送
+        LOG_INFO("{} pipeline upload {} file {} name {} dir {}", id_, id, file.local_path, file.filename, file.dir);
+        co_await send_upload_file_request(file, id, ec);
+        if (ec)
+        {
+            LOG_ERROR("{} pipeline upload {} request error {} {}", id_, id, ec.message(), file.local_path);
+            break;
+        }
+        uint64_t skip = 0;
+        if (needs_response(file))
+        {
+            if (!co_await wait_response(id, [&]() { return responses_.contains(id); }, ec))
+            {
+                if (ec)
+                {
+                    break;
+                }
+                continue;
+            }
+            auto response = responses_[id];
+            responses_.erase(id);
+            // 秒传成功, 等待服务端的 done
+            if (response.instant)
+            {
+                LOG_INFO("{} pipeline upload {} file {} instant", id_, id, file.local_path);
+                continue;
+            }
+            if (resumable(file))
+            {
+                skip = response.offset;
+                LOG_INFO("{} pipeline upload {} file {} range {}:{} resume {}", id_, id, file.local_path, file.offset, file.length, skip);
+            }
+        }
+        if (dedup())
+        {
+            co_await send_file_chunks(file, id, ec);
+            if (ec)
+            {
+                LOG_ERROR("{} pipeline upload {} chunk error {} {}", id_, id, ec.message(), file.local_path);
+                break;
+            }
+            continue;
+        }
+        co_await send_file_data(file, id, skip, ec);
+        if (ec)
+        {
+            LOG_ERROR("{} pipeline upload {} data error {} {}", id_, id, ec.message(), file.local_path);
+            break;
+        }
+    }
+    pipeline_stop_ = true;
+    ws_client_->close();
+}
+
+boost::asio::awaitable<void> upload_session::wait_window(uint64_t bytes, boost::beast::error_code& ec)
+{
+    while (!window_.has_room(bytes))
+    {
+        if (shutdown_ || pipeline_stop_)
+        {
+            ec = boost::asio::error::operation_aborted;
+            co_return;
+        }
+        // 收到 ack 时取消定时器唤醒, 超时说明对端不再确认
+        boost::beast::error_code wait_ec;
+        window_timer_->expires_after(std::chrono::seconds(30));
+        co_await window_timer_->async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, wait_ec));
+        if (!wait_ec)
+        {
+            LOG_ERROR("{} wait window timeout inflight {} window {}", id_, window_.inflight(), window_.window());
+            ec = boost::asio::error::timed_out;
+            co_return;
+        }
+    }
+}
+
+boost::asio::awaitable<bool> upload_session::wait_response(uint32_t id, const std::function<bool()>& ready, boost::beast::error_code& ec)
+{
+    while (true)
+    {
+        if (ready())
+        {
+            co_return true;
+        }
+        if (!inflight_.contains(id))
+        {
+            co_return false;
+        }
+        if (shutdown_ || pipeline_stop_)
+        {
+            ec = boost::asio::error::operation_aborted;
+            co_return false;
+        }
+        // 收到响应时取消定时器唤醒
+        boost::beast::error_code wait_ec;
+        window_timer_->expires_after(std::chrono::seconds(30));
+        co_await window_timer_->async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, wait_ec));
+        if (!wait_ec)
+        {
+            LOG_ERROR("{} pipeline upload {} wait response timeout", id_, id);
+            ec = boost::asio::error::timed_out;
+            co_return false;
+        }
+    }
+}
+
+boost::asio::awaitable<void> upload_session::pipeline_recv(boost::beast::error_code& ec)
+{
+    while (true)
+    {
+        boost::beast::flat_buffer buffer;
+        co_await ws_client_->read(ec, buffer);
+        if (ec)
+        {
+            break;
+        }
+        auto message = leaf::decode(leaf::buffers_to_span(buffer.cdata()));
+        std::visit(leaf::overloaded{[&](const leaf::ack& a) { on_ack(a); },
+                                    [&](const leaf::done& d) { on_file_done(d); },
+                                    [&](const leaf::error_message& e) { on_error_message(e); },
+                                    [&](const leaf::upload_file_response& r) { on_upload_file_response(r); },
+                                    [&](const leaf::chunk_need& n) { on_chunk_need(n); },
+                                    [&](const leaf::keepalive&) {},
+                                    [&](const auto&) { ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error); }},
+                   message);
+        if (ec)
+        {
+            LOG_ERROR("{} pipeline recv message {} error {}", id_, message.index(), ec.message());
+            break;
+        }
+    }
+    pipeline_stop_ = true;
+    window_timer_->cancel();
+    ws_client_->close();
+}
+
+void upload_session::on_ack(const leaf::ack& a)
+{
+    window_.on_ack(a.id, a.offset);
+    LOG_TRACE("{} pipeline upload {} ack {} inflight {} window {} srtt {}us",
+              id_,
+              a.id,
+              a.offset,
+              window_.inflight(),
+              window_.window(),
+              window_.srtt().count());
+    window_timer_->cancel();
+}
+
+void upload_session::on_upload_file_response(const leaf::upload_file_response& r)
+{
+    LOG_DEBUG("{} upload file response {} filename {} offset {}", id_, r.id, r.filename, r.offset);
+    auto it = inflight_.find(r.id);
+    if (it == inflight_.end() || !needs_response(it->second))
+    {
+        return;
+    }
+    auto& response = responses_[r.id];
+    response = r;
+    response.offset = std::min<uint64_t>(r.offset, it->second.length);
+    window_timer_->cancel();
+}
+
+void upload_session::on_chunk_need(const leaf::chunk_need& n)
+{
+    if (!inflight_.contains(n.id))
+    {
+        return;
+    }
+    chunk_needs_[n.id] = n.indexes;
+    window_timer_->cancel();
+}
+
+void upload_session::on_file_done(const leaf::done& d)
+{
+    auto it = inflight_.find(d.id);
+    if (it == inflight_.end())
+    {
+        LOG_WARN("{} pipeline upload {} unknown done", id_, d.id);
+        return;
+    }
+    LOG_INFO("{} pipeline upload {} done {}", id_, d.id, it->second.local_path);
+    inflight_.erase(it);
+    batches_.erase(d.id);
+    window_.on_done(d.id);
+    window_timer_->cancel();
+    file_event u;
+    u.process_size = 0;
+    u.file_size = 0;
+    leaf::event_manager::instance().post("upload", u);
+    if (timer_ != nullptr)
+    {
+        timer_->cancel();
+    }
+}
+
+void upload_session::on_error_message(const leaf::error_message& e)
+{
+    auto it = inflight_.find(e.id);
+    if (it == inflight_.end())
+    {
+        LOG_ERROR("{} pipeline upload {} error {}", id_, e.id, e.error);
+        return;
+    }
+    // 服务端拒绝的文件不再重试
+    LOG_ERROR("{} pipeline upload {} file {} error {}", id_, e.id, it->second.local_path, e.error);
+    inflight_.erase(it);
+    batches_.erase(e.id);
+    window_.on_done(e.id);
+    window_timer_->cancel();
+    file_event u;
+    u.process_size = 0;
+    u.file_size = 0;
+    leaf::event_manager::instance().post("upload", u);
+    if (timer_ != nullptr)
+    {
+        timer_->cancel();
+    }
+}
+
 void upload_session::padding_file_event()
 {
     for (const auto& file : padding_files_)
@@ -395,19 +996,7 @@ void upload_session::padding_file_event()
 }
 boost::asio::awaitable<void> upload_session::send_keepalive(boost::beast::error_code& ec)
 {
-    leaf::keepalive k;
-    k.id = 0;
-    k.client_id = reinterpret_cast<uintptr_t>(this);
-    k.client_timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-    k.server_timestamp = padding_files_.size();
-    LOG_TRACE("{} keepalive request client {} server_timestamp {} client_timestamp {} token {}",
-              id_,
-              k.client_id,
-              k.server_timestamp,
-              k.client_timestamp,
-              token_);
-
-    co_await write(leaf::serialize_keepalive(k), ec);
+    co_await write_keepalive(ec);
     boost::beast::flat_buffer buffer;
     co_await ws_client_->read(ec, buffer);
     if (ec)
@@ -435,4 +1024,21 @@ boost::asio::awaitable<void> upload_session::send_keepalive(boost::beast::error_
               token_);
 }
 
+boost::asio::awaitable<void> upload_session::write_keepalive(boost::beast::error_code& ec)
+{
+    leaf::keepalive k;
+    k.id = 0;
+    k.client_id = reinterpret_cast<uintptr_t>(this);
+    k.client_timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    k.server_timestamp = padding_files_.size();
+    LOG_TRACE("{} keepalive request client {} server_timestamp {} client_timestamp {} token {}",
+              id_,
+              k.client_id,
+              k.server_timestamp,
+              k.client_timestamp,
+              token_);
+
+    co_await write(leaf::serialize_keepalive(k, options_.codec), ec);
+}
+
 }    // namespace leaf
@@ -1,7 +1,12 @@
 #ifndef LEAF_FILE_UPLOAD_SESSION_H
 #define LEAF_FILE_UPLOAD_SESSION_H
 
+#include <map>
 #include <deque>
+#include <functional>
+#include <boost/asio/experimental/awaitable_operators.hpp>
+#include "protocol/message.h"
+#include "file/send_window.h"
 #include "file/file_context.h"
 #include "net/plain_websocket_client.h"
 
@@ -19,24 +24,50 @@ class upload_session : public std::enable_shared_from_this<upload_session>
     void shutdown();
     void add_file(const file_info &file);
     void add_files(const std::vector<file_info> &files);
+    // 大文件切分后的分段轮流交给这些会话, 每个会话是一条独立的连接
+    void set_range_sessions(std::vector<std::weak_ptr<upload_session>> sessions);
 
    private:
     boost::asio::awaitable<void> loop();
     boost::asio::awaitable<void> loop1(boost::beast::error_code &ec);
     boost::asio::awaitable<void> write(const std::vector<uint8_t> &data, boost::system::error_code &ec);
+    boost::asio::awaitable<void> write(const leaf::file_data_view &fd, boost::system::error_code &ec);
     boost::asio::awaitable<void> shutdown_coro();
     boost::asio::awaitable<void> delay(int second);
-    boost::asio::awaitable<void> send_upload_file_request(const file_info &file, boost::beast::error_code &ec);
+    boost::asio::awaitable<void> send_upload_file_request(const file_info &file, uint32_t id, boost::beast::error_code &ec);
     boost::asio::awaitable<void> wait_upload_file_response(boost::beast::error_code &ec);
     boost::asio::awaitable<void> send_ack(boost::beast::error_code &ec);
-    boost::asio::awaitable<void> send_file_data(const file_info &file, boost::beast::error_code &ec);
-    boost::asio::awaitable<void> send_file_done(boost::beast::error_code &ec);
+    boost::asio::awaitable<void> send_file_data(const file_info &file, uint32_t id, uint64_t skip, boost::beast::error_code &ec);
+    boost::asio::awaitable<void> send_file_done(uint32_t id, boost::beast::error_code &ec);
     boost::asio::awaitable<void> wait_file_done(boost::beast::error_code &ec);
     boost::asio::awaitable<void> send_keepalive(boost::beast::error_code &ec);
+    boost::asio::awaitable<void> write_keepalive(boost::beast::error_code &ec);
+    // 流水线模式, 发送和接收各一个协程, 完成按传输 id 异步返回
+    boost::asio::awaitable<void> pipeline(boost::beast::error_code &ec);
+    boost::asio::awaitable<void> pipeline_send(boost::beast::error_code &ec);
+    boost::asio::awaitable<void> pipeline_recv(boost::beast::error_code &ec);
+    boost::asio::awaitable<void> wait_window(uint64_t bytes, boost::beast::error_code &ec);
+    // 等待服务端对 id 的回复, 返回 false 表示服务端拒绝了这个文件
+    boost::asio::awaitable<bool> wait_response(uint32_t id, const std::function<bool()> &ready, boost::beast::error_code &ec);
+    // 去重上传, 按内容分块后只发送服务端缺少的分块
+    boost::asio::awaitable<void> send_file_chunks(const file_info &file, uint32_t id, boost::beast::error_code &ec);
+    // 小文件批量上传, 一批文件只有一个传输 id
+    boost::asio::awaitable<void> send_batch(const std::vector<file_info> &files, boost::beast::error_code &ec);
     boost::asio::awaitable<void> login(boost::beast::error_code &);
 
    private:
     void padding_file_event();
+    void split_ranges(const file_info &file);
+    void on_ack(const leaf::ack &a);
+    void on_upload_file_response(const leaf::upload_file_response &r);
+    void on_chunk_need(const leaf::chunk_need &n);
+    bool dedup() const;
+    bool resumable(const file_info &file) const;
+    bool needs_response(const file_info &file) const;
+    bool batchable(const file_info &file) const;
+    std::vector<file_info> take_batch(const file_info &file);
+    void on_file_done(const leaf::done &d);
+    void on_error_message(const leaf::error_message &e);
     void safe_add_file(const file_info &file);
     void safe_add_files(const std::vector<file_info> &files);
 
@@ -46,10 +77,19 @@ class upload_session : public std::enable_shared_from_this<upload_session>
     std::string host_;
     std::string port_;
     std::string token_;
+    leaf::transfer_options options_;
     boost::asio::io_context &io_;
     std::deque<file_info> padding_files_;
+    std::map<uint32_t, file_info> inflight_;
+    std::map<uint32_t, leaf::upload_file_response> responses_;
+    std::map<uint32_t, std::vector<file_info>> batches_;    // 批量上传的文件, 断线后整批放回队列
+    std::map<uint32_t, std::vector<uint32_t>> chunk_needs_;
     bool shutdown_ = false;
     std::shared_ptr<boost::asio::steady_timer> timer_;
+    bool pipeline_stop_ = false;
+    leaf::send_window window_;
+    std::shared_ptr<boost::asio::steady_timer> window_timer_;
+    std::vector<std::weak_ptr<upload_session>> range_sessions_;
     std::shared_ptr<leaf::plain_websocket_client> ws_client_;
 };
 }    // namespace leaf
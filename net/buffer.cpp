@@ -17,4 +17,9 @@ std::vector<uint8_t> buffers_to_vector(const boost::asio::mutable_buffer& buffer
     return result;
 }
 
+std::span<const uint8_t> buffers_to_span(const boost::asio::const_buffer& buffers)
+{
+    return {static_cast<const uint8_t*>(buffers.data()), buffers.size()};
+}
+
 }    // namespace leaf
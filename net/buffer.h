@@ -1,3 +1,4 @@
+#include <span>
 #include <vector>
 #include <boost/asio/buffer.hpp>
 
@@ -6,4 +7,6 @@ namespace leaf
 
 std::vector<uint8_t> buffers_to_vector(const boost::asio::mutable_buffer& buffers);
 
+std::span<const uint8_t> buffers_to_span(const boost::asio::const_buffer& buffers);
+
 }    // namespace leaf
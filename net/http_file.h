@@ -0,0 +1,60 @@
+#ifndef LEAF_NET_HTTP_FILE_H
+#define LEAF_NET_HTTP_FILE_H
+
+#include <vector>
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <boost/beast.hpp>
+#include "net/http_session.h"
+
+namespace leaf
+{
+constexpr std::size_t kHttpFileChunk = 64 * 1024;
+
+// 先写响应头, 再分块读文件写出正文, TLS 等不能 sendfile 的连接使用
+template <typename Stream>
+boost::asio::awaitable<void> write_http_file(Stream& stream, http_file& file, boost::beast::error_code& ec)
+{
+    boost::beast::file f;
+    f.open(file.path.c_str(), boost::beast::file_mode::scan, ec);
+    if (ec)
+    {
+        co_return;
+    }
+    f.seek(file.offset, ec);
+    if (ec)
+    {
+        co_return;
+    }
+    boost::beast::http::response_serializer<boost::beast::http::empty_body> sr(file.header);
+    co_await boost::beast::http::async_write_header(stream, sr, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+    if (ec)
+    {
+        co_return;
+    }
+    std::vector<uint8_t> buffer(kHttpFileChunk);
+    uint64_t remaining = file.length;
+    while (remaining > 0)
+    {
+        auto n = f.read(buffer.data(), std::min<uint64_t>(buffer.size(), remaining), ec);
+        if (ec)
+        {
+            co_return;
+        }
+        // 文件在发送过程中被截断
+        if (n == 0)
+        {
+            ec = boost::asio::error::eof;
+            co_return;
+        }
+        co_await boost::asio::async_write(stream, boost::asio::buffer(buffer.data(), n), boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+        if (ec)
+        {
+            co_return;
+        }
+        remaining -= n;
+    }
+}
+}    // namespace leaf
+
+#endif
@@ -2,18 +2,29 @@
 #define LEAF_NET_HTTP_SESSION_H
 
 #include <memory>
+#include <string>
+#include <cstdint>
 #include <boost/optional.hpp>
 #include <boost/asio.hpp>
 #include <boost/beast.hpp>
 
 namespace leaf
 {
+// 文件响应, 响应头由调用方填好 Content-Length 等字段, 正文为文件的 [offset, offset + length)
+struct http_file
+{
+    boost::beast::http::response<boost::beast::http::empty_body> header;
+    std::string path;
+    uint64_t offset = 0;
+    uint64_t length = 0;
+};
 
 class http_session : public std::enable_shared_from_this<http_session>
 {
    public:
     using http_response_ptr = std::shared_ptr<boost::beast::http::message_generator>;
     using http_request_ptr = std::shared_ptr<boost::beast::http::request<boost::beast::http::string_body>>;
+    using http_file_ptr = std::shared_ptr<http_file>;
     using ptr = std::shared_ptr<http_session>;
 
    public:
@@ -23,6 +34,14 @@ class http_session : public std::enable_shared_from_this<http_session>
     virtual void startup() = 0;
     virtual void shutdown() = 0;
     virtual void write(const http_response_ptr &ptr) = 0;
+    // 明文连接在 Linux 上不限速时使用 sendfile, 其余读文件后写出
+    virtual void write_file(const http_file_ptr &file) = 0;
+    virtual boost::asio::any_io_executor get_executor() = 0;
+    // 在连接的执行器上调用, 0 表示不限速, 限速时明文连接不再使用 sendfile
+    virtual void set_write_limit(std::size_t bytes_per_second) = 0;
+    // PUT 请求交给 http_handle 时只有请求头, 正文由处理函数在连接的执行器上分块读取
+    // 读满 buffer 或正文结束时返回, 返回 0 表示正文已读完, chunked 编码同样适用
+    virtual boost::asio::awaitable<std::size_t> read_body(void *buffer, std::size_t size, boost::beast::error_code &ec) = 0;
 };
 
 }    // namespace leaf
@@ -1,4 +1,13 @@
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#endif
+#include <limits>
+#include <boost/asio/experimental/awaitable_operators.hpp>
 #include "log/log.h"
+#include "net/http_file.h"
+#include "net/scoped_exit.hpp"
 #include "net/session_handle.h"
 #include "net/plain_http_session.h"
 #include "net/plain_websocket_session.h"
@@ -17,6 +26,7 @@ void plain_http_session::startup()
 {
     LOG_INFO("startup {}", id_);
     self_ = shared_from_this();
+    set_write_limit(handle_.http_write_limit);
     do_read();
 }
 
@@ -32,12 +42,37 @@ void plain_http_session::do_read()
 
 void plain_http_session::safe_read()
 {
-    parser_.emplace();
-
-    parser_->body_limit(10000);
+    parser_.reset();
+    body_parser_.reset();
+    continue_sent_ = false;
+    header_parser_.emplace();
 
     boost::beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
 
+    boost::beast::http::async_read_header(
+        stream_, buffer_, *header_parser_, boost::beast::bind_front_handler(&plain_http_session::on_read_header, this));
+}
+
+void plain_http_session::on_read_header(boost::beast::error_code ec, std::size_t /*bytes_transferred*/)
+{
+    if (ec)
+    {
+        shutdown();
+        return;
+    }
+    // PUT 正文不限大小, 不读入内存, 交给处理函数通过 read_body 分块读取
+    if (header_parser_->get().method() == boost::beast::http::verb::put)
+    {
+        body_parser_.emplace(std::move(*header_parser_));
+        body_parser_->body_limit(boost::none);
+        auto req_ptr = std::make_shared<boost::beast::http::request<boost::beast::http::string_body>>(body_parser_->get().base());
+        handle_.http_handle(shared_from_this(), req_ptr);
+        return;
+    }
+    parser_.emplace(std::move(*header_parser_));
+
+    parser_->body_limit(10000);
+
     boost::beast::http::async_read(stream_, buffer_, *parser_, boost::beast::bind_front_handler(&plain_http_session::on_read, this));
 }
 
@@ -56,6 +91,7 @@ void plain_http_session::on_read(boost::beast::error_code ec, std::size_t bytes_
         boost::beast::http::request<boost::beast::http::string_body> req(parser_->release());
 
         boost::beast::get_lowest_layer(stream_).expires_never();
+        set_write_limit(0);
         std::string target = req.target();
         const auto& io = stream_.get_executor();
         leaf::websocket_session::ptr s = std::make_shared<leaf::plain_websocket_session>(id_, std::move(stream_), std::move(req));
@@ -80,6 +116,149 @@ void plain_http_session::safe_write(const http_response_ptr& ptr)
                               boost::beast::bind_front_handler(&plain_http_session::on_write, this, keep_alive));
 }
 
+void plain_http_session::write_file(const http_file_ptr& file)
+{
+    boost::asio::dispatch(stream_.get_executor(), boost::beast::bind_front_handler(&plain_http_session::safe_write_file, this, file));
+}
+
+void plain_http_session::safe_write_file(const http_file_ptr& file)
+{
+    bool keep_alive = file->header.keep_alive();
+    auto ec = std::make_shared<boost::beast::error_code>();
+    boost::asio::co_spawn(stream_.get_executor(),
+                          send_file(file, *ec),
+                          [this, self = shared_from_this(), file, ec, keep_alive](const std::exception_ptr& e)
+                          {
+                              if (e || *ec)
+                              {
+                                  LOG_ERROR("{} send file {} error {}", id_, file->path, ec->message());
+                                  shutdown();
+                                  return;
+                              }
+                              on_write(keep_alive, *ec, file->length);
+                          });
+}
+
+boost::asio::awaitable<void> plain_http_session::send_file(http_file_ptr file, boost::beast::error_code& ec)
+{
+#ifndef __linux__
+    co_await leaf::write_http_file(stream_, *file, ec);
+#else
+    // sendfile 绕过 rate policy, 限速时仍按块读出后经过限速的流写出
+    if (write_limit_ != 0)
+    {
+        co_await leaf::write_http_file(stream_, *file, ec);
+        co_return;
+    }
+    using boost::asio::experimental::awaitable_operators::operator||;
+    // 先打开文件, 打开失败时还没有写出响应头, 连接可以直接关闭
+    int fd = ::open(file->path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        ec.assign(errno, boost::system::system_category());
+        co_return;
+    }
+    auto close_file = leaf::make_scoped_exit([fd]() { ::close(fd); });
+
+    boost::beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
+    boost::beast::http::response_serializer<boost::beast::http::empty_body> sr(file->header);
+    co_await boost::beast::http::async_write_header(stream_, sr, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+    if (ec)
+    {
+        co_return;
+    }
+    boost::beast::get_lowest_layer(stream_).expires_never();
+
+    // 正文由内核直接从页缓存发到 socket, 不经过用户态缓冲区
+    auto& socket = stream_.socket();
+    socket.native_non_blocking(true, ec);
+    if (ec)
+    {
+        co_return;
+    }
+    boost::asio::steady_timer timer(stream_.get_executor());
+    auto offset = static_cast<off_t>(file->offset);
+    uint64_t remaining = file->length;
+    while (remaining > 0)
+    {
+        auto n = ::sendfile(socket.native_handle(), fd, &offset, static_cast<std::size_t>(std::min<uint64_t>(remaining, 0x7ffff000)));
+        if (n > 0)
+        {
+            remaining -= static_cast<uint64_t>(n);
+            continue;
+        }
+        // 文件在发送过程中被截断
+        if (n == 0)
+        {
+            ec = boost::asio::error::eof;
+            co_return;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            ec.assign(errno, boost::system::system_category());
+            co_return;
+        }
+        // 发送缓冲区满, 等 socket 可写, 对端 30 秒不读数据时断开
+        timer.expires_after(std::chrono::seconds(30));
+        auto result = co_await (socket.async_wait(boost::asio::socket_base::wait_write, boost::asio::redirect_error(boost::asio::use_awaitable, ec)) ||
+                                timer.async_wait(boost::asio::use_awaitable));
+        if (result.index() == 1)
+        {
+            ec = boost::beast::error::timeout;
+            co_return;
+        }
+        if (ec)
+        {
+            co_return;
+        }
+    }
+#endif
+}
+
+boost::asio::any_io_executor plain_http_session::get_executor() { return stream_.get_executor(); }
+
+void plain_http_session::set_write_limit(std::size_t bytes_per_second)
+{
+    write_limit_ = bytes_per_second;
+    stream_.rate_policy().write_limit(bytes_per_second != 0 ? bytes_per_second : std::numeric_limits<std::size_t>::max());
+}
+
+boost::asio::awaitable<std::size_t> plain_http_session::read_body(void* buffer, std::size_t size, boost::beast::error_code& ec)
+{
+    ec = {};
+    if (!body_parser_ || body_parser_->is_done())
+    {
+        co_return 0;
+    }
+    // 客户端等待 100 Continue 后才发送正文
+    if (!continue_sent_ && boost::beast::iequals(body_parser_->get()[boost::beast::http::field::expect], "100-continue"))
+    {
+        continue_sent_ = true;
+        boost::beast::http::response<boost::beast::http::empty_body> res{boost::beast::http::status::continue_, body_parser_->get().version()};
+        boost::beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
+        co_await boost::beast::http::async_write(stream_, res, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+        if (ec)
+        {
+            co_return 0;
+        }
+    }
+    auto& body = body_parser_->get().body();
+    body.data = buffer;
+    body.size = size;
+    boost::beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
+    co_await boost::beast::http::async_read(stream_, buffer_, *body_parser_, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+    // buffer 已满, 正文还没有读完
+    if (ec == boost::beast::http::error::need_buffer)
+    {
+        ec = {};
+    }
+    co_return size - body.size;
+}
+
 void plain_http_session::on_write(bool keep_alive, boost::beast::error_code ec, std::size_t /*bytes_transferred*/)
 {
     if (ec)
@@ -87,7 +266,8 @@ void plain_http_session::on_write(bool keep_alive, boost::beast::error_code ec,
         shutdown();
         return;
     }
-    if (keep_alive)
+    // PUT 正文没有读完时连接上还有未读的数据, 不能继续读下一个请求
+    if (keep_alive && (!body_parser_ || body_parser_->is_done()))
     {
         do_read();
     }
@@ -53,6 +53,12 @@ boost::asio::awaitable<void> plain_websocket_client::write(boost::beast::error_c
     co_await ws_->async_write(boost::asio::buffer(data, data_size), boost::asio::redirect_error(boost::asio::use_awaitable, ec));
 }
 
+boost::asio::awaitable<void> plain_websocket_client::write(boost::beast::error_code& ec, const std::vector<boost::asio::const_buffer>& buffers)
+{
+    ws_->binary(true);
+    co_await ws_->async_write(buffers, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+}
+
 void plain_websocket_client::set_read_limit(std::size_t bytes_per_second) { ws_->next_layer().rate_policy().read_limit(bytes_per_second); }
 
 void plain_websocket_client::set_write_limit(std::size_t bytes_per_second) { ws_->next_layer().rate_policy().write_limit(bytes_per_second); }
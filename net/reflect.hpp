@@ -8,6 +8,7 @@
 #include <boost/preprocessor/seq/for_each.hpp>
 #include <boost/optional.hpp>
 #include <boost/utility/string_view.hpp>
+#include <bit>
 #include <cassert>
 #include <functional>
 #include <memory>
@@ -16,6 +17,7 @@
 #include <type_traits>
 #include <vector>
 #include <map>
+#include "net/net_buffer.h"
 
 namespace reflect
 {
@@ -57,6 +59,23 @@ struct JsonWriter
     void string(const char *s, size_t len);
 };
 
+// 二进制编码, 成员顺序即 REFLECT_STRUCT 中的顺序
+// 整数按类型宽度大端写入, 字符串和数组以 uint32 长度为前缀
+struct BinaryWriter
+{
+    leaf::write_buffer *m;
+
+    explicit BinaryWriter(leaf::write_buffer *m) : m(m) {}
+};
+
+struct BinaryReader
+{
+    leaf::read_buffer *m;
+    bool ok = true;
+
+    explicit BinaryReader(leaf::read_buffer *m) : m(m) {}
+};
+
 // clang-format off
 
 inline     std::string JsonReader::getString() { return m->GetString(); }
@@ -99,6 +118,136 @@ inline     void reflect(JsonWriter &vis, std::string &v       ) { vis.string(v.c
 inline     void reflect(JsonReader& vis, JsonNull& v) {}
 inline     void reflect(JsonWriter& vis, JsonNull& v) { vis.m->Null(); }
 // clang-format on
+// binary
+template <typename T>
+    requires std::is_integral_v<T>
+inline void reflect(BinaryWriter &vis, T &v)
+{
+    if constexpr (sizeof(T) == 1)
+    {
+        vis.m->write_uint8(static_cast<uint8_t>(v));
+    }
+    else if constexpr (sizeof(T) == 2)
+    {
+        vis.m->write_uint16(static_cast<uint16_t>(v));
+    }
+    else if constexpr (sizeof(T) == 4)
+    {
+        vis.m->write_uint32(static_cast<uint32_t>(v));
+    }
+    else
+    {
+        vis.m->write_uint64(static_cast<uint64_t>(v));
+    }
+}
+template <typename T>
+    requires std::is_integral_v<T>
+inline void reflect(BinaryReader &vis, T &v)
+{
+    bool ok = false;
+    if constexpr (sizeof(T) == 1)
+    {
+        uint8_t x = 0;
+        ok = vis.m->read_uint8(&x);
+        if constexpr (std::is_same_v<T, bool>)
+        {
+            v = x != 0;
+        }
+        else
+        {
+            v = static_cast<T>(x);
+        }
+    }
+    else if constexpr (sizeof(T) == 2)
+    {
+        uint16_t x = 0;
+        ok = vis.m->read_uint16(&x);
+        v = static_cast<T>(x);
+    }
+    else if constexpr (sizeof(T) == 4)
+    {
+        uint32_t x = 0;
+        ok = vis.m->read_uint32(&x);
+        v = static_cast<T>(x);
+    }
+    else
+    {
+        uint64_t x = 0;
+        ok = vis.m->read_uint64(&x);
+        v = static_cast<T>(x);
+    }
+    vis.ok = vis.ok && ok;
+}
+inline void reflect(BinaryWriter &vis, double &v) { vis.m->write_uint64(std::bit_cast<uint64_t>(v)); }
+inline void reflect(BinaryReader &vis, double &v)
+{
+    uint64_t x = 0;
+    vis.ok = vis.ok && vis.m->read_uint64(&x);
+    v = std::bit_cast<double>(x);
+}
+inline void reflect(BinaryWriter &vis, std::string &v)
+{
+    vis.m->write_uint32(static_cast<uint32_t>(v.size()));
+    vis.m->write_bytes(v.data(), v.size());
+}
+inline void reflect(BinaryReader &vis, std::string &v)
+{
+    uint32_t size = 0;
+    if (!vis.m->read_uint32(&size) || !vis.m->read_string(&v, size))
+    {
+        vis.ok = false;
+    }
+}
+template <typename T>
+inline void reflect(BinaryWriter &vis, boost::optional<T> &v)
+{
+    vis.m->write_uint8(v.has_value() ? 1 : 0);
+    if (v.has_value())
+    {
+        reflect(vis, *v);
+    }
+}
+template <typename T>
+inline void reflect(BinaryReader &vis, boost::optional<T> &v)
+{
+    uint8_t has_value = 0;
+    if (!vis.m->read_uint8(&has_value))
+    {
+        vis.ok = false;
+        return;
+    }
+    if (has_value != 0)
+    {
+        v.emplace();
+        reflect(vis, *v);
+    }
+}
+template <typename T>
+inline void reflect(BinaryWriter &vis, std::vector<T> &v)
+{
+    vis.m->write_uint32(static_cast<uint32_t>(v.size()));
+    for (auto &it : v)
+    {
+        reflect(vis, it);
+    }
+}
+template <typename T>
+inline void reflect(BinaryReader &vis, std::vector<T> &v)
+{
+    uint32_t count = 0;
+    // 每个元素至少占一个字节, 避免被伪造的数量撑爆内存
+    if (!vis.m->read_uint32(&count) || count > vis.m->size())
+    {
+        vis.ok = false;
+        return;
+    }
+    v.reserve(count);
+    for (uint32_t i = 0; i < count && vis.ok; i++)
+    {
+        v.emplace_back();
+        reflect(vis, v.back());
+    }
+}
 // boost optional
 template <typename T>
 void reflect(JsonReader &vis, boost::optional<T> &v)
@@ -208,6 +357,21 @@ inline void reflectMember(JsonWriter &vis, const char *name, boost::optional<T>
     }
 }
 
+template <typename T>
+inline void reflectMember(BinaryWriter &vis, const char * /*name*/, T &v)
+{
+    reflect(vis, v);
+}
+template <typename T>
+inline void reflectMember(BinaryReader &vis, const char * /*name*/, T &v)
+{
+    // 旧版本对端没有尾部追加的字段, 读完即停, 保持默认值
+    if (vis.ok && vis.m->size() != 0)
+    {
+        reflect(vis, v);
+    }
+}
+
 inline void JsonReader::iterArray(const std::function<void()> &fn)
 {
     if (!m->IsArray())
@@ -306,6 +470,24 @@ inline std::string serialize_struct(const T &t)
     return sb.GetString();
 }
 
+template <typename T>
+inline void serialize_struct_binary(const T &t, leaf::write_buffer &w)
+{
+    using non_const_t = typename std::remove_const<T>::type;
+    auto &nt = const_cast<non_const_t &>(t);
+    BinaryWriter binary_writer(&w);
+    reflect(binary_writer, nt);
+}
+
+// 末尾多余的字节被忽略, 缺少的尾部字段保持默认值, 新版本可以在结构体尾部追加字段
+template <typename T>
+inline bool deserialize_struct_binary(T &t, leaf::read_buffer &r)
+{
+    BinaryReader binary_reader(&r);
+    reflect(binary_reader, t);
+    return binary_reader.ok;
+}
+
 }    // namespace reflect
 
 #endif
@@ -13,6 +13,8 @@ struct session_handle
         const boost::asio::any_io_executor &, leaf::websocket_session::ptr &, const std::string &, const std::string &)>
         ws_handle;
     std::function<void(const leaf::http_session::ptr &, const leaf::http_session::http_request_ptr &)> http_handle;
+    // HTTP 响应的发送限速, 字节每秒, 0 表示不限速, 升级为 websocket 后由 websocket 处理函数自行设置
+    std::size_t http_write_limit = 0;
 };
 
 }    // namespace leaf
@@ -1,4 +1,6 @@
+#include <limits>
 #include "log/log.h"
+#include "net/http_file.h"
 #include "net/ssl_http_session.h"
 #include "net/ssl_websocket_session.h"
 
@@ -23,6 +25,7 @@ void ssl_http_session::startup()
 void ssl_http_session::safe_startup()
 {
     LOG_INFO("startup {}", id_);
+    set_write_limit(handle_.http_write_limit);
     boost::beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
 
     stream_.async_handshake(
@@ -62,12 +65,37 @@ void ssl_http_session::do_read()
 
 void ssl_http_session::safe_read()
 {
-    parser_.emplace();
-
-    parser_->body_limit(10000);
+    parser_.reset();
+    body_parser_.reset();
+    continue_sent_ = false;
+    header_parser_.emplace();
 
     boost::beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
 
+    boost::beast::http::async_read_header(
+        stream_, buffer_, *header_parser_, boost::beast::bind_front_handler(&ssl_http_session::on_read_header, this));
+}
+
+void ssl_http_session::on_read_header(boost::beast::error_code ec, std::size_t /*bytes_transferred*/)
+{
+    if (ec)
+    {
+        shutdown();
+        return;
+    }
+    // PUT 正文不限大小, 不读入内存, 交给处理函数通过 read_body 分块读取
+    if (header_parser_->get().method() == boost::beast::http::verb::put)
+    {
+        body_parser_.emplace(std::move(*header_parser_));
+        body_parser_->body_limit(boost::none);
+        auto req_ptr = std::make_shared<boost::beast::http::request<boost::beast::http::string_body>>(body_parser_->get().base());
+        handle_.http_handle(shared_from_this(), req_ptr);
+        return;
+    }
+    parser_.emplace(std::move(*header_parser_));
+
+    parser_->body_limit(10000);
+
     boost::beast::http::async_read(stream_, buffer_, *parser_, boost::beast::bind_front_handler(&ssl_http_session::on_read, this));
 }
 void ssl_http_session::on_read(boost::beast::error_code ec, std::size_t bytes_transferred)
@@ -83,6 +111,7 @@ void ssl_http_session::on_read(boost::beast::error_code ec, std::size_t bytes_tr
     if (boost::beast::websocket::is_upgrade(parser_->get()))
     {
         boost::beast::get_lowest_layer(stream_).expires_never();
+        set_write_limit(0);
         boost::beast::http::request<boost::beast::http::string_body> req(parser_->release());
         std::string target = req.target();
         const auto& io = stream_.get_executor();
@@ -107,9 +136,73 @@ void ssl_http_session::safe_write(const http_response_ptr& ptr)
                               boost::beast::bind_front_handler(&ssl_http_session::on_write, this, keep_alive));
 }
 
+void ssl_http_session::write_file(const http_file_ptr& file)
+{
+    boost::asio::dispatch(stream_.get_executor(), boost::beast::bind_front_handler(&ssl_http_session::safe_write_file, this, file));
+}
+
+void ssl_http_session::safe_write_file(const http_file_ptr& file)
+{
+    // TLS 需要在用户态加密, 不能 sendfile
+    bool keep_alive = file->header.keep_alive();
+    auto ec = std::make_shared<boost::beast::error_code>();
+    boost::asio::co_spawn(stream_.get_executor(),
+                          leaf::write_http_file(stream_, *file, *ec),
+                          [this, self = shared_from_this(), file, ec, keep_alive](const std::exception_ptr& e)
+                          {
+                              if (e || *ec)
+                              {
+                                  LOG_ERROR("{} write file {} error {}", id_, file->path, ec->message());
+                                  shutdown();
+                                  return;
+                              }
+                              on_write(keep_alive, *ec, file->length);
+                          });
+}
+
+boost::asio::any_io_executor ssl_http_session::get_executor() { return stream_.get_executor(); }
+
+void ssl_http_session::set_write_limit(std::size_t bytes_per_second)
+{
+    boost::beast::get_lowest_layer(stream_).rate_policy().write_limit(bytes_per_second != 0 ? bytes_per_second : std::numeric_limits<std::size_t>::max());
+}
+
+boost::asio::awaitable<std::size_t> ssl_http_session::read_body(void* buffer, std::size_t size, boost::beast::error_code& ec)
+{
+    ec = {};
+    if (!body_parser_ || body_parser_->is_done())
+    {
+        co_return 0;
+    }
+    // 客户端等待 100 Continue 后才发送正文
+    if (!continue_sent_ && boost::beast::iequals(body_parser_->get()[boost::beast::http::field::expect], "100-continue"))
+    {
+        continue_sent_ = true;
+        boost::beast::http::response<boost::beast::http::empty_body> res{boost::beast::http::status::continue_, body_parser_->get().version()};
+        boost::beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
+        co_await boost::beast::http::async_write(stream_, res, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+        if (ec)
+        {
+            co_return 0;
+        }
+    }
+    auto& body = body_parser_->get().body();
+    body.data = buffer;
+    body.size = size;
+    boost::beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
+    co_await boost::beast::http::async_read(stream_, buffer_, *body_parser_, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+    // buffer 已满, 正文还没有读完
+    if (ec == boost::beast::http::error::need_buffer)
+    {
+        ec = {};
+    }
+    co_return size - body.size;
+}
+
 void ssl_http_session::on_write(bool keep_alive, boost::beast::error_code /*ec*/, std::size_t /*bytes_transferred*/)
 {
-    if (keep_alive)
+    // PUT 正文没有读完时连接上还有未读的数据, 不能继续读下一个请求
+    if (keep_alive && (!body_parser_ || body_parser_->is_done()))
     {
         do_read();
     }
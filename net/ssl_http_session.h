@@ -29,14 +29,24 @@ class ssl_http_session : public http_session
 
     void write(const http_response_ptr& ptr) override;
 
+    void write_file(const http_file_ptr& file) override;
+
+    boost::asio::any_io_executor get_executor() override;
+
+    void set_write_limit(std::size_t bytes_per_second) override;
+
+    boost::asio::awaitable<std::size_t> read_body(void* buffer, std::size_t size, boost::beast::error_code& ec) override;
+
    private:
     void safe_startup();
     void safe_shutdown();
     void safe_write(const http_response_ptr& ptr);
+    void safe_write_file(const http_file_ptr& file);
     void on_write(bool keep_alive, boost::beast::error_code ec, std::size_t bytes_transferred);
     void on_handshake(boost::beast::error_code ec, std::size_t bytes_used);
     void do_read();
     void safe_read();
+    void on_read_header(boost::beast::error_code ec, std::size_t bytes_transferred);
     void on_read(boost::beast::error_code ec, std::size_t bytes_transferred);
 
    private:
@@ -45,7 +55,10 @@ class ssl_http_session : public http_session
     leaf::session_handle handle_;
     boost::beast::flat_buffer buffer_;
     boost::beast::ssl_stream<tcp_stream_limited> stream_;
+    bool continue_sent_ = false;
+    boost::optional<boost::beast::http::request_parser<boost::beast::http::empty_body>> header_parser_;
     boost::optional<boost::beast::http::request_parser<boost::beast::http::string_body>> parser_;
+    boost::optional<boost::beast::http::request_parser<boost::beast::http::buffer_body>> body_parser_;
 };
 
 }    // namespace leaf
@@ -34,6 +34,11 @@ boost::asio::awaitable<void> ssl_websocket_session::write(boost::beast::error_co
 {
     co_await ws_.async_write(boost::asio::buffer(data, data_len), boost::asio::redirect_error(boost::asio::use_awaitable, ec));
 }
+boost::asio::awaitable<void> ssl_websocket_session::write(boost::beast::error_code& ec, const std::vector<boost::asio::const_buffer>& buffers)
+{
+    ws_.binary(true);
+    co_await ws_.async_write(buffers, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+}
 
 void ssl_websocket_session::set_read_limit(std::size_t bytes_per_second)
 {
@@ -1,5 +1,7 @@
 #include <cassert>
+#include <algorithm>
 #include <type_traits>
+#include "config/config.h"
 #include "protocol/codec.h"
 #include "net/reflect.hpp"
 #include "net/net_buffer.h"
@@ -10,13 +12,16 @@ REFLECT_STRUCT(leaf::create_dir, (parent)(dir)(token));
 REFLECT_STRUCT(leaf::keepalive, (id)(client_id)(client_timestamp)(server_timestamp));
 REFLECT_STRUCT(leaf::login_request, (username)(password));
 REFLECT_STRUCT(leaf::rename_request, (type)(token)(parent)(old_name)(new_name));
-REFLECT_STRUCT(leaf::login_token, (id)(token));
+REFLECT_STRUCT(leaf::login_token, (id)(token)(codec)(version)(block_size)(hash_block_size)(hash)(digest)(compression)(window));
 REFLECT_STRUCT(leaf::error_message, (id)(error));
-REFLECT_STRUCT(leaf::upload_file_request, (id)(filesize)(dir)(filename));
-REFLECT_STRUCT(leaf::upload_file_response, (id)(filename));
+REFLECT_STRUCT(leaf::upload_file_request, (id)(filesize)(dir)(filename)(offset)(length)(range_id)(resume)(dedup)(hash));
+REFLECT_STRUCT(leaf::upload_file_response, (id)(filename)(offset)(instant));
 REFLECT_STRUCT(leaf::download_file_response, (id)(filesize)(filename)(offset)(hash));
-REFLECT_STRUCT(leaf::download_file_request, (id)(filename)(dir)(offset)(hash));
+REFLECT_STRUCT(leaf::download_file_request, (id)(filename)(dir)(offset)(hash)(length));
 REFLECT_STRUCT(leaf::delete_file_request, (id)(filename));
+REFLECT_STRUCT(leaf::chunk_offer, (id)(sizes)(hashes));
+REFLECT_STRUCT(leaf::chunk_need, (id)(indexes));
+REFLECT_STRUCT(leaf::upload_batch_request, (id)(dir)(filenames)(sizes)(hashes));
 REFLECT_STRUCT(leaf::file_node, (parent)(name)(type)(file_size));
 REFLECT_STRUCT(leaf::files_request, (token)(dir));
 REFLECT_STRUCT(leaf::files_response, (files)(token)(dir));
@@ -25,16 +30,122 @@ REFLECT_STRUCT(leaf::files_response, (files)(token)(dir));
 namespace leaf
 {
 static uint16_t to_underlying(leaf::message_type type) { return static_cast<std::underlying_type_t<leaf::message_type>>(type); }
+static uint8_t to_underlying(leaf::codec_type type) { return static_cast<std::underlying_type_t<leaf::codec_type>>(type); }
+static uint8_t to_underlying(leaf::digest_type type) { return static_cast<std::underlying_type_t<leaf::digest_type>>(type); }
 
-static void write_padding(leaf::write_buffer &w)
+// 头部 8 字节的最高字节为消息体编码, 旧版本在这里写 0 也就是 json
+// 低 32 位为流水线模式下的传输 id, 旧版本读取时直接忽略
+static void write_padding(leaf::write_buffer &w, leaf::codec_type codec = leaf::codec_type::json, uint32_t id = 0)
 {
-    uint64_t xx = 0;
+    uint64_t xx = static_cast<uint64_t>(codec) << 56 | id;
     w.write_uint64(xx);
 }
-static void read_padding(leaf::read_buffer &r)
+static leaf::codec_type read_padding(leaf::read_buffer &r, uint32_t *id = nullptr)
 {
     uint64_t xx = 0;
     r.read_uint64(&xx);
+    if (id != nullptr)
+    {
+        *id = static_cast<uint32_t>(xx);
+    }
+    return static_cast<leaf::codec_type>(xx >> 56);
+}
+
+template <typename T>
+static void write_body(leaf::write_buffer &w, const T &msg, leaf::codec_type codec)
+{
+    if (codec == leaf::codec_type::binary)
+    {
+        reflect::serialize_struct_binary(msg, w);
+        return;
+    }
+    std::string str = reflect::serialize_struct(msg);
+    w.write_bytes(str.data(), str.size());
+}
+
+template <typename T>
+static bool read_body(leaf::read_buffer &r, T &msg, leaf::codec_type codec)
+{
+    if (codec == leaf::codec_type::binary)
+    {
+        return reflect::deserialize_struct_binary(msg, r);
+    }
+    std::string str;
+    r.read_string(&str, r.size());
+    if (str.empty())
+    {
+        return false;
+    }
+    return reflect::deserialize_struct(msg, str);
+}
+
+leaf::codec_type negotiate_codec(uint32_t codec)
+{
+    if (codec == leaf::to_underlying(leaf::codec_type::binary))
+    {
+        return leaf::codec_type::binary;
+    }
+    return leaf::codec_type::json;
+}
+
+leaf::transfer_options preferred_transfer_options()
+{
+    leaf::transfer_options options;
+    options.version = kProtocolVersion;
+    options.codec = leaf::codec_type::binary;
+    options.block_size = kMaxBlockSize;
+    options.hash_block_size = 4 * kMaxBlockSize;
+    options.digest = leaf::digest_type::raw;
+    options.window = kMaxWindow;
+    return options;
+}
+
+leaf::transfer_options negotiate_transfer_options(const leaf::login_token &peer)
+{
+    leaf::transfer_options options;
+    options.codec = negotiate_codec(peer.codec);
+    // 旧版本对端, 其余参数保持默认
+    if (peer.version == 0)
+    {
+        return options;
+    }
+    options.version = std::min<uint32_t>(peer.version, kProtocolVersion);
+    if (peer.block_size != 0)
+    {
+        options.block_size = std::clamp<uint32_t>(peer.block_size, kMinBlockSize, kMaxBlockSize);
+        // 数据块按扇区对齐, 大文件在服务端可以使用 O_DIRECT
+        options.block_size -= options.block_size % kDirectIoAlignment;
+    }
+    uint32_t hash_block_size = peer.hash_block_size;
+    if (hash_block_size == 0)
+    {
+        hash_block_size = options.block_size * (kHashBlockSize / kBlockSize);
+    }
+    // 摘要边界必须落在数据块边界上
+    hash_block_size = std::clamp<uint32_t>(hash_block_size, options.block_size, kMaxHashBlockSize);
+    options.hash_block_size = hash_block_size - hash_block_size % options.block_size;
+    if (peer.digest == leaf::to_underlying(leaf::digest_type::raw))
+    {
+        options.digest = leaf::digest_type::raw;
+    }
+    // 目前只有 blake2b 且不压缩, 对端的其他取值一律回退
+    if (peer.window != 0)
+    {
+        options.window = std::clamp<uint32_t>(peer.window, 1, kMaxWindow);
+    }
+    return options;
+}
+
+void set_transfer_options(leaf::login_token &l, const leaf::transfer_options &options)
+{
+    l.version = options.version;
+    l.codec = static_cast<uint32_t>(options.codec);
+    l.block_size = options.block_size;
+    l.hash_block_size = options.hash_block_size;
+    l.hash = static_cast<uint32_t>(options.hash);
+    l.digest = static_cast<uint32_t>(options.digest);
+    l.compression = static_cast<uint32_t>(options.compression);
+    l.window = options.window;
 }
 
 leaf::message_type get_message_type(std::string_view data)
@@ -48,7 +159,9 @@ leaf::message_type get_message_type(std::string_view data)
 
 leaf::message_type get_message_type(const std::string &data) { return get_message_type(std::string_view(data)); }
 
-leaf::message_type get_message_type(const std::vector<uint8_t> &data)
+leaf::message_type get_message_type(const std::vector<uint8_t> &data) { return get_message_type(std::span<const uint8_t>(data)); }
+
+leaf::message_type get_message_type(std::span<const uint8_t> data)
 {
     leaf::read_buffer r(data.data(), data.size());
     read_padding(r);
@@ -57,6 +170,101 @@ leaf::message_type get_message_type(const std::vector<uint8_t> &data)
     return static_cast<leaf::message_type>(type);
 }
 
+static std::optional<leaf::file_data_view> read_file_data(leaf::read_buffer &r);
+
+// 旧版本的 ack 没有偏移
+static leaf::ack read_ack(leaf::read_buffer &r, uint32_t id)
+{
+    leaf::ack a;
+    a.id = id;
+    r.read_uint64(&a.offset);
+    return a;
+}
+
+template <typename T>
+static leaf::message decode_body(leaf::read_buffer &r, leaf::codec_type codec)
+{
+    T msg;
+    if (!read_body(r, msg, codec))
+    {
+        return std::monostate{};
+    }
+    return msg;
+}
+
+leaf::message decode(std::span<const uint8_t> data)
+{
+    leaf::read_buffer r(data.data(), data.size());
+    uint32_t id = 0;
+    auto codec = read_padding(r, &id);
+    uint16_t type = 0;
+    if (!r.read_uint16(&type))
+    {
+        return std::monostate{};
+    }
+    switch (static_cast<leaf::message_type>(type))
+    {
+        case leaf::message_type::file_data:
+        {
+            auto fd = read_file_data(r);
+            if (!fd.has_value())
+            {
+                return std::monostate{};
+            }
+            fd->id = id;
+            return fd.value();
+        }
+        case leaf::message_type::ack:
+            return read_ack(r, id);
+        case leaf::message_type::done:
+            return leaf::done{id};
+        case leaf::message_type::dir:
+            return decode_body<leaf::create_dir>(r, codec);
+        case leaf::message_type::rename:
+            return decode_body<leaf::rename_request>(r, codec);
+        // 一批分块的摘要超过控制消息的大小限制
+        case leaf::message_type::chunk_offer:
+            return decode_body<leaf::chunk_offer>(r, codec);
+        case leaf::message_type::chunk_need:
+            return decode_body<leaf::chunk_need>(r, codec);
+        case leaf::message_type::upload_batch_request:
+            return decode_body<leaf::upload_batch_request>(r, codec);
+        default:
+            break;
+    }
+    // 其余控制消息与 deserialize_* 一样限制大小
+    if (data.size() > 2048)
+    {
+        return std::monostate{};
+    }
+    switch (static_cast<leaf::message_type>(type))
+    {
+        case leaf::message_type::error:
+            return decode_body<leaf::error_message>(r, codec);
+        case leaf::message_type::login:
+            return decode_body<leaf::login_token>(r, codec);
+        case leaf::message_type::upload_file_request:
+            return decode_body<leaf::upload_file_request>(r, codec);
+        case leaf::message_type::upload_file_response:
+            return decode_body<leaf::upload_file_response>(r, codec);
+        case leaf::message_type::download_file_request:
+            return decode_body<leaf::download_file_request>(r, codec);
+        case leaf::message_type::download_file_response:
+            return decode_body<leaf::download_file_response>(r, codec);
+        case leaf::message_type::delete_file_request:
+            return decode_body<leaf::delete_file_request>(r, codec);
+        case leaf::message_type::keepalive:
+            return decode_body<leaf::keepalive>(r, codec);
+        case leaf::message_type::files_request:
+            return decode_body<leaf::files_request>(r, codec);
+        case leaf::message_type::files_response:
+            return decode_body<leaf::files_response>(r, codec);
+        default:
+            break;
+    }
+    return std::monostate{};
+}
+
 std::string message_type_to_string(leaf::message_type type)
 {
 #define MESSAGE_TYPE_TO_STRING(t)      \
@@ -80,16 +288,18 @@ std::string message_type_to_string(leaf::message_type type)
     MESSAGE_TYPE_TO_STRING(dir)
     MESSAGE_TYPE_TO_STRING(error)
     MESSAGE_TYPE_TO_STRING(rename)
+    MESSAGE_TYPE_TO_STRING(chunk_offer)
+    MESSAGE_TYPE_TO_STRING(chunk_need)
+    MESSAGE_TYPE_TO_STRING(upload_batch_request)
 #undef MESSAGE_TYPE_TO_STRING
     return "unknown";
 }
-std::vector<uint8_t> serialize_upload_file_request(const upload_file_request &msg)
+std::vector<uint8_t> serialize_upload_file_request(const upload_file_request &msg, leaf::codec_type codec)
 {
     leaf::write_buffer w;
-    write_padding(w);
+    write_padding(w, codec);
     w.write_uint16(leaf::to_underlying(message_type::upload_file_request));
-    std::string str = reflect::serialize_struct(msg);
-    w.write_bytes(str.data(), str.size());
+    write_body(w, msg, codec);
     std::vector<uint8_t> bytes;
     w.copy_to(&bytes);
     return bytes;
@@ -101,7 +311,7 @@ std::optional<leaf::upload_file_request> deserialize_upload_file_request(const s
     {
         return {};
     }
-    read_padding(r);
+    auto codec = read_padding(r);
 
     uint16_t type = 0;
     r.read_uint16(&type);
@@ -110,27 +320,20 @@ std::optional<leaf::upload_file_request> deserialize_upload_file_request(const s
         return {};
     }
 
-    std::string str;
-    r.read_string(&str, r.size());
-    if (str.empty())
-    {
-        return {};
-    }
     leaf::upload_file_request req;
-    if (!reflect::deserialize_struct(req, str))
+    if (!read_body(r, req, codec))
     {
         return {};
     }
     return req;
 }
 // response
-std::vector<uint8_t> serialize_upload_file_response(const upload_file_response &msg)
+std::vector<uint8_t> serialize_upload_file_response(const upload_file_response &msg, leaf::codec_type codec)
 {
     leaf::write_buffer w;
-    write_padding(w);
+    write_padding(w, codec);
     w.write_uint16(leaf::to_underlying(message_type::upload_file_response));
-    std::string str = reflect::serialize_struct(msg);
-    w.write_bytes(str.data(), str.size());
+    write_body(w, msg, codec);
     std::vector<uint8_t> bytes;
     w.copy_to(&bytes);
     return bytes;
@@ -142,34 +345,27 @@ std::optional<leaf::upload_file_response> deserialize_upload_file_response(const
     {
         return {};
     }
-    read_padding(r);
+    auto codec = read_padding(r);
     uint16_t type = 0;
     r.read_uint16(&type);
     if (type != leaf::to_underlying(message_type::upload_file_response))
     {
         return {};
     }
-    std::string str;
-    r.read_string(&str, r.size());
-    if (str.empty())
-    {
-        return {};
-    }
     leaf::upload_file_response resp;
-    if (!reflect::deserialize_struct(resp, str))
+    if (!read_body(r, resp, codec))
     {
         return {};
     }
     return resp;
 }
 
-std::vector<uint8_t> serialize_error_message(const error_message &msg)
+std::vector<uint8_t> serialize_error_message(const error_message &msg, leaf::codec_type codec)
 {
     leaf::write_buffer w;
-    write_padding(w);
+    write_padding(w, codec);
     w.write_uint16(leaf::to_underlying(message_type::error));
-    std::string str = reflect::serialize_struct(msg);
-    w.write_bytes(str.data(), str.size());
+    write_body(w, msg, codec);
     std::vector<uint8_t> bytes;
     w.copy_to(&bytes);
     return bytes;
@@ -182,34 +378,27 @@ std::optional<leaf::error_message> deserialize_error_message(const std::vector<u
     {
         return {};
     }
-    read_padding(r);
+    auto codec = read_padding(r);
     uint16_t type = 0;
     r.read_uint16(&type);
     if (type != leaf::to_underlying(message_type::error))
     {
         return {};
     }
-    std::string str;
-    r.read_string(&str, r.size());
-    if (str.empty())
-    {
-        return {};
-    }
     leaf::error_message req;
-    if (!reflect::deserialize_struct(req, str))
+    if (!read_body(r, req, codec))
     {
         return {};
     }
     return req;
 }
 
-std::vector<uint8_t> serialize_download_file_request(const download_file_request &msg)
+std::vector<uint8_t> serialize_download_file_request(const download_file_request &msg, leaf::codec_type codec)
 {
     leaf::write_buffer w;
-    write_padding(w);
+    write_padding(w, codec);
     w.write_uint16(leaf::to_underlying(message_type::download_file_request));
-    std::string str = reflect::serialize_struct(msg);
-    w.write_bytes(str.data(), str.size());
+    write_body(w, msg, codec);
     std::vector<uint8_t> bytes;
     w.copy_to(&bytes);
     return bytes;
@@ -221,34 +410,27 @@ std::optional<leaf::download_file_request> deserialize_download_file_request(con
     {
         return {};
     }
-    read_padding(r);
+    auto codec = read_padding(r);
     uint16_t type = 0;
     r.read_uint16(&type);
     if (type != leaf::to_underlying(message_type::download_file_request))
     {
         return {};
     }
-    std::string str;
-    r.read_string(&str, r.size());
-    if (str.empty())
-    {
-        return {};
-    }
     leaf::download_file_request req;
-    if (!reflect::deserialize_struct(req, str))
+    if (!read_body(r, req, codec))
     {
         return {};
     }
     return req;
 }
 
-std::vector<uint8_t> serialize_download_file_response(const download_file_response &msg)
+std::vector<uint8_t> serialize_download_file_response(const download_file_response &msg, leaf::codec_type codec)
 {
     leaf::write_buffer w;
-    write_padding(w);
+    write_padding(w, codec);
     w.write_uint16(leaf::to_underlying(message_type::download_file_response));
-    std::string str = reflect::serialize_struct(msg);
-    w.write_bytes(str.data(), str.size());
+    write_body(w, msg, codec);
     std::vector<uint8_t> bytes;
     w.copy_to(&bytes);
     return bytes;
@@ -260,31 +442,27 @@ std::optional<leaf::download_file_response> deserialize_download_file_response(c
     {
         return {};
     }
-    read_padding(r);
+    auto codec = read_padding(r);
     uint16_t type = 0;
     r.read_uint16(&type);
     if (type != leaf::to_underlying(message_type::download_file_response))
     {
         return {};
     }
-    std::string str;
-    r.read_string(&str, r.size());
-    if (str.empty())
+    leaf::download_file_response resp;
+    if (!read_body(r, resp, codec))
     {
         return {};
     }
-    leaf::download_file_response resp;
-    reflect::deserialize_struct(resp, str);
     return resp;
 }
 
-std::vector<uint8_t> serialize_delete_file_request(const delete_file_request &msg)
+std::vector<uint8_t> serialize_delete_file_request(const delete_file_request &msg, leaf::codec_type codec)
 {
     leaf::write_buffer w;
-    write_padding(w);
+    write_padding(w, codec);
     w.write_uint16(leaf::to_underlying(message_type::delete_file_request));
-    std::string str = reflect::serialize_struct(msg);
-    w.write_bytes(str.data(), str.size());
+    write_body(w, msg, codec);
     std::vector<uint8_t> bytes;
     w.copy_to(&bytes);
     return bytes;
@@ -297,34 +475,27 @@ std::optional<leaf::delete_file_request> deserialize_delete_file_request(const s
     {
         return {};
     }
-    read_padding(r);
+    auto codec = read_padding(r);
     uint16_t type = 0;
     r.read_uint16(&type);
     if (type != leaf::to_underlying(message_type::delete_file_request))
     {
         return {};
     }
-    std::string str;
-    r.read_string(&str, r.size());
-    if (str.empty())
-    {
-        return {};
-    }
     leaf::delete_file_request req;
-    if (!reflect::deserialize_struct(req, str))
+    if (!read_body(r, req, codec))
     {
         return {};
     }
     return req;
 }
 
-std::vector<uint8_t> serialize_keepalive(const leaf::keepalive &k)
+std::vector<uint8_t> serialize_keepalive(const leaf::keepalive &k, leaf::codec_type codec)
 {
     leaf::write_buffer w;
-    write_padding(w);
+    write_padding(w, codec);
     w.write_uint16(leaf::to_underlying(message_type::keepalive));
-    std::string str = reflect::serialize_struct(k);
-    w.write_bytes(str.data(), str.size());
+    write_body(w, k, codec);
     std::vector<uint8_t> bytes;
     w.copy_to(&bytes);
     return bytes;
@@ -336,21 +507,15 @@ std::optional<leaf::keepalive> deserialize_keepalive(const std::vector<uint8_t>
     {
         return {};
     }
-    read_padding(r);
+    auto codec = read_padding(r);
     uint16_t type = 0;
     r.read_uint16(&type);
     if (type != leaf::to_underlying(message_type::keepalive))
     {
         return {};
     }
-    std::string str;
-    r.read_string(&str, r.size());
-    if (str.empty())
-    {
-        return {};
-    }
     leaf::keepalive resp;
-    if (!reflect::deserialize_struct(resp, str))
+    if (!read_body(r, resp, codec))
     {
         return {};
     }
@@ -361,8 +526,7 @@ std::vector<uint8_t> serialize_login_request(const leaf::login_request &l)
     leaf::write_buffer w;
     write_padding(w);
     w.write_uint16(leaf::to_underlying(message_type::login));
-    std::string str = reflect::serialize_struct(l);
-    w.write_bytes(str.data(), str.size());
+    write_body(w, l, leaf::codec_type::json);
     std::vector<uint8_t> bytes;
     w.copy_to(&bytes);
     return bytes;
@@ -375,7 +539,7 @@ std::optional<leaf::login_request> deserialize_login_request(const std::vector<u
         return {};
     }
 
-    read_padding(r);
+    auto codec = read_padding(r);
     uint16_t type = 0;
     r.read_uint16(&type);
     if (type != leaf::to_underlying(message_type::login))
@@ -383,14 +547,8 @@ std::optional<leaf::login_request> deserialize_login_request(const std::vector<u
         return {};
     }
 
-    std::string str;
-    r.read_string(&str, r.size());
-    if (str.empty())
-    {
-        return {};
-    }
     leaf::login_request l;
-    if (!reflect::deserialize_struct(l, str))
+    if (!read_body(r, l, codec))
     {
         return {};
     }
@@ -402,8 +560,7 @@ std::vector<uint8_t> serialize_login_token(const leaf::login_token &l)
     leaf::write_buffer w;
     write_padding(w);
     w.write_uint16(leaf::to_underlying(message_type::login));
-    std::string str = reflect::serialize_struct(l);
-    w.write_bytes(str.data(), str.size());
+    write_body(w, l, leaf::codec_type::json);
     std::vector<uint8_t> bytes;
     w.copy_to(&bytes);
     return bytes;
@@ -417,7 +574,7 @@ std::optional<leaf::login_token> deserialize_login_token(const std::vector<uint8
         return {};
     }
 
-    read_padding(r);
+    auto codec = read_padding(r);
     uint16_t type = 0;
     r.read_uint16(&type);
     if (type != leaf::to_underlying(message_type::login))
@@ -425,27 +582,20 @@ std::optional<leaf::login_token> deserialize_login_token(const std::vector<uint8
         return {};
     }
 
-    std::string str;
-    r.read_string(&str, r.size());
-    if (str.empty())
-    {
-        return {};
-    }
     leaf::login_token l;
-    if (!reflect::deserialize_struct(l, str))
+    if (!read_body(r, l, codec))
     {
         return {};
     }
     return l;
 }
 
-std::vector<uint8_t> serialize_files_request(const leaf::files_request &f)
+std::vector<uint8_t> serialize_files_request(const leaf::files_request &f, leaf::codec_type codec)
 {
     leaf::write_buffer w;
-    write_padding(w);
+    write_padding(w, codec);
     w.write_uint16(leaf::to_underlying(message_type::files_request));
-    std::string str = reflect::serialize_struct(f);
-    w.write_bytes(str.data(), str.size());
+    write_body(w, f, codec);
     std::vector<uint8_t> bytes;
     w.copy_to(&bytes);
     return bytes;
@@ -458,34 +608,27 @@ std::optional<leaf::files_request> deserialize_files_request(const std::vector<u
     {
         return {};
     }
-    read_padding(r);
+    auto codec = read_padding(r);
     uint16_t type = 0;
     r.read_uint16(&type);
     if (type != leaf::to_underlying(message_type::files_request))
     {
         return {};
     }
-    std::string str;
-    r.read_string(&str, r.size());
-    if (str.empty())
-    {
-        return {};
-    }
     leaf::files_request f;
-    if (!reflect::deserialize_struct(f, str))
+    if (!read_body(r, f, codec))
     {
         return {};
     }
     return f;
 }
 
-std::vector<uint8_t> serialize_files_response(const leaf::files_response &f)
+std::vector<uint8_t> serialize_files_response(const leaf::files_response &f, leaf::codec_type codec)
 {
     leaf::write_buffer w;
-    write_padding(w);
+    write_padding(w, codec);
     w.write_uint16(leaf::to_underlying(message_type::files_response));
-    std::string str = reflect::serialize_struct(f);
-    w.write_bytes(str.data(), str.size());
+    write_body(w, f, codec);
     std::vector<uint8_t> bytes;
     w.copy_to(&bytes);
     return bytes;
@@ -498,21 +641,15 @@ std::optional<leaf::files_response> deserialize_files_response(const std::vector
     {
         return {};
     }
-    read_padding(r);
+    auto codec = read_padding(r);
     uint16_t type = 0;
     r.read_uint16(&type);
     if (type != leaf::to_underlying(message_type::files_response))
     {
         return {};
     }
-    std::string str;
-    r.read_string(&str, r.size());
-    if (str.empty())
-    {
-        return {};
-    }
     leaf::files_response f;
-    if (!reflect::deserialize_struct(f, str))
+    if (!read_body(r, f, codec))
     {
         return {};
     }
@@ -520,9 +657,21 @@ std::optional<leaf::files_response> deserialize_files_response(const std::vector
 }
 
 std::vector<uint8_t> serialize_file_data(const file_data &data)
+{
+    leaf::file_data_view view;
+    view.id = data.id;
+    view.hash = data.hash;
+    view.data = data.data;
+    auto bytes = serialize_file_data_header(view);
+    bytes.insert(bytes.end(), data.data.begin(), data.data.end());
+    return bytes;
+}
+
+// 只编码头部和 hash, 数据部分由调用方作为第二段缓冲区发送
+std::vector<uint8_t> serialize_file_data_header(const file_data_view &data)
 {
     leaf::write_buffer w;
-    write_padding(w);
+    write_padding(w, leaf::codec_type::json, data.id);
     w.write_uint16(leaf::to_underlying(message_type::file_data));
     uint32_t data_size = data.data.size();
     uint32_t hash_size = data.hash.size();
@@ -532,42 +681,70 @@ std::vector<uint8_t> serialize_file_data(const file_data &data)
     {
         w.write_bytes(data.hash.data(), hash_size);
     }
-    w.write_bytes(data.data);
     std::vector<uint8_t> bytes;
     w.copy_to(&bytes);
     return bytes;
 }
 
 std::optional<file_data> deserialize_file_data(const std::vector<uint8_t> &data)
+{
+    auto view = deserialize_file_data_view(data);
+    if (!view.has_value())
+    {
+        return {};
+    }
+    file_data fd;
+    fd.id = view->id;
+    fd.hash.assign(view->hash.begin(), view->hash.end());
+    fd.data.assign(view->data.begin(), view->data.end());
+    return fd;
+}
+
+static std::optional<leaf::file_data_view> read_file_data(leaf::read_buffer &r)
+{
+    uint32_t hash_size = 0;
+    uint32_t data_size = 0;
+    if (!r.read_uint32(&hash_size) || !r.read_uint32(&data_size))
+    {
+        return {};
+    }
+    if (static_cast<uint64_t>(hash_size) + data_size > r.size())
+    {
+        return {};
+    }
+    file_data_view fd;
+    fd.hash = std::span<const uint8_t>(reinterpret_cast<const uint8_t *>(r.data()), hash_size);
+    r.consume(hash_size);
+    fd.data = std::span<const uint8_t>(reinterpret_cast<const uint8_t *>(r.data()), data_size);
+    return fd;
+}
+
+std::optional<leaf::file_data_view> deserialize_file_data_view(std::span<const uint8_t> data)
 {
     leaf::read_buffer r(data.data(), data.size());
-    read_padding(r);
+    uint32_t id = 0;
+    read_padding(r, &id);
     uint16_t type = 0;
     r.read_uint16(&type);
     if (type != leaf::to_underlying(message_type::file_data))
     {
         return {};
     }
-    uint32_t hash_size = 0;
-    uint32_t data_size = 0;
-    r.read_uint32(&hash_size);
-    r.read_uint32(&data_size);
-    file_data fd;
-    if (hash_size > 0)
+    auto fd = read_file_data(r);
+    if (fd.has_value())
     {
-        fd.hash.assign(hash_size, 0);
-        r.read_bytes(fd.hash.data(), hash_size);
+        fd->id = id;
     }
-    fd.data.assign(data_size, 0);
-    r.read_bytes(fd.data.data(), data_size);
     return fd;
 }
 
-std::vector<uint8_t> serialize_ack(const ack & /*a*/)
+std::vector<uint8_t> serialize_ack(const ack &a)
 {
     leaf::write_buffer w;
-    write_padding(w);
+    write_padding(w, leaf::codec_type::json, a.id);
     w.write_uint16(leaf::to_underlying(message_type::ack));
+    // 旧版本只检查类型, 忽略后面的偏移
+    w.write_uint64(a.offset);
     std::vector<uint8_t> bytes;
     w.copy_to(&bytes);
     return bytes;
@@ -576,19 +753,20 @@ std::vector<uint8_t> serialize_ack(const ack & /*a*/)
 std::optional<leaf::ack> deserialize_ack(const std::vector<uint8_t> &data)
 {
     leaf::read_buffer r(data.data(), data.size());
-    read_padding(r);
+    uint32_t id = 0;
+    read_padding(r, &id);
     uint16_t type = 0;
     r.read_uint16(&type);
     if (type != leaf::to_underlying(message_type::ack))
     {
         return {};
     }
-    return leaf::ack{};
+    return read_ack(r, id);
 }
-std::vector<uint8_t> serialize_done(const done & /*d*/)
+std::vector<uint8_t> serialize_done(const done &d)
 {
     leaf::write_buffer w;
-    write_padding(w);
+    write_padding(w, leaf::codec_type::json, d.id);
     w.write_uint16(leaf::to_underlying(message_type::done));
     std::vector<uint8_t> bytes;
     w.copy_to(&bytes);
@@ -597,22 +775,22 @@ std::vector<uint8_t> serialize_done(const done & /*d*/)
 std::optional<leaf::done> deserialize_done(const std::vector<uint8_t> &data)
 {
     leaf::read_buffer r(data.data(), data.size());
-    read_padding(r);
+    uint32_t id = 0;
+    read_padding(r, &id);
     uint16_t type = 0;
     r.read_uint16(&type);
     if (type != leaf::to_underlying(message_type::done))
     {
         return {};
     }
-    return leaf::done{};
+    return leaf::done{id};
 }
-std::vector<uint8_t> serialize_create_dir(const create_dir &c)
+std::vector<uint8_t> serialize_create_dir(const create_dir &c, leaf::codec_type codec)
 {
     leaf::write_buffer w;
-    write_padding(w);
+    write_padding(w, codec);
     w.write_uint16(leaf::to_underlying(message_type::dir));
-    std::string str = reflect::serialize_struct(c);
-    w.write_bytes(str.data(), str.size());
+    write_body(w, c, codec);
     std::vector<uint8_t> bytes;
     w.copy_to(&bytes);
     return bytes;
@@ -620,33 +798,26 @@ std::vector<uint8_t> serialize_create_dir(const create_dir &c)
 std::optional<leaf::create_dir> deserialize_create_dir(const std::vector<uint8_t> &data)
 {
     leaf::read_buffer r(data.data(), data.size());
-    read_padding(r);
+    auto codec = read_padding(r);
     uint16_t type = 0;
     r.read_uint16(&type);
     if (type != leaf::to_underlying(message_type::dir))
     {
         return {};
     }
-    std::string str;
-    r.read_string(&str, r.size());
-    if (str.empty())
-    {
-        return {};
-    }
     leaf::create_dir c;
-    if (!reflect::deserialize_struct(c, str))
+    if (!read_body(r, c, codec))
     {
         return {};
     }
     return c;
 }
-std::vector<uint8_t> serialize_rename_request(const rename_request &r)
+std::vector<uint8_t> serialize_rename_request(const rename_request &r, leaf::codec_type codec)
 {
     leaf::write_buffer w;
-    write_padding(w);
+    write_padding(w, codec);
     w.write_uint16(leaf::to_underlying(message_type::rename));
-    std::string str = reflect::serialize_struct(r);
-    w.write_bytes(str.data(), str.size());
+    write_body(w, r, codec);
     std::vector<uint8_t> bytes;
     w.copy_to(&bytes);
     return bytes;
@@ -654,29 +825,56 @@ std::vector<uint8_t> serialize_rename_request(const rename_request &r)
 std::optional<leaf::rename_request> deserialize_rename_request(const std::vector<uint8_t> &data)
 {
     leaf::read_buffer r(data.data(), data.size());
-    read_padding(r);
+    auto codec = read_padding(r);
     uint16_t type = 0;
     r.read_uint16(&type);
     if (type != leaf::to_underlying(message_type::rename))
     {
         return {};
     }
-    std::string str;
-    r.read_string(&str, r.size());
-    if (str.empty())
-    {
-        return {};
-    }
     leaf::rename_request rq;
-    if (!reflect::deserialize_struct(rq, str))
+    if (!read_body(r, rq, codec))
     {
         return {};
     }
     return rq;
 }
 
-std::vector<uint8_t> serialize_rename_response(const rename_response &r) { return serialize_rename_request(r); }
+std::vector<uint8_t> serialize_rename_response(const rename_response &r, leaf::codec_type codec) { return serialize_rename_request(r, codec); }
 
 std::optional<leaf::rename_response> deserialize_rename_response(const std::vector<uint8_t> &data) { return deserialize_rename_request(data); }
 
+std::vector<uint8_t> serialize_chunk_offer(const chunk_offer &o, leaf::codec_type codec)
+{
+    leaf::write_buffer w;
+    write_padding(w, codec);
+    w.write_uint16(leaf::to_underlying(message_type::chunk_offer));
+    write_body(w, o, codec);
+    std::vector<uint8_t> bytes;
+    w.copy_to(&bytes);
+    return bytes;
+}
+
+std::vector<uint8_t> serialize_chunk_need(const chunk_need &n, leaf::codec_type codec)
+{
+    leaf::write_buffer w;
+    write_padding(w, codec);
+    w.write_uint16(leaf::to_underlying(message_type::chunk_need));
+    write_body(w, n, codec);
+    std::vector<uint8_t> bytes;
+    w.copy_to(&bytes);
+    return bytes;
+}
+
+std::vector<uint8_t> serialize_upload_batch_request(const upload_batch_request &b, leaf::codec_type codec)
+{
+    leaf::write_buffer w;
+    write_padding(w, codec);
+    w.write_uint16(leaf::to_underlying(message_type::upload_batch_request));
+    write_body(w, b, codec);
+    std::vector<uint8_t> bytes;
+    w.copy_to(&bytes);
+    return bytes;
+}
+
 }    // namespace leaf
@@ -1,6 +1,8 @@
 #ifndef LEAF_PROTOCOL_CODEC_H
 #define LEAF_PROTOCOL_CODEC_H
 
+#include <span>
+#include <variant>
 #include <optional>
 #include <cstdint>
 #include <string_view>
@@ -8,27 +10,70 @@
 
 namespace leaf
 {
+// decode 的结果, std::monostate 表示类型未知或解析失败
+// file_data_view 指向传入的缓冲区, 生命周期与缓冲区相同
+using message = std::variant<std::monostate,
+                             leaf::error_message,
+                             leaf::login_token,
+                             leaf::upload_file_request,
+                             leaf::upload_file_response,
+                             leaf::download_file_request,
+                             leaf::download_file_response,
+                             leaf::delete_file_request,
+                             leaf::keepalive,
+                             leaf::files_request,
+                             leaf::files_response,
+                             leaf::file_data_view,
+                             leaf::ack,
+                             leaf::done,
+                             leaf::create_dir,
+                             leaf::rename_request,
+                             leaf::chunk_offer,
+                             leaf::chunk_need,
+                             leaf::upload_batch_request>;
+
+// 用于 std::visit 的多个 lambda 组合
+template <typename... Ts>
+struct overloaded : Ts...
+{
+    using Ts::operator()...;
+};
+
+// 头部只解析一次, 按类型解码消息体
+leaf::message decode(std::span<const uint8_t> data);
+
 leaf::message_type get_message_type(const std::string &data);
 leaf::message_type get_message_type(std::string_view data);
 leaf::message_type get_message_type(const std::vector<uint8_t> &data);
+leaf::message_type get_message_type(std::span<const uint8_t> data);
 std::string message_type_to_string(leaf::message_type type);
-std::vector<uint8_t> serialize_keepalive(const leaf::keepalive &k);
-std::vector<uint8_t> serialize_error_message(const error_message &msg);
+leaf::codec_type negotiate_codec(uint32_t codec);
+// 本端支持的最优参数, 客户端 login 时携带
+leaf::transfer_options preferred_transfer_options();
+// 按对端 login_token 的能力协商, 服务端和客户端收到回复时都用它
+leaf::transfer_options negotiate_transfer_options(const leaf::login_token &peer);
+void set_transfer_options(leaf::login_token &l, const leaf::transfer_options &options);
+std::vector<uint8_t> serialize_keepalive(const leaf::keepalive &k, leaf::codec_type codec = leaf::codec_type::json);
+std::vector<uint8_t> serialize_error_message(const error_message &msg, leaf::codec_type codec = leaf::codec_type::json);
 std::vector<uint8_t> serialize_login_request(const leaf::login_request &l);
 std::vector<uint8_t> serialize_login_token(const leaf::login_token &l);
-std::vector<uint8_t> serialize_files_request(const leaf::files_request &f);
-std::vector<uint8_t> serialize_files_response(const leaf::files_response &f);
-std::vector<uint8_t> serialize_upload_file_request(const upload_file_request &msg);
-std::vector<uint8_t> serialize_upload_file_response(const upload_file_response &msg);
-std::vector<uint8_t> serialize_download_file_request(const download_file_request &msg);
-std::vector<uint8_t> serialize_download_file_response(const download_file_response &msg);
-std::vector<uint8_t> serialize_delete_file_request(const delete_file_request &msg);
+std::vector<uint8_t> serialize_files_request(const leaf::files_request &f, leaf::codec_type codec = leaf::codec_type::json);
+std::vector<uint8_t> serialize_files_response(const leaf::files_response &f, leaf::codec_type codec = leaf::codec_type::json);
+std::vector<uint8_t> serialize_upload_file_request(const upload_file_request &msg, leaf::codec_type codec = leaf::codec_type::json);
+std::vector<uint8_t> serialize_upload_file_response(const upload_file_response &msg, leaf::codec_type codec = leaf::codec_type::json);
+std::vector<uint8_t> serialize_download_file_request(const download_file_request &msg, leaf::codec_type codec = leaf::codec_type::json);
+std::vector<uint8_t> serialize_download_file_response(const download_file_response &msg, leaf::codec_type codec = leaf::codec_type::json);
+std::vector<uint8_t> serialize_delete_file_request(const delete_file_request &msg, leaf::codec_type codec = leaf::codec_type::json);
 std::vector<uint8_t> serialize_file_data(const file_data &data);
+std::vector<uint8_t> serialize_file_data_header(const file_data_view &data);
 std::vector<uint8_t> serialize_ack(const ack &a);
 std::vector<uint8_t> serialize_done(const done &d);
-std::vector<uint8_t> serialize_create_dir(const create_dir &c);
-std::vector<uint8_t> serialize_rename_request(const rename_request &r);
-std::vector<uint8_t> serialize_rename_response(const rename_response &r);
+std::vector<uint8_t> serialize_create_dir(const create_dir &c, leaf::codec_type codec = leaf::codec_type::json);
+std::vector<uint8_t> serialize_rename_request(const rename_request &r, leaf::codec_type codec = leaf::codec_type::json);
+std::vector<uint8_t> serialize_rename_response(const rename_response &r, leaf::codec_type codec = leaf::codec_type::json);
+std::vector<uint8_t> serialize_chunk_offer(const chunk_offer &o, leaf::codec_type codec = leaf::codec_type::json);
+std::vector<uint8_t> serialize_chunk_need(const chunk_need &n, leaf::codec_type codec = leaf::codec_type::json);
+std::vector<uint8_t> serialize_upload_batch_request(const upload_batch_request &b, leaf::codec_type codec = leaf::codec_type::json);
 
 std::optional<leaf::error_message> deserialize_error_message(const std::vector<uint8_t> &data);
 std::optional<leaf::upload_file_request> deserialize_upload_file_request(const std::vector<uint8_t> &data);
@@ -42,6 +87,7 @@ std::optional<leaf::login_token> deserialize_login_token(const std::vector<uint8
 std::optional<leaf::files_request> deserialize_files_request(const std::vector<uint8_t> &data);
 std::optional<leaf::files_response> deserialize_files_response(const std::vector<uint8_t> &data);
 std::optional<leaf::file_data> deserialize_file_data(const std::vector<uint8_t> &data);
+std::optional<leaf::file_data_view> deserialize_file_data_view(std::span<const uint8_t> data);
 std::optional<leaf::ack> deserialize_ack(const std::vector<uint8_t> &data);
 std::optional<leaf::done> deserialize_done(const std::vector<uint8_t> &data);
 std::optional<leaf::create_dir> deserialize_create_dir(const std::vector<uint8_t> &data);
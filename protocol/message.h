@@ -1,9 +1,12 @@
 #ifndef LEAF_PROTOCOL_MESSAGE_H
 #define LEAF_PROTOCOL_MESSAGE_H
 
+#include <span>
 #include <string>
 #include <vector>
 #include <cstdint>
+#include <string_view>
+#include "config/config.h"
 
 namespace leaf
 {
@@ -25,6 +28,31 @@ enum class message_type : uint8_t
     done = 13,
     dir = 14,
     rename = 15,
+    chunk_offer = 16,
+    chunk_need = 17,
+    upload_batch_request = 18,
+};
+
+enum class codec_type : uint8_t
+{
+    json = 0x00,
+    binary = 0x01,
+};
+
+enum class hash_type : uint8_t
+{
+    blake2b = 0x00,
+};
+
+enum class digest_type : uint8_t
+{
+    hex = 0x00,
+    raw = 0x01,
+};
+
+enum class compress_type : uint8_t
+{
+    none = 0x00,
 };
 
 struct create_dir
@@ -51,10 +79,32 @@ struct login_request
     std::string password;
 };
 
+// 客户端携带本端能力, 服务端回复协商结果, 旧版本不携带的字段为 0
 struct login_token
 {
     uint32_t id = 0;
     std::string token;
+    uint32_t codec = 0;              // 协商的消息体编码 codec_type
+    uint32_t version = 0;            // 协议版本
+    uint32_t block_size = 0;         // file_data 数据块大小
+    uint32_t hash_block_size = 0;    // 每多少字节发送一次块摘要
+    uint32_t hash = 0;               // 摘要算法 hash_type
+    uint32_t digest = 0;             // 摘要编码 digest_type
+    uint32_t compression = 0;        // 数据块压缩 compress_type
+    uint32_t window = 0;             // 未确认的摘要块数量上限
+};
+
+// login 协商后的传输参数, 默认值即旧版本的行为
+struct transfer_options
+{
+    uint32_t version = 0;
+    leaf::codec_type codec = leaf::codec_type::json;
+    uint32_t block_size = kBlockSize;
+    uint32_t hash_block_size = kHashBlockSize;
+    leaf::hash_type hash = leaf::hash_type::blake2b;
+    leaf::digest_type digest = leaf::digest_type::hex;
+    leaf::compress_type compression = leaf::compress_type::none;
+    uint32_t window = 1;
 };
 
 struct files_request
@@ -77,11 +127,15 @@ struct files_response
     std::string dir;
     std::vector<file_node> files;
 };
+// 流水线模式下携带传输 id 和已校验的累计偏移
 struct ack
 {
+    uint32_t id = 0;
+    uint64_t offset = 0;
 };
 struct done
 {
+    uint32_t id = 0;    // 流水线模式下的传输 id
 };
 // ------------------------------------------------------------------------------
 struct upload_file_request
@@ -90,17 +144,35 @@ struct upload_file_request
     uint64_t filesize = 0;
     std::string dir;
     std::string filename;
+    // 分段上传, length 为 0 表示整个文件
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    uint64_t range_id = 0;
+    bool resume = false;    // 客户端等待响应中的断点再发送数据
+    bool dedup = false;     // 去重上传, 数据按 chunk_offer/chunk_need 交换
+    std::string hash;       // 整个文件的 blake2b hex 摘要, 服务端已有相同文件时秒传
 };
 struct upload_file_response
 {
     uint32_t id = 0;
     std::string filename;
+    uint64_t offset = 0;    // 分段内已校验的字节数, 客户端从这里继续发送
+    bool instant = false;   // 秒传成功, 客户端不再发送数据, 服务端随后发送 done
 };
+// hash 为原始 blake2b 摘要, 旧版本对端发送的是 hex 字符串
 struct file_data
 {
-    std::string hash;
+    uint32_t id = 0;    // 流水线模式下的传输 id
+    std::vector<uint8_t> hash;
     std::vector<uint8_t> data;
 };
+// 指向接收缓冲区, 仅在缓冲区下一次读取前有效
+struct file_data_view
+{
+    uint32_t id = 0;
+    std::span<const uint8_t> hash;
+    std::span<const uint8_t> data;
+};
 struct error_message
 {
     uint32_t id = 0;
@@ -115,6 +187,29 @@ struct keepalive
     uint64_t server_timestamp = 0;    // 服务端时间
 };
 
+// 去重上传, 客户端按内容分块后先发送每个分块的大小和原始摘要
+struct chunk_offer
+{
+    uint32_t id = 0;
+    std::vector<uint32_t> sizes;
+    std::string hashes;    // 连续的 64 字节 blake2b 摘要, 与 sizes 一一对应
+};
+// 服务端缺少的分块在 chunk_offer 中的序号, 客户端按顺序以 file_data 发送
+struct chunk_need
+{
+    uint32_t id = 0;
+    std::vector<uint32_t> indexes;
+};
+// 小文件批量上传, 一个清单加上所有文件按顺序拼接的数据, 数据以 file_data 发送
+struct upload_batch_request
+{
+    uint32_t id = 0;
+    std::string dir;
+    std::vector<std::string> filenames;
+    std::vector<uint64_t> sizes;
+    std::string hashes;    // 每个文件连续的 64 字节 blake2b 摘要, 与 filenames 一一对应
+};
+
 struct download_file_request
 {
     uint32_t id = 0;
@@ -122,6 +217,7 @@ struct download_file_request
     std::string dir;
     std::string hash;
     std::string filename;    // 文件名称
+    uint64_t length = 0;     // 分段下载, 0 表示到文件末尾
 };
 
 struct download_file_response
@@ -1,8 +1,15 @@
+#include <iostream>
+#include <boost/program_options.hpp>
 #include "log/log.h"
 #include "net/socket.h"
 #include "net/tcp_server.h"
 #include "net/session_handle.h"
 #include "net/detect_session.h"
+#include "file/file.h"
+#include "file/file_io.h"
+#include "config/config.h"
+#include "file/block_cache.h"
+#include "file/group_commit.h"
 #include "server/application.h"
 #include "file/file_http_handle.h"
 
@@ -15,18 +22,13 @@ application::~application() = default;
 
 void application::startup()
 {
-    uint16_t listen_port = 8080;
-    if (argc_ > 1)
-    {
-        listen_port = std::atoi(argv_[1]);
-    }
-
-    LOG_INFO("listen port {}", listen_port);
-    endpoint_ = boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), listen_port);
+    LOG_INFO("listen port {}", listen_port_);
+    endpoint_ = boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), listen_port_);
 
     leaf::session_handle h2;
     h2.http_handle = leaf::http_handle;
     h2.ws_handle = leaf::websocket_handle;
+    h2.http_write_limit = http_write_limit_;
     leaf::tcp_server::handle h;
     h.accept = [this, h2](boost::asio::ip::tcp::socket socket)
     {
@@ -53,10 +55,78 @@ void application::startup()
     server_->startup();
 }
 
+std::optional<int> application::parse_command_line()
+{
+    std::string file_io;
+    bool durable = false;
+    uint64_t direct_io_mb = 0;
+    uint64_t block_cache_mb = kBlockCacheSize / kMB;
+    uint64_t http_write_limit_kb = 0;
+    boost::program_options::options_description desc("Allowed options");
+    // clang-format off
+    desc.add_options()("help,h", "Show help message")(
+        "port,p", boost::program_options::value<uint16_t>(&listen_port_)->default_value(8080), "Listen port")(
+        "file-io", boost::program_options::value<std::string>(&file_io)->default_value("thread_pool"), "File io backend: thread_pool or libuv")(
+        "sync", boost::program_options::bool_switch(&durable), "Wait for file data and directory to reach disk before an upload completes")(
+        "direct-io-mb", boost::program_options::value<uint64_t>(&direct_io_mb)->default_value(0), "Files of at least this size in MB bypass the page cache, 0 disables")(
+        "block-cache-mb", boost::program_options::value<uint64_t>(&block_cache_mb)->default_value(block_cache_mb), "Download block cache size in MB, 0 disables")(
+        "http-write-limit-kb", boost::program_options::value<uint64_t>(&http_write_limit_kb)->default_value(0), "HTTP response rate limit in KB/s, 0 disables");
+    // clang-format on
+    // 兼容只传端口的旧用法
+    boost::program_options::positional_options_description positional;
+    positional.add("port", 1);
+    boost::program_options::variables_map vm;
+    try
+    {
+        auto parsed = boost::program_options::command_line_parser(argc_, argv_).options(desc).positional(positional).run();
+        boost::program_options::store(parsed, vm);
+        boost::program_options::notify(vm);
+    }
+    catch (const boost::program_options::error& e)
+    {
+        std::cerr << e.what() << "\n" << desc << "\n";
+        return 1;
+    }
+    if (vm.contains("help"))
+    {
+        std::cerr << desc << "\n";
+        return 0;
+    }
+
+    leaf::set_file_io(file_io);
+    // 上传完成前等待数据和目录落盘
+    if (durable)
+    {
+        leaf::group_commit::instance().set_durable(true);
+        LOG_INFO("durable upload commit");
+    }
+    // 不小于该大小的文件使用 O_DIRECT, 0 时全部走页缓存
+    if (direct_io_mb != 0)
+    {
+        leaf::set_direct_io_size(direct_io_mb * kMB);
+        LOG_INFO("direct io size {} MB", direct_io_mb);
+    }
+    leaf::block_cache::instance().set_capacity(block_cache_mb * kMB);
+    LOG_INFO("block cache size {} MB", block_cache_mb);
+    // 限速时 HTTP 下载不使用 sendfile
+    http_write_limit_ = static_cast<std::size_t>(http_write_limit_kb * kKB);
+    if (http_write_limit_ != 0)
+    {
+        LOG_INFO("http write limit {} KB/s", http_write_limit_kb);
+    }
+    return {};
+}
+
 int application::exec()
 {
     leaf::init_log("cmd.log");
     leaf::set_log_level("trace");
+    auto code = parse_command_line();
+    if (code.has_value())
+    {
+        leaf::shutdown_log();
+        return *code;
+    }
     executors_ = new leaf::executors(4);
     executors_->startup();
     {
@@ -1,6 +1,7 @@
 #ifndef LEAF_SERVER_APPLICATION_H
 #define LEAF_SERVER_APPLICATION_H
 
+#include <optional>
 #include "net/tcp_server.h"
 
 namespace leaf
@@ -15,12 +16,16 @@ class application
     int exec();
 
    private:
+    // 解析命令行并应用设置, 返回退出码时不再启动
+    std::optional<int> parse_command_line();
     void startup();
     void shutdown();
 
    private:
     int argc_ = 0;
     char** argv_ = nullptr;
+    uint16_t listen_port_ = 8080;
+    std::size_t http_write_limit_ = 0;
     leaf::executors* executors_ = nullptr;
     boost::asio::ip::tcp::endpoint endpoint_;
     std::shared_ptr<leaf::tcp_server> server_;
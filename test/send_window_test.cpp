@@ -0,0 +1,71 @@
+#include <cstdio>
+#include <cstdlib>
+#include "file/send_window.h"
+
+#define CHECK(expr)                                                        \
+    do                                                                     \
+    {                                                                      \
+        if (!(expr))                                                       \
+        {                                                                  \
+            std::fprintf(stderr, "%s:%d %s\n", __FILE__, __LINE__, #expr); \
+            std::exit(1);                                                  \
+        }                                                                  \
+    } while (0)
+
+// 从头发送, 累计 ack 后未确认字节归零
+static void send_from_start()
+{
+    leaf::send_window w;
+    w.reset(1024, 4096);
+    w.on_start(1, 0);
+    w.on_send(1, 0, 512);
+    w.on_send(1, 512, 512);
+    CHECK(w.inflight() == 1024);
+    w.on_ack(1, 512);
+    CHECK(w.inflight() == 512);
+    w.on_ack(1, 1024);
+    CHECK(w.inflight() == 0);
+    CHECK(w.acked(1) == 1024);
+}
+
+// 续传从 skip 开始发送, 对端的 ack 包含 skip
+static void resume_at_offset()
+{
+    const uint64_t skip = 1 << 20;
+    leaf::send_window w;
+    w.reset(1024, 4096);
+    w.on_start(1, skip);
+    CHECK(w.inflight() == 0);
+    w.on_send(1, skip, 512);
+    w.on_send(1, skip + 512, 512);
+    CHECK(w.inflight() == 1024);
+    w.on_ack(1, skip + 512);
+    CHECK(w.inflight() == 512);
+    w.on_ack(1, skip + 1024);
+    CHECK(w.inflight() == 0);
+    CHECK(w.acked(1) == skip + 1024);
+    w.on_done(1);
+    CHECK(w.inflight() == 0);
+}
+
+// 重新开始同一个 id 时丢弃旧的未确认字节
+static void restart_stream()
+{
+    leaf::send_window w;
+    w.reset(1024, 4096);
+    w.on_start(1, 0);
+    w.on_send(1, 0, 512);
+    w.on_start(1, 256);
+    CHECK(w.inflight() == 0);
+    w.on_send(1, 256, 256);
+    w.on_ack(1, 512);
+    CHECK(w.inflight() == 0);
+}
+
+int main()
+{
+    send_from_start();
+    resume_at_offset();
+    restart_stream();
+    return 0;
+}